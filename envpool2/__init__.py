@@ -20,6 +20,10 @@ from envpool2.registration import (
   make_dm,
   make_gym,
   make_gymnasium,
+  make_remote,
+  make_remote_server,
+  make_shm_client,
+  make_shm_server,
   make_spec,
   register,
 )
@@ -32,5 +36,9 @@ __all__ = [
   "make_gym",
   "make_gymnasium",
   "make_spec",
+  "make_shm_server",
+  "make_shm_client",
+  "make_remote_server",
+  "make_remote",
   "list_all_envs",
 ]
@@ -21,8 +21,11 @@
 #define MOODYCAMEL_DELETE_FUNCTION = delete
 #endif
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <mutex>
 #include <utility>
 #include <vector>
 
@@ -30,7 +33,19 @@
 #include "concurrentqueue/lightweightsemaphore.h"
 
 /**
- * Lock-free action buffer queue.
+ * Order in which the workers take the queued actions.
+ *
+ * kFifo: in the order they were enqueued.
+ * kOldest: actions of older blocks (Send / Reset calls) first, so that a
+ * step resumed after Env::Suspend doesn't queue behind newer blocks.
+ * kCost: as kOldest, and within a block the actions with the highest expected
+ * cost first, so that the slowest envs of a block don't start last.
+ */
+enum class SchedulePolicy : uint8_t { kFifo, kOldest, kCost };
+
+/**
+ * Lock-free action buffer queue. The priority policies use a heap under a
+ * mutex instead.
  */
 class ActionBufferQueue {
  public:
@@ -38,6 +53,11 @@ class ActionBufferQueue {
     int env_id;
     int order;
     bool force_reset;
+    // continue the suspended step of the env, see Env::Suspend
+    bool resume;
+    // block of the action and its expected cost, see SchedulePolicy
+    uint64_t block;
+    float cost;
   };
 
  protected:
@@ -45,18 +65,60 @@ class ActionBufferQueue {
   std::size_t queue_size_;
   std::vector<ActionSlice> queue_;
   moodycamel::LightweightSemaphore sem_, sem_enqueue_, sem_dequeue_;
+  SchedulePolicy policy_;
+  // heap of the priority policies, with the enqueue position of each action
+  std::mutex heap_mu_;
+  std::vector<std::pair<uint64_t, ActionSlice>> heap_;
+
+  /**
+   * Whether `a` is to be taken after `b`, for the heap.
+   */
+  bool After(const std::pair<uint64_t, ActionSlice>& a,
+             const std::pair<uint64_t, ActionSlice>& b) const {
+    if (a.second.block != b.second.block) {
+      return a.second.block > b.second.block;
+    }
+    if (policy_ == SchedulePolicy::kCost && a.second.cost != b.second.cost) {
+      return a.second.cost < b.second.cost;
+    }
+    return a.first > b.first;
+  }
+
+  ActionSlice Pop() {
+    std::pop_heap(heap_.begin(), heap_.end(),
+                  [this](const auto& a, const auto& b) { return After(a, b); });
+    ActionSlice ret = heap_.back().second;
+    heap_.pop_back();
+    ++done_ptr_;
+    return ret;
+  }
 
  public:
-  explicit ActionBufferQueue(std::size_t num_envs)
+  explicit ActionBufferQueue(std::size_t num_envs,
+                             SchedulePolicy policy = SchedulePolicy::kFifo)
       : alloc_ptr_(0),
         done_ptr_(0),
         queue_size_(num_envs * 2),
-        queue_(queue_size_),
+        queue_(policy == SchedulePolicy::kFifo ? queue_size_ : 0),
         sem_(0),
         sem_enqueue_(1),
-        sem_dequeue_(1) {}
+        sem_dequeue_(1),
+        policy_(policy) {}
 
   void EnqueueBulk(const std::vector<ActionSlice>& action) {
+    if (policy_ != SchedulePolicy::kFifo) {
+      {
+        std::lock_guard<std::mutex> lock(heap_mu_);
+        for (const auto& slice : action) {
+          heap_.emplace_back(alloc_ptr_++, slice);
+          std::push_heap(
+              heap_.begin(), heap_.end(),
+              [this](const auto& a, const auto& b) { return After(a, b); });
+        }
+      }
+      sem_.signal(action.size());
+      return;
+    }
     // ensure only one enqueue_bulk happens at any time
     while (!sem_enqueue_.wait()) {
     }
@@ -71,6 +133,10 @@ class ActionBufferQueue {
   ActionSlice Dequeue() {
     while (!sem_.wait()) {
     }
+    if (policy_ != SchedulePolicy::kFifo) {
+      std::lock_guard<std::mutex> lock(heap_mu_);
+      return Pop();
+    }
     while (!sem_dequeue_.wait()) {
     }
     auto ptr = done_ptr_.fetch_add(1);
@@ -79,6 +145,31 @@ class ActionBufferQueue {
     return ret;
   }
 
+  /**
+   * Wait for at least one action and take up to `max` of the queued ones into
+   * `out`. Returns the number taken.
+   */
+  std::size_t DequeueBulk(ActionSlice* out, std::size_t max) {
+    std::size_t n;
+    while ((n = sem_.waitMany(static_cast<ssize_t>(max))) == 0) {
+    }
+    if (policy_ != SchedulePolicy::kFifo) {
+      std::lock_guard<std::mutex> lock(heap_mu_);
+      for (std::size_t i = 0; i < n; ++i) {
+        out[i] = Pop();
+      }
+      return n;
+    }
+    while (!sem_dequeue_.wait()) {
+    }
+    auto ptr = done_ptr_.fetch_add(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = queue_[(ptr + i) % queue_size_];
+    }
+    sem_dequeue_.signal(1);
+    return n;
+  }
+
   std::size_t SizeApprox() {
     return static_cast<std::size_t>(alloc_ptr_ - done_ptr_);
   }
@@ -19,9 +19,13 @@
 
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -195,6 +199,51 @@ class Array {
 
   void Zero() const { std::memset(ptr_.get(), 0, size * element_size); }
   [[nodiscard]] std::shared_ptr<char> SharedPtr() const { return ptr_; }
+
+  /**
+   * Return an Array of the same memory that also keeps `owner` alive.
+   */
+  [[nodiscard]] Array KeepAlive(std::shared_ptr<void> owner) const {
+    auto holder = std::make_shared<std::pair<std::shared_ptr<char>,
+                                             std::shared_ptr<void>>>(
+        ptr_, std::move(owner));
+    return {std::shared_ptr<char>(holder, ptr_.get()), shape_, element_size};
+  }
+};
+
+/**
+ * Memory of the ragged fields of a state buffer. Envs append to it from their
+ * own threads, it grows by chunks and releases them all at once.
+ */
+class RaggedArena {
+ protected:
+  static constexpr std::size_t kMinChunk = 1 << 16;
+  std::mutex mu_;
+  std::vector<std::unique_ptr<char[]>> chunks_;  // NOLINT
+  std::size_t used_{0}, capacity_{0};
+
+ public:
+  /**
+   * Zero-filled memory of `bytes`, aligned to 16 bytes.
+   */
+  char* Allocate(std::size_t bytes) {
+    bytes = (bytes + 15) & ~static_cast<std::size_t>(15);
+    std::lock_guard<std::mutex> lock(mu_);
+    if (used_ + bytes > capacity_) {
+      capacity_ = std::max({bytes, capacity_ * 2, kMinChunk});
+      chunks_.emplace_back(new char[capacity_]);  // NOLINT
+      used_ = 0;
+    }
+    char* ptr = chunks_.back().get() + used_;
+    used_ += bytes;
+    std::memset(ptr, 0, bytes);
+    return ptr;
+  }
+
+  [[nodiscard]] bool Empty() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return chunks_.empty();
+  }
 };
 
 template <typename Dtype>
@@ -273,6 +322,52 @@ class TArray : public Array {
     std::memcpy(ptr_.get(), buff, sz * sizeof(Dtype));
   }
 
+  /**
+   * Flag `i` of a `TArray<PackedBits>`, see `Spec<PackedBits>`.
+   */
+  template <typename D = Dtype,
+            std::enable_if_t<std::is_same_v<D, PackedBits>, bool> = true>
+  [[nodiscard]] bool Bit(std::size_t i) const {
+    return (Bytes()[i / 8] >> (i % 8)) & 1;
+  }
+
+  template <typename D = Dtype,
+            std::enable_if_t<std::is_same_v<D, PackedBits>, bool> = true>
+  void SetBit(std::size_t i, bool value) const {
+    uint8_t mask = 1 << (i % 8);
+    Bytes()[i / 8] = value ? Bytes()[i / 8] | mask : Bytes()[i / 8] & ~mask;
+  }
+
+  /**
+   * Set the first `n` flags of a `TArray<PackedBits>` and clear the rest.
+   */
+  template <typename D = Dtype,
+            std::enable_if_t<std::is_same_v<D, PackedBits>, bool> = true>
+  void SetFirstBits(std::size_t n) const {
+    for (std::size_t i = 0; i < size; ++i) {
+      std::size_t k = std::min<std::size_t>(n - std::min(n, i * 8), 8);
+      Bytes()[i] = static_cast<uint8_t>((1U << k) - 1);
+    }
+  }
+
+  /**
+   * Give this slot of a ragged field the rows of `spec`, allocated in the
+   * arena of the state buffer, and return them for writing.
+   */
+  template <typename D = Dtype,
+            std::enable_if_t<IsRagged<D>::value, bool> = true>
+  TArray<typename D::value_type> Emplace(
+      const Spec<typename D::value_type>& spec) const {
+    auto* slot = reinterpret_cast<D*>(ptr_.get());
+    DCHECK(slot->arena != nullptr) << " ragged slot outside of a state buffer";
+    auto shape = spec.Shape();
+    char* data = slot->arena->Allocate(Prod(shape.data(), shape.size()) *
+                                       spec.element_size);
+    slot->data = reinterpret_cast<typename D::value_type*>(data);
+    slot->length = spec.shape.empty() ? 1 : spec.shape[0];
+    return TArray<typename D::value_type>(Array(spec, data));
+  }
+
   operator Dtype&() const {  // NOLINT
     return *reinterpret_cast<Dtype*>(ptr_.get());
   }
@@ -299,6 +394,11 @@ class TArray : public Array {
     TArray ret(ptr_, std::move(new_shape), element_size);
     return ret;
   }
+
+ private:
+  [[nodiscard]] uint8_t* Bytes() const {
+    return reinterpret_cast<uint8_t*>(ptr_.get());
+  }
 };
 
 #endif  // ENVPOOL_CORE_ARRAY_H_
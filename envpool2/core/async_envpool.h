@@ -19,8 +19,14 @@
 
 #include <algorithm>
 #include <atomic>
+#include <deque>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -28,6 +34,8 @@
 #include "envpool2/core/action_buffer_queue.h"
 #include "envpool2/core/array.h"
 #include "envpool2/core/envpool.h"
+#include "envpool2/core/numa.h"
+#include "envpool2/core/page_arena.h"
 #include "envpool2/core/state_buffer_queue.h"
 /**
  * Async EnvPool
@@ -45,38 +53,553 @@ class AsyncEnvPool : public EnvPool<typename Env::Spec> {
   std::size_t max_num_players_;
   std::size_t num_threads_;
   bool is_sync_;
+  // in async mode, place states by the order their actions were sent
+  bool is_deterministic_;
+  std::size_t next_order_{0};
   std::atomic<int> stop_;
   std::atomic<std::size_t> stepping_env_num_;
+  // rows sent whose states have not been taken from the state queue, and the
+  // batches drained from the queue by Resize, which Recv returns first
+  std::atomic<std::size_t> in_flight_{0};
+  std::deque<std::pair<std::vector<Array>, std::size_t>> drained_;
+  // resume hooks being run, which Resize waits for
+  std::atomic<int> running_hooks_{0};
+  std::size_t partition_offset_{0};
   std::vector<std::thread> workers_;
-  std::unique_ptr<ActionBufferQueue> action_buffer_queue_;
+  // NUMA policy: -1, MPOL_PREFERRED ("node") or MPOL_INTERLEAVE
+  int numa_mode_;
+  NumaTopology numa_;
+  bool huge_pages_;
+  // envs are split into contiguous groups, each with its own action queue
+  // and workers; with a NUMA policy there is one group per node
+  std::vector<std::unique_ptr<ActionBufferQueue>> action_buffer_queues_;
+  std::vector<std::size_t> group_node_, group_threads_;
+  std::vector<std::size_t> env_group_;
   std::unique_ptr<StateBufferQueue> state_buffer_queue_;
+  // extra state queues and the queue each env writes its states to
+  std::vector<std::unique_ptr<StateBufferQueue>> group_queues_;
+  std::vector<StateBufferQueue*> env_queue_;
+  // with lazy_init, an env is constructed by the worker of its first reset
+  std::shared_ptr<const typename Env::Spec> shared_spec_;
+  bool lazy_init_;
   std::vector<std::unique_ptr<Env>> envs_;
   std::vector<std::atomic<int>> stepping_env_;
-  std::chrono::duration<double> dur_send_, dur_recv_, dur_send_all_;
+  // each Send / Reset is one block of actions, see SchedulePolicy; the block
+  // of the last action of each env, and the EWMA of its step time in seconds
+  SchedulePolicy schedule_policy_;
+  std::atomic<uint64_t> next_block_{1};
+  std::vector<uint64_t> env_block_;
+  std::vector<std::atomic<float>> step_cost_;
+  // scratch for grouping player rows by env id, see GroupPlayers
+  std::vector<int> player_count_, player_first_, player_last_;
+  std::chrono::duration<double> dur_recv_;
 
   template <typename V>
   void SendImpl(V&& action) {
     int* env_id = static_cast<int*>(action[0].Data());
     int shared_offset = action[0].Shape(0);
+    // reject bad ids before any env or order slot is touched
+    for (int i = 0; i < shared_offset; ++i) {
+      int eid = env_id[i];
+      if (eid < 0) {
+        throw std::invalid_argument("invalid env id " + std::to_string(eid));
+      }
+      if (eid < static_cast<int>(num_envs_) && lazy_init_ &&
+          envs_[eid] == nullptr) {
+        throw std::runtime_error("env " + std::to_string(eid) +
+                                 " is stepped before its first reset");
+      }
+    }
     std::vector<ActionSlice> actions;
     std::shared_ptr<std::vector<Array>> action_batch =
         std::make_shared<std::vector<Array>>(std::forward<V>(action));
+    std::shared_ptr<const std::vector<int>> player_index;
+    if (max_num_players_ > 1) {
+      player_index = GroupPlayers(env_id, shared_offset, (*action_batch)[1]);
+    }
+    uint64_t block = next_block_.fetch_add(1, std::memory_order_relaxed);
+    // in sync mode the states are placed in the order of the actions, after
+    // those of the actions sent since the last Recv
+    int row = static_cast<int>(stepping_env_num_);
     for (int i = 0; i < shared_offset; ++i) {
       int eid = env_id[i];
-      envs_[eid]->SetAction(action_batch, i);
+      if (eid >= static_cast<int>(num_envs_)) {
+        // removed by Resize
+        continue;
+      }
+      env_block_[eid] = block;
+      if (max_num_players_ > 1) {
+        envs_[eid]->SetAction(action_batch, i, player_first_[eid],
+                              player_count_[eid], player_index);
+      } else {
+        envs_[eid]->SetAction(action_batch, i);
+      }
       actions.emplace_back(ActionSlice{
           .env_id = eid,
-          .order = is_sync_ ? i : -1,
+          .order = is_sync_ ? row++ : NextOrder(),
           .force_reset = false,
+          .resume = false,
+          .block = block,
+          .cost = step_cost_[eid].load(std::memory_order_relaxed),
       });
     }
     if (is_sync_) {
-      stepping_env_num_ += shared_offset;
+      stepping_env_num_ += actions.size();
     }
+    in_flight_ += actions.size();
     // add to abq
-    auto start = std::chrono::system_clock::now();
-    action_buffer_queue_->EnqueueBulk(actions);
-    dur_send_ += std::chrono::system_clock::now() - start;
+    Enqueue(actions);
+  }
+
+  /**
+   * Hand each action to the queue of its env's group.
+   */
+  void Enqueue(const std::vector<ActionBufferQueue::ActionSlice>& actions) {
+    if (action_buffer_queues_.size() == 1) {
+      action_buffer_queues_[0]->EnqueueBulk(actions);
+      return;
+    }
+    std::vector<std::vector<ActionBufferQueue::ActionSlice>> grouped(
+        action_buffer_queues_.size());
+    for (const auto& a : actions) {
+      grouped[env_group_[a.env_id]].push_back(a);
+    }
+    for (std::size_t g = 0; g < grouped.size(); ++g) {
+      if (!grouped[g].empty()) {
+        action_buffer_queues_[g]->EnqueueBulk(grouped[g]);
+      }
+    }
+  }
+
+  /**
+   * Worker loop for env types with `kMaxStepBatch > 1`: take up to that many
+   * actions at once, reset the envs that need it one by one, and step the
+   * others with a single `Env::StepBatch` call.
+   */
+  void BatchWorker(ActionBufferQueue* queue) {
+    std::vector<ActionSlice> slices(Env::kMaxStepBatch);
+    std::vector<Env*> envs;
+    std::vector<Action> actions;
+    std::vector<int> env_ids;
+    envs.reserve(Env::kMaxStepBatch);
+    actions.reserve(Env::kMaxStepBatch);
+    env_ids.reserve(Env::kMaxStepBatch);
+    for (;;) {
+      std::size_t n = queue->DequeueBulk(slices.data(), slices.size());
+      if (stop_ == 1) {
+        // every worker has to see one of the stop actions, so pass on the
+        // others taken along with it
+        if (n > 1) {
+          queue->EnqueueBulk(std::vector<ActionSlice>(n - 1, StopSlice()));
+        }
+        break;
+      }
+      std::size_t num_stops = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        int env_id = slices[i].env_id;
+        if (env_id < 0) {
+          ++num_stops;
+          continue;
+        }
+        Env* env = GetEnv(env_id);
+        if (slices[i].resume) {
+          TimedStep(env_id, [env] { env->EnvResume(); });
+        } else if (slices[i].force_reset || env->IsDone()) {
+          env->EnvStep(env_queue_[env_id], slices[i].order, true);
+        } else {
+          actions.emplace_back(
+              env->BeginStep(env_queue_[env_id], slices[i].order));
+          envs.push_back(env);
+          env_ids.push_back(env_id);
+        }
+      }
+      if (!envs.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        Env::StepBatch(envs.data(), actions.data(), envs.size());
+        for (Env* env : envs) {
+          env->EndStep();
+        }
+        if (schedule_policy_ == SchedulePolicy::kCost) {
+          std::chrono::duration<float> elapsed =
+              std::chrono::steady_clock::now() - start;
+          for (int env_id : env_ids) {
+            RecordCost(env_id, elapsed.count() / env_ids.size());
+          }
+        }
+        envs.clear();
+        actions.clear();
+        env_ids.clear();
+      }
+      if (num_stops > 0) {
+        if (num_stops > 1) {
+          queue->EnqueueBulk(std::vector<ActionSlice>(
+              num_stops - 1, StopSlice()));
+        }
+        break;
+      }
+    }
+  }
+
+  /**
+   * Action that ends the worker taking it after the actions queued before it,
+   * see Resize. It has the last block, so every schedule policy takes it
+   * last. The destructor sends these too, but also sets `stop_` so that the
+   * workers quit on their next action, whatever its block.
+   */
+  static ActionBufferQueue::ActionSlice StopSlice() {
+    // the last block, so that the priority policies also take it last
+    return ActionBufferQueue::ActionSlice{
+        .env_id = -1,
+        .order = 0,
+        .force_reset = false,
+        .resume = false,
+        .block = std::numeric_limits<uint64_t>::max(),
+        .cost = 0};
+  }
+
+  /**
+   * Construct the envs [begin, end) unless they are built lazily. With a NUMA
+   * policy, each env is constructed (and first touches its memory) on its own
+   * node; lazily constructed envs are built by the workers, which already run
+   * there.
+   */
+  void MakeEnvs(std::size_t begin, std::size_t end) {
+    if (lazy_init_ || begin == end) {
+      return;
+    }
+    std::size_t processor_count = std::thread::hardware_concurrency();
+    ThreadPool init_pool(std::min(processor_count, end - begin));
+    std::vector<std::future<void>> result;
+    for (std::size_t i = begin; i < end; ++i) {
+      result.emplace_back(init_pool.enqueue([i, this] {
+        if (const auto* cpus = EnvCpus(i)) {
+          PinThread(pthread_self(), *cpus);
+        }
+        MakeEnv(i);
+      }));
+    }
+    for (auto& f : result) {
+      f.get();
+    }
+  }
+
+  /**
+   * Start the workers of each group, pinned as the config asks.
+   */
+  void StartWorkers() {
+    for (std::size_t g = 0; g < group_threads_.size(); ++g) {
+      ActionBufferQueue* queue = action_buffer_queues_[g].get();
+      for (std::size_t i = 0; i < group_threads_[g]; ++i) {
+        if (Env::kMaxStepBatch > 1) {
+          workers_.emplace_back([this, queue] { BatchWorker(queue); });
+          continue;
+        }
+        workers_.emplace_back([this, queue] {
+          for (;;) {
+            ActionSlice raw_action = queue->Dequeue();
+            if (stop_ == 1 || raw_action.env_id < 0) {
+              break;
+            }
+            int env_id = raw_action.env_id;
+            Env* env = GetEnv(env_id);
+            if (raw_action.resume) {
+              TimedStep(env_id, [env] { env->EnvResume(); });
+              continue;
+            }
+            int order = raw_action.order;
+            bool reset = raw_action.force_reset || env->IsDone();
+            if (reset) {
+              env->EnvStep(env_queue_[env_id], order, true);
+            } else {
+              TimedStep(env_id, [&] {
+                env->EnvStep(env_queue_[env_id], order, false);
+              });
+            }
+          }
+        });
+      }
+    }
+    std::size_t processor_count = std::thread::hardware_concurrency();
+    int thread_affinity_offset = this->spec.config["thread_affinity_offset"_];
+    std::size_t tid = 0;
+    for (std::size_t g = 0; g < group_threads_.size(); ++g) {
+      for (std::size_t i = 0; i < group_threads_[g]; ++i, ++tid) {
+        pthread_t thread = workers_[tid].native_handle();
+        if (numa_mode_ >= 0) {
+          // workers stay on their node, on one core of it if requested
+          const auto& cpus = numa_.nodes[group_node_[g]].cpus;
+          if (thread_affinity_offset >= 0) {
+            std::size_t cid = (thread_affinity_offset + i) % cpus.size();
+            PinThread(thread, {cpus[cid]});
+          } else {
+            PinThread(thread, cpus);
+          }
+        } else if (thread_affinity_offset >= 0) {
+          PinThread(thread, {static_cast<int>((thread_affinity_offset + tid) %
+                                              processor_count)});
+        }
+      }
+    }
+  }
+
+  /**
+   * Construct env `env_id` on the calling thread.
+   */
+  void MakeEnv(std::size_t i) {
+    if constexpr (std::is_constructible_v<Env, std::shared_ptr<const Spec>,
+                                          int>) {
+      envs_[i].reset(new Env(shared_spec_, i));
+    } else {
+      envs_[i].reset(new Env(*shared_spec_, i));
+    }
+    envs_[i]->SetResumeHook([this, i] {
+      ++running_hooks_;
+      Enqueue({ActionSlice{
+          .env_id = static_cast<int>(i),
+          .order = 0,
+          .force_reset = false,
+          .resume = true,
+          .block = env_block_[i],
+          .cost = step_cost_[i].load(std::memory_order_relaxed)}});
+      --running_hooks_;
+    });
+  }
+
+  Env* GetEnv(int env_id) {
+    if (lazy_init_ && envs_[env_id] == nullptr) {
+      MakeEnv(env_id);
+    }
+    return envs_[env_id].get();
+  }
+
+  /**
+   * Run `step` of env `env_id`, and with the cost policy fold its duration
+   * into the env's expected cost.
+   */
+  template <typename F>
+  void TimedStep(int env_id, const F& step) {
+    if (schedule_policy_ != SchedulePolicy::kCost) {
+      step();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    step();
+    std::chrono::duration<float> elapsed =
+        std::chrono::steady_clock::now() - start;
+    RecordCost(env_id, elapsed.count());
+  }
+
+  void RecordCost(int env_id, float seconds) {
+    constexpr float kAlpha = 0.25F;
+    auto& cost = step_cost_[env_id];
+    float old = cost.load(std::memory_order_relaxed);
+    cost.store(old == 0 ? seconds : old + kAlpha * (seconds - old),
+               std::memory_order_relaxed);
+  }
+
+  static SchedulePolicy ParseSchedulePolicy(const std::string& policy) {
+    if (policy == "oldest") {
+      return SchedulePolicy::kOldest;
+    }
+    if (policy == "cost") {
+      return SchedulePolicy::kCost;
+    }
+    return SchedulePolicy::kFifo;
+  }
+
+  static int NumaMode(const std::string& policy) {
+    if (policy == "node") {
+      return MPOL_PREFERRED;
+    }
+    if (policy == "interleave") {
+      return MPOL_INTERLEAVE;
+    }
+    return -1;
+  }
+
+  /**
+   * Split `total` into parts proportional to `weights`.
+   */
+  static std::vector<std::size_t> Split(
+      std::size_t total, const std::vector<std::size_t>& weights) {
+    std::size_t sum = std::accumulate(weights.begin(), weights.end(),
+                                      static_cast<std::size_t>(0));
+    std::vector<std::size_t> parts;
+    std::size_t acc = 0;
+    std::size_t prev = 0;
+    for (std::size_t w : weights) {
+      acc += w;
+      std::size_t end = total * acc / sum;
+      parts.push_back(end - prev);
+      prev = end;
+    }
+    return parts;
+  }
+
+  /**
+   * Split the envs and the worker threads into groups. With a NUMA policy
+   * every node gets a contiguous range of envs proportional to its usable
+   * CPUs, and its share of the threads; nodes left without envs get no group.
+   */
+  void MakeGroups() {
+    std::vector<std::size_t> weights{1};
+    if (numa_mode_ >= 0) {
+      weights.clear();
+      for (const auto& node : numa_.nodes) {
+        weights.push_back(node.cpus.size());
+      }
+    }
+    auto env_count = Split(num_envs_, weights);
+    auto thread_count = Split(num_threads_, env_count);
+    num_threads_ = 0;
+    for (std::size_t n = 0; n < weights.size(); ++n) {
+      if (env_count[n] == 0) {
+        continue;
+      }
+      std::size_t threads = std::max<std::size_t>(thread_count[n], 1);
+      env_group_.insert(env_group_.end(), env_count[n], group_node_.size());
+      group_node_.push_back(n);
+      group_threads_.push_back(threads);
+      action_buffer_queues_.emplace_back(new ActionBufferQueue(
+          std::max(env_count[n], threads), schedule_policy_));
+      num_threads_ += threads;
+    }
+  }
+
+  /**
+   * CPUs of the node that owns env `env_id`, or nullptr without NUMA policy.
+   */
+  const std::vector<int>* EnvCpus(std::size_t env_id) const {
+    if (numa_mode_ < 0) {
+      return nullptr;
+    }
+    return &numa_.nodes[group_node_[env_group_[env_id]]].cpus;
+  }
+
+  /**
+   * Allocator of the state buffers written by the envs [begin, end): the heap,
+   * or a PageArena when huge pages or a NUMA policy are requested. "node"
+   * places the buffers on the node of these envs, or on the node of the
+   * calling thread (which receives them) if they span several nodes;
+   * "interleave" spreads the pages over the nodes of these envs.
+   */
+  StateBuffer::Allocator StateAllocator(std::size_t begin, std::size_t end) {
+    if (numa_mode_ < 0 && !huge_pages_) {
+      return nullptr;
+    }
+    PageArena::Prepare prepare;
+    if (numa_mode_ >= 0) {
+      prepare = NumaPrepare(begin, end);
+    }
+    auto arena = std::make_shared<PageArena>(huge_pages_, std::move(prepare));
+    return [arena](const std::vector<ShapeSpec>& specs) {
+      return arena->Allocate(specs);
+    };
+  }
+
+  PageArena::Prepare NumaPrepare(std::size_t begin, std::size_t end) {
+    std::vector<int> node_ids;
+    for (std::size_t i = begin; i < end; ++i) {
+      int id = numa_.nodes[group_node_[env_group_[i]]].id;
+      if (node_ids.empty() || node_ids.back() != id) {
+        node_ids.push_back(id);
+      }
+    }
+    if (numa_mode_ == MPOL_PREFERRED && node_ids.size() > 1) {
+      node_ids = {numa_.nodes[numa_.CurrentNode()].id};
+    }
+    int mode = numa_mode_;
+    return [mode, node_ids](void* addr, std::size_t bytes) {
+      NumaBind(addr, bytes, mode, node_ids);
+    };
+  }
+
+  /**
+   * Position of the next state in the state queue in deterministic mode, or -1
+   * to let the env take the first free row. In deterministic mode the k-th
+   * action sent (counting resets) produces the k-th state received, so the
+   * batches only depend on the actions and not on the finishing order of the
+   * envs. A batch then waits for its slowest env, but the other envs keep
+   * running ahead into the following batches, up to `Window()` states.
+   */
+  int NextOrder() {
+    if (!is_deterministic_) {
+      return -1;
+    }
+    int order = static_cast<int>(next_order_);
+    next_order_ = (next_order_ + 1) % state_buffer_queue_->Window();
+    return order;
+  }
+
+  /**
+   * Counting sort of the player rows by `players.env_id`, so that each env
+   * finds its rows in O(1) instead of scanning the whole batch. Afterwards
+   * env `eid` owns `player_count_[eid]` rows starting at `player_first_[eid]`.
+   * If every env's rows are already contiguous in the batch (the common case)
+   * these are batch row indices and nullptr is returned; otherwise they index
+   * into the returned permutation of batch rows.
+   */
+  std::shared_ptr<const std::vector<int>> GroupPlayers(const int* env_id,
+                                                       int shared_offset,
+                                                       const Array& players) {
+    const int* player_env_id = static_cast<const int*>(players.Data());
+    int player_offset = players.Shape(0);
+    // the ids come from the caller, rows of unknown envs belong to no env
+    auto known = [this](int eid) {
+      return static_cast<std::size_t>(eid) < num_envs_;
+    };
+    for (int p = 0; p < player_offset; ++p) {
+      if (known(player_env_id[p])) {
+        player_count_[player_env_id[p]] = 0;
+      }
+    }
+    for (int i = 0; i < shared_offset; ++i) {
+      if (known(env_id[i])) {
+        player_count_[env_id[i]] = player_first_[env_id[i]] = 0;
+      }
+    }
+    bool contiguous = true;
+    for (int p = 0; p < player_offset; ++p) {
+      int eid = player_env_id[p];
+      if (!known(eid)) {
+        continue;
+      }
+      if (player_count_[eid]++ == 0) {
+        player_first_[eid] = p;
+      } else if (player_last_[eid] != p - 1) {
+        contiguous = false;
+      }
+      player_last_[eid] = p;
+    }
+    if (contiguous) {
+      return nullptr;
+    }
+    // rows of envs outside this batch are left out, as before
+    auto index = std::make_shared<std::vector<int>>(player_offset);
+    for (int p = 0; p < player_offset; ++p) {
+      if (known(player_env_id[p])) {
+        player_last_[player_env_id[p]] = -1;
+      }
+    }
+    int offset = 0;
+    for (int i = 0; i < shared_offset; ++i) {
+      int eid = env_id[i];
+      if (!known(eid)) {
+        continue;
+      }
+      player_first_[eid] = player_last_[eid] = offset;
+      offset += player_count_[eid];
+    }
+    for (int p = 0; p < player_offset; ++p) {
+      if (!known(player_env_id[p])) {
+        continue;
+      }
+      int& pos = player_last_[player_env_id[p]];
+      if (pos >= 0) {
+        (*index)[pos++] = p;
+      }
+    }
+    return index;
   }
 
  public:
@@ -84,6 +607,8 @@ class AsyncEnvPool : public EnvPool<typename Env::Spec> {
   using Action = typename Env::Action;
   using State = typename Env::State;
   using ActionSlice = typename ActionBufferQueue::ActionSlice;
+  static_assert(AllRelocatable<typename Spec::StateSpec::Values>::value,
+                "state values must be relocatable, see StateBuffer::Wait");
 
   explicit AsyncEnvPool(const Spec& spec)
       : EnvPool<Spec>(spec),
@@ -93,66 +618,73 @@ class AsyncEnvPool : public EnvPool<typename Env::Spec> {
         max_num_players_(spec.config["max_num_players"_]),
         num_threads_(spec.config["num_threads"_]),
         is_sync_(batch_ == num_envs_ && max_num_players_ == 1),
+        is_deterministic_(spec.config["deterministic"_] && !is_sync_),
         stop_(0),
         stepping_env_num_(0),
-        action_buffer_queue_(new ActionBufferQueue(num_envs_)),
-        state_buffer_queue_(new StateBufferQueue(
-            batch_, num_envs_, max_num_players_,
-            spec.state_spec.template AllValues<ShapeSpec>())),
-        envs_(num_envs_) {
-    std::size_t processor_count = std::thread::hardware_concurrency();
-    ThreadPool init_pool(std::min(processor_count, num_envs_));
-    std::vector<std::future<void>> result;
-    for (std::size_t i = 0; i < num_envs_; ++i) {
-      result.emplace_back(init_pool.enqueue(
-          [i, spec, this] { envs_[i].reset(new Env(spec, i)); }));
-    }
-    for (auto& f : result) {
-      f.get();
+        numa_mode_(NumaMode(spec.config["numa_policy"_])),
+        numa_(numa_mode_ < 0 ? NumaTopology() : NumaTopology::Detect()),
+        huge_pages_(spec.config["huge_pages"_]),
+        shared_spec_(std::make_shared<const Spec>(spec)),
+        lazy_init_(spec.config["lazy_init"_]),
+        envs_(num_envs_),
+        schedule_policy_(ParseSchedulePolicy(spec.config["schedule_policy"_])),
+        env_block_(num_envs_),
+        step_cost_(num_envs_) {
+    if (max_num_players_ > 1) {
+      player_count_.resize(num_envs_);
+      player_first_.resize(num_envs_);
+      player_last_.resize(num_envs_);
     }
     if (num_threads_ == 0) {
-      num_threads_ = std::min(batch_, processor_count);
-    }
-    for (std::size_t i = 0; i < num_threads_; ++i) {
-      workers_.emplace_back([this] {
-        for (;;) {
-          ActionSlice raw_action = action_buffer_queue_->Dequeue();
-          if (stop_ == 1) {
-            break;
-          }
-          int env_id = raw_action.env_id;
-          int order = raw_action.order;
-          bool reset = raw_action.force_reset || envs_[env_id]->IsDone();
-          envs_[env_id]->EnvStep(state_buffer_queue_.get(), order, reset);
-        }
-      });
+      num_threads_ = std::min<std::size_t>(batch_,
+                                           std::thread::hardware_concurrency());
     }
-    if (spec.config["thread_affinity_offset"_] >= 0) {
-      std::size_t thread_affinity_offset =
-          spec.config["thread_affinity_offset"_];
-      for (std::size_t tid = 0; tid < num_threads_; ++tid) {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        std::size_t cid = (thread_affinity_offset + tid) % processor_count;
-        CPU_SET(cid, &cpuset);
-        pthread_setaffinity_np(workers_[tid].native_handle(), sizeof(cpu_set_t),
-                               &cpuset);
-      }
+    MakeGroups();
+    state_buffer_queue_.reset(new StateBufferQueue(
+        batch_, num_envs_, max_num_players_,
+        spec.state_spec.template AllValues<ShapeSpec>(),
+        StateAllocator(0, num_envs_), is_deterministic_));
+    env_queue_.assign(num_envs_, state_buffer_queue_.get());
+    MakeEnvs(0, num_envs_);
+    StartWorkers();
+  }
+
+  /**
+   * Let the workers finish the queued actions, then join them.
+   */
+  void StopWorkers() {
+    for (std::size_t g = 0; g < group_threads_.size(); ++g) {
+      action_buffer_queues_[g]->EnqueueBulk(
+          std::vector<ActionSlice>(group_threads_[g], StopSlice()));
+    }
+    for (auto& worker : workers_) {
+      worker.join();
     }
+    workers_.clear();
   }
 
   ~AsyncEnvPool() override {
     stop_ = 1;
-    // LOG(INFO) << "envpool send: " << dur_send_.count();
     // LOG(INFO) << "envpool recv: " << dur_recv_.count();
     // send n actions to clear threadpool
-    std::vector<ActionSlice> empty_actions(workers_.size());
-    action_buffer_queue_->EnqueueBulk(empty_actions);
+    for (std::size_t g = 0; g < group_threads_.size(); ++g) {
+      action_buffer_queues_[g]->EnqueueBulk(
+          std::vector<ActionSlice>(group_threads_[g], StopSlice()));
+    }
     for (auto& worker : workers_) {
       worker.join();
     }
+    // envs may still be woken while they are destroyed, so destroy them
+    // before the members their resume hooks use
+    envs_.clear();
   }
 
+  /**
+   * Send the actions of the envs in `action[0]`. With separate state queues
+   * (see AddStateQueue, as ShmEnvPoolServer sets up) calls for disjoint sets
+   * of envs may run concurrently, as may `Reset`. Otherwise `Send`, `Reset`
+   * and `Recv` must not be called concurrently.
+   */
   void Send(const Action& action) {
     SendImpl(action.template AllValues<Array>());
   }
@@ -160,32 +692,208 @@ class AsyncEnvPool : public EnvPool<typename Env::Spec> {
   void Send(std::vector<Array>&& action) override { SendImpl(action); }
 
   std::vector<Array> Recv() override {
+    if (!drained_.empty()) {
+      auto ret = std::move(drained_.front().first);
+      partition_offset_ = drained_.front().second;
+      drained_.pop_front();
+      return ret;
+    }
     int additional_wait = 0;
     if (is_sync_ && stepping_env_num_ < batch_) {
       additional_wait = batch_ - stepping_env_num_;
     }
     auto start = std::chrono::system_clock::now();
-    auto ret = state_buffer_queue_->Wait(additional_wait);
+    auto ret = state_buffer_queue_->Wait(additional_wait, &partition_offset_);
     dur_recv_ += std::chrono::system_clock::now() - start;
     if (is_sync_) {
       stepping_env_num_ -= ret[0].Shape(0);
     }
+    in_flight_ -= ret[0].Shape(0);
     return ret;
   }
 
+  /**
+   * Number of leading rows of the last received batch that belong to
+   * partition 0. The remaining rows belong to partition 1.
+   */
+  [[nodiscard]] std::size_t PartitionOffset() const {
+    return partition_offset_;
+  }
+
+  /**
+   * Change the number of envs and of worker threads (0 for one per core, up
+   * to the batch size) without rebuilding the pool, between a `Recv` and the
+   * next `Send`. `batch_size` 0 keeps the batch size, or follows the number
+   * of envs in sync mode.
+   *
+   * The steps in flight are finished first, including suspended ones, and
+   * their states are returned by the next calls to `Recv` in batches of the
+   * old size. Envs [num_envs, old num_envs) are then removed: their last
+   * states are still received, but actions sent to them are ignored. New envs
+   * have to be reset before they are stepped, as after construction. The
+   * other envs keep their episodes.
+   */
+  void Resize(std::size_t num_envs, std::size_t num_threads,
+              std::size_t batch_size = 0) {
+    if (is_deterministic_ || !group_queues_.empty()) {
+      throw std::invalid_argument(
+          "resize is not supported in deterministic mode or with separate "
+          "state queues");
+    }
+    if (batch_size == 0) {
+      batch_size = batch_ == num_envs_ ? num_envs : std::min(batch_, num_envs);
+    }
+    if (num_envs == 0 || batch_size > num_envs) {
+      throw std::invalid_argument("invalid num_envs or batch_size of resize");
+    }
+    StopWorkers();
+    // run the steps still suspended here, their resume actions are the only
+    // ones that can still arrive
+    for (std::size_t g = 0; g < action_buffer_queues_.size(); ++g) {
+      for (;;) {
+        std::size_t suspended = 0;
+        for (std::size_t i = 0; i < num_envs_; ++i) {
+          suspended += env_group_[i] == g && envs_[i] != nullptr &&
+                       envs_[i]->IsSuspended();
+        }
+        if (suspended == 0) {
+          break;
+        }
+        for (; suspended > 0; --suspended) {
+          ActionSlice slice = action_buffer_queues_[g]->Dequeue();
+          envs_[slice.env_id]->EnvResume();
+        }
+      }
+    }
+    // the hooks may still be returning from Enqueue
+    while (running_hooks_ > 0) {
+      std::this_thread::yield();
+    }
+    for (std::size_t pending = in_flight_; pending > 0;) {
+      std::size_t n = std::min(pending, batch_);
+      std::size_t offset = 0;
+      auto batch = state_buffer_queue_->Wait(batch_ - n, &offset);
+      drained_.emplace_back(std::move(batch), offset);
+      pending -= n;
+    }
+    in_flight_ = 0;
+    stepping_env_num_ = 0;
+
+    std::size_t old_num_envs = num_envs_;
+    num_envs_ = num_envs;
+    batch_ = batch_size;
+    num_threads_ = num_threads != 0
+                       ? num_threads
+                       : std::min<std::size_t>(
+                             batch_, std::thread::hardware_concurrency());
+    is_sync_ = batch_ == num_envs_ && max_num_players_ == 1;
+    this->spec.config["num_envs"_] = static_cast<int>(num_envs_);
+    this->spec.config["batch_size"_] = static_cast<int>(batch_);
+    this->spec.config["num_threads"_] = static_cast<int>(num_threads_);
+    // envs built from now on see the new config
+    shared_spec_ = std::make_shared<const Spec>(this->spec);
+    if (max_num_players_ > 1 && num_envs_ > player_count_.size()) {
+      // actions may still name removed envs, so these never shrink
+      player_count_.resize(num_envs_);
+      player_first_.resize(num_envs_);
+      player_last_.resize(num_envs_);
+    }
+    env_block_.resize(num_envs_);
+    std::vector<std::atomic<float>> step_cost(num_envs_);
+    for (std::size_t i = 0; i < std::min(old_num_envs, num_envs_); ++i) {
+      step_cost[i].store(step_cost_[i].load());
+    }
+    step_cost_.swap(step_cost);
+    envs_.resize(num_envs_);
+    action_buffer_queues_.clear();
+    group_node_.clear();
+    group_threads_.clear();
+    env_group_.clear();
+    MakeGroups();
+    state_buffer_queue_.reset(new StateBufferQueue(
+        batch_, num_envs_, max_num_players_,
+        this->spec.state_spec.template AllValues<ShapeSpec>(),
+        StateAllocator(0, num_envs_)));
+    env_queue_.assign(num_envs_, state_buffer_queue_.get());
+    MakeEnvs(old_num_envs, num_envs_);
+    StartWorkers();
+  }
+
+  /**
+   * Route the states of envs [begin, end) to a state queue of their own with
+   * batch size `batch`, to be received with `Recv(group)` where `group` is the
+   * returned index. `allocator` places the buffers of that queue, see
+   * `StateBuffer::Allocator`; by default they follow `huge_pages` and the NUMA
+   * policy. This has to be called before the envs in the range are first
+   * stepped, and turns the pool into async mode.
+   */
+  std::size_t AddStateQueue(int begin, int end, std::size_t batch,
+                            StateBuffer::Allocator allocator = nullptr) {
+    if (max_num_players_ != 1) {
+      throw std::invalid_argument(
+          "separate state queues require max_num_players == 1");
+    }
+    if (is_deterministic_) {
+      throw std::invalid_argument(
+          "separate state queues are not supported in deterministic mode");
+    }
+    if (begin < 0 || end > static_cast<int>(num_envs_) || begin >= end ||
+        batch == 0 || batch > static_cast<std::size_t>(end - begin)) {
+      throw std::invalid_argument("invalid env range or batch of state queue");
+    }
+    is_sync_ = false;
+    if (!allocator) {
+      allocator = StateAllocator(begin, end);
+    }
+    group_queues_.emplace_back(new StateBufferQueue(
+        batch, end - begin, max_num_players_,
+        this->spec.state_spec.template AllValues<ShapeSpec>(),
+        std::move(allocator)));
+    for (int i = begin; i < end; ++i) {
+      env_queue_[i] = group_queues_.back().get();
+    }
+    return group_queues_.size() - 1;
+  }
+
+  /**
+   * Wait for the next batch of a state queue added by `AddStateQueue`. Each
+   * group must be received from a single thread.
+   */
+  std::vector<Array> Recv(std::size_t group) {
+    return group_queues_[group]->Wait();
+  }
+
   void Reset(const Array& env_ids) override {
     TArray<int> tenv_ids(env_ids);
     int shared_offset = tenv_ids.Shape(0);
-    std::vector<ActionSlice> actions(shared_offset);
     for (int i = 0; i < shared_offset; ++i) {
-      actions[i].force_reset = true;
-      actions[i].env_id = tenv_ids[i];
-      actions[i].order = is_sync_ ? i : -1;
+      int eid = tenv_ids[i];
+      if (eid < 0) {
+        throw std::invalid_argument("invalid env id " + std::to_string(eid));
+      }
+    }
+    std::vector<ActionSlice> actions;
+    actions.reserve(shared_offset);
+    uint64_t block = next_block_.fetch_add(1, std::memory_order_relaxed);
+    int row = static_cast<int>(stepping_env_num_);
+    for (int i = 0; i < shared_offset; ++i) {
+      int eid = tenv_ids[i];
+      if (eid >= static_cast<int>(num_envs_)) {
+        continue;
+      }
+      ActionSlice action{};
+      action.force_reset = true;
+      action.env_id = eid;
+      action.order = is_sync_ ? row++ : NextOrder();
+      action.block = block;
+      env_block_[eid] = block;
+      actions.push_back(action);
     }
     if (is_sync_) {
-      stepping_env_num_ += shared_offset;
+      stepping_env_num_ += actions.size();
     }
-    action_buffer_queue_->EnqueueBulk(actions);
+    in_flight_ += actions.size();
+    Enqueue(actions);
   }
 };
 
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2021 Garena Online Private Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENVPOOL_CORE_DLPACK_H_
+#define ENVPOOL_CORE_DLPACK_H_
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "envpool2/core/array.h"
+#include "envpool2/core/spec.h"
+
+/**
+ * The structs of the DLPack ABI (https://github.com/dmlc/dlpack), which is
+ * stable and all we need of it. They live in their own namespace so that they
+ * don't clash with dlpack.h if a translation unit also includes it.
+ */
+namespace dlpack {
+
+enum DeviceType : int32_t { kDLCPU = 1 };
+
+enum DataTypeCode : uint8_t {
+  kDLInt = 0,
+  kDLUInt = 1,
+  kDLFloat = 2,
+  kDLBool = 6,
+};
+
+struct Device {
+  DeviceType device_type;
+  int32_t device_id;
+};
+
+struct DataType {
+  uint8_t code;
+  uint8_t bits;
+  uint16_t lanes;
+};
+
+struct Tensor {
+  void* data;
+  Device device;
+  int32_t ndim;
+  DataType dtype;
+  int64_t* shape;
+  int64_t* strides;
+  uint64_t byte_offset;
+};
+
+struct ManagedTensor {
+  Tensor dl_tensor;
+  void* manager_ctx;
+  void (*deleter)(ManagedTensor* self);
+};
+
+template <typename T>
+DataType DataTypeOf() {
+  if constexpr (std::is_same_v<T, PackedBits>) {
+    return {kDLUInt, 8, 1};
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return {kDLBool, 8, 1};
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return {kDLFloat, sizeof(T) * 8, 1};
+  } else if constexpr (std::is_signed_v<T>) {
+    return {kDLInt, sizeof(T) * 8, 1};
+  } else {
+    return {kDLUInt, sizeof(T) * 8, 1};
+  }
+}
+
+/**
+ * A ManagedTensor viewing the memory of `a` as a CPU tensor of type `dtype`.
+ * It holds `owner`, which must keep that memory alive, until its deleter is
+ * called by the consumer. The deleter doesn't need the GIL.
+ */
+inline ManagedTensor* Wrap(const Array& a, DataType dtype,
+                           std::shared_ptr<const void> owner) {
+  struct Context {
+    ManagedTensor tensor;
+    std::vector<int64_t> shape, strides;
+    std::shared_ptr<const void> owner;
+  };
+  auto* ctx = new Context;
+  ctx->owner = std::move(owner);
+  ctx->shape.resize(a.ndim);
+  ctx->strides.resize(a.ndim);
+  int64_t stride = 1;
+  for (std::size_t i = a.ndim; i > 0; --i) {
+    ctx->shape[i - 1] = static_cast<int64_t>(a.Shape(i - 1));
+    ctx->strides[i - 1] = stride;
+    stride *= ctx->shape[i - 1];
+  }
+  ctx->tensor.dl_tensor = Tensor{
+      .data = a.Data(),
+      .device = Device{kDLCPU, 0},
+      .ndim = static_cast<int32_t>(a.ndim),
+      .dtype = dtype,
+      .shape = ctx->shape.data(),
+      .strides = ctx->strides.data(),
+      .byte_offset = 0,
+  };
+  ctx->tensor.manager_ctx = ctx;
+  ctx->tensor.deleter = [](ManagedTensor* self) {
+    delete static_cast<Context*>(self->manager_ctx);
+  };
+  return &ctx->tensor;
+}
+
+}  // namespace dlpack
+
+#endif  // ENVPOOL_CORE_DLPACK_H_
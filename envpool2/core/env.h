@@ -17,6 +17,8 @@
 #ifndef ENVPOOL_CORE_ENV_H_
 #define ENVPOOL_CORE_ENV_H_
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <random>
 #include <tuple>
@@ -29,12 +31,12 @@
 
 template <typename Dtype>
 struct InitializeHelper {
-  static void Init(Array* arr) {}
+  static void Init(Array* arr, RaggedArena* arena) {}
 };
 
 template <typename Dtype>
 struct InitializeHelper<Container<Dtype>> {
-  static void Init(Array* arr) {
+  static void Init(Array* arr, RaggedArena* arena) {
     auto* carr = reinterpret_cast<Container<Dtype>*>(arr->Data());
     for (std::size_t i = 0; i < arr->size; ++i) {
       new (carr + i) Container<Dtype>(nullptr);
@@ -42,9 +44,19 @@ struct InitializeHelper<Container<Dtype>> {
   }
 };
 
+template <typename Dtype>
+struct InitializeHelper<Ragged<Dtype>> {
+  static void Init(Array* arr, RaggedArena* arena) {
+    auto* rarr = reinterpret_cast<Ragged<Dtype>*>(arr->Data());
+    for (std::size_t i = 0; i < arr->size; ++i) {
+      rarr[i] = Ragged<Dtype>{arena, nullptr, 0};
+    }
+  }
+};
+
 template <typename Spec>
-void InplaceInitialize(const Spec& spec, Array* arr) {
-  InitializeHelper<typename Spec::dtype>::Init(arr);
+void InplaceInitialize(const Spec& spec, Array* arr, RaggedArena* arena) {
+  InitializeHelper<typename Spec::dtype>::Init(arr, arena);
 }
 
 template <typename SpecTuple>
@@ -62,7 +74,9 @@ template <typename EnvSpec>
 class Env {
  protected:
   int max_num_players_;
-  EnvSpec spec_;
+  // the spec is shared by all envs of a pool, see the shared_ptr constructor
+  std::shared_ptr<const EnvSpec> shared_spec_;
+  const EnvSpec& spec_;
   int env_id_, seed_;
   std::mt19937 gen_;
 
@@ -70,6 +84,7 @@ class Env {
   StateBufferQueue* sbq_;
   int order_, current_step_{-1};
   bool is_single_player_;
+  bool is_partitioned_;
   StateBuffer::WritableSlice slice_;
   // for parsing single env action from input action batch
   std::vector<ShapeSpec> action_specs_;
@@ -77,6 +92,19 @@ class Env {
   std::shared_ptr<std::vector<Array>> action_batch_;
   std::vector<Array> raw_action_;
   int env_index_;
+  // player rows of this env, either [player_start_, player_start_ +
+  // player_num_) of the batch, or the same range of `player_index_` when they
+  // are scattered
+  int player_start_{0}, player_num_{0};
+  std::shared_ptr<const std::vector<int>> player_index_;
+  // reused storage for gathering scattered player rows
+  std::vector<Array> gather_buffer_;
+  // see Suspend: the current step waits for Wake, and the env is resumed by
+  // the pool through `resume_hook_` once both it has returned and Wake has
+  // been called, whichever comes last
+  bool suspended_{false};
+  std::atomic<int> resume_gate_{0};
+  std::function<void()> resume_hook_;
 
  public:
   using Spec = EnvSpec;
@@ -88,13 +116,22 @@ class Env {
            typename SpecToTArray<typename EnvSpec::ActionSpec::Values>::Type>;
 
   Env(const EnvSpec& spec, int env_id)
-      : max_num_players_(spec.config["max_num_players"_]),
-        spec_(spec),
+      : Env(std::make_shared<const EnvSpec>(spec), env_id) {}
+
+  /**
+   * Construct the env with a spec shared with other envs instead of a copy of
+   * its own, which is what the pool does.
+   */
+  Env(std::shared_ptr<const EnvSpec> spec, int env_id)
+      : max_num_players_(spec->config["max_num_players"_]),
+        shared_spec_(std::move(spec)),
+        spec_(*shared_spec_),
         env_id_(env_id),
-        seed_(spec.config["seed"_] + env_id),
+        seed_(spec_.config["seed"_] + env_id),
         gen_(seed_),
         is_single_player_(max_num_players_ == 1),
-        action_specs_(spec.action_spec.template AllValues<ShapeSpec>()),
+        is_partitioned_(spec_.config["num_partitions"_] > 1),
+        action_specs_(spec_.action_spec.template AllValues<ShapeSpec>()),
         is_player_action_(Transform(action_specs_, [](const ShapeSpec& s) {
           return (!s.shape.empty() && s.shape[0] == -1);
         })) {
@@ -103,10 +140,21 @@ class Env {
 
   virtual ~Env() = default;
 
-  void SetAction(std::shared_ptr<std::vector<Array>> action_batch,
-                 int env_index) {
+  /**
+   * Bind this env to its slice of an action batch. For multi-player envs the
+   * pool has already grouped the player rows by env id: this env owns
+   * `player_num` rows starting at `player_start`, indexed through
+   * `player_index` if the rows are not contiguous in the batch.
+   */
+  void SetAction(
+      std::shared_ptr<std::vector<Array>> action_batch, int env_index,
+      int player_start = 0, int player_num = 0,
+      std::shared_ptr<const std::vector<int>> player_index = nullptr) {
     action_batch_ = std::move(action_batch);
     env_index_ = env_index;
+    player_start_ = player_start;
+    player_num_ = player_num;
+    player_index_ = std::move(player_index);
   }
 
   void ParseAction() {
@@ -122,51 +170,89 @@ class Env {
         }
       }
     } else {
-      std::vector<int> env_player_index;
-      int* player_env_id = static_cast<int*>((*action_batch_)[1].Data());
-      int player_offset = (*action_batch_)[1].Shape(0);
-      for (int i = 0; i < player_offset; ++i) {
-        if (player_env_id[i] == env_id_) {
-          env_player_index.push_back(i);
-        }
-      }
-      int player_num = env_player_index.size();
-      bool continuous = false;
-      int start = 0;
-      int end = 0;
-      if (player_num > 0) {
-        start = env_player_index[0];
-        end = env_player_index[player_num - 1] + 1;
-        continuous = (player_num == end - start);
-      }
       for (std::size_t i = 0; i < action_size; ++i) {
-        if (is_player_action_[i]) {
-          if (continuous) {
-            raw_action_.emplace_back((*action_batch_)[i].Slice(start, end));
-          } else {
-            action_specs_[i].shape[0] = player_num;
-            Array arr(action_specs_[i]);
-            for (int j = 0; j < player_num; ++j) {
-              int player_index = env_player_index[j];
-              arr[j].Assign((*action_batch_)[i][player_index]);
-            }
-            raw_action_.emplace_back(std::move(arr));
-          }
-        } else {
+        if (!is_player_action_[i]) {
           raw_action_.emplace_back((*action_batch_)[i][env_index_]);
+        } else if (player_index_ == nullptr) {
+          raw_action_.emplace_back((*action_batch_)[i].Slice(
+              player_start_, player_start_ + player_num_));
+        } else {
+          raw_action_.emplace_back(GatherPlayerRows(i));
         }
       }
+      player_index_.reset();
+    }
+  }
+
+  /**
+   * Copy this env's scattered player rows of action `key` into a buffer that
+   * is allocated once with `max_num_players` rows and reused across steps.
+   */
+  Array GatherPlayerRows(std::size_t key) {
+    if (gather_buffer_.empty()) {
+      gather_buffer_.resize(action_specs_.size());
     }
+    Array& buffer = gather_buffer_[key];
+    if (buffer.Data() == nullptr) {
+      action_specs_[key].shape[0] = max_num_players_;
+      buffer = Array(action_specs_[key]);
+    }
+    const Array& src = (*action_batch_)[key];
+    Array arr = buffer.Truncate(player_num_);
+    for (int j = 0; j < player_num_; ++j) {
+      arr[j].Assign(src[(*player_index_)[player_start_ + j]]);
+    }
+    return arr;
   }
 
   void EnvStep(StateBufferQueue* sbq, int order, bool reset) {
-    PreProcess(sbq, order, reset);
     if (reset) {
+      PreProcess(sbq, order, reset);
       Reset();
     } else {
-      ParseAction();
-      Step(Action(std::move(raw_action_)));
-      raw_action_.clear();
+      Step(BeginStep(sbq, order));
+    }
+    EndStep();
+  }
+
+  /**
+   * Continue the step suspended by `Suspend`, on whichever worker the pool
+   * runs it.
+   */
+  void EnvResume() {
+    suspended_ = false;
+    Resume();
+    EndStep();
+  }
+
+  /**
+   * Whether the last step was suspended and has not been resumed yet.
+   */
+  [[nodiscard]] bool IsSuspended() const { return suspended_; }
+
+  /**
+   * Called by the pool with a thread-safe function that makes a worker call
+   * `EnvResume`. Envs not run by a pool can't suspend.
+   */
+  void SetResumeHook(std::function<void()> hook) {
+    resume_hook_ = std::move(hook);
+  }
+
+  /**
+   * The parts of a non-reset `EnvStep` before and after `Step`, so that the
+   * pool can step several envs with one `StepBatch` call in between.
+   */
+  Action BeginStep(StateBufferQueue* sbq, int order) {
+    PreProcess(sbq, order, false);
+    ParseAction();
+    return Action(std::move(raw_action_));
+  }
+
+  void EndStep() {
+    raw_action_.clear();
+    if (suspended_) {
+      PassResumeGate();
+      return;
     }
     PostProcess();
   }
@@ -175,7 +261,26 @@ class Env {
   virtual void Step(const Action& action) {
     throw std::runtime_error("step not implemented");
   }
+
+  /**
+   * Maximum number of envs a worker steps with one `StepBatch` call. Env types
+   * with cheap steps can raise it and define their own `StepBatch`.
+   */
+  static constexpr std::size_t kMaxStepBatch = 1;
+
+  /**
+   * Step `envs[i]` with `actions[i]` for i < n, the envs being of the same type
+   * E. This is resolved statically on E, which may hide it with a vectorized
+   * version; the default steps the envs one by one.
+   */
+  template <typename E>
+  static void StepBatch(E* const* envs, const Action* actions, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      envs[i]->Step(actions[i]);
+    }
+  }
   virtual bool IsDone() { throw std::runtime_error("is_done not implemented"); }
+  virtual void Resume() { throw std::runtime_error("resume not implemented"); }
 
  protected:
   void PreProcess(StateBufferQueue* sbq, int order, bool reset) {
@@ -193,8 +298,32 @@ class Env {
     // action_batch_.reset();
   }
 
-  State Allocate(int player_num = 1) {
-    slice_ = sbq_->Allocate(player_num, order_);
+  [[nodiscard]] bool CanSuspend() const {
+    return static_cast<bool>(resume_hook_);
+  }
+
+  /**
+   * End the current `Reset`, `Step` or `Resume` without a state, e.g. to wait
+   * for a slow opponent without blocking the worker. Call it before
+   * `Allocate` and before starting what the env waits on, which has to call
+   * `Wake` once done, from any thread. `Resume` is then called to continue
+   * the step, and eventually writes its state. Requires `CanSuspend()`.
+   */
+  void Suspend() {
+    suspended_ = true;
+    resume_gate_ = 0;
+  }
+
+  void Wake() { PassResumeGate(); }
+
+  /**
+   * Allocate the state of this step. `partition` selects the sub-batch this
+   * state is written to when the pool is created with `num_partitions > 1`,
+   * e.g. the seat that is to play in a two-player game.
+   */
+  State Allocate(int player_num = 1, int partition = 0) {
+    slice_ = sbq_->Allocate(player_num, order_,
+                            is_partitioned_ ? partition : -1);
     State state(slice_.arr);
     bool done = IsDone();
     int max_episode_steps = spec_.config["max_episode_steps"_];
@@ -215,11 +344,18 @@ class Env {
     int i = 0;
     std::apply(
         [&](auto&&... spec) {
-          (InplaceInitialize(spec, &slice_.arr[i++]), ...);
+          (InplaceInitialize(spec, &slice_.arr[i++], slice_.arena), ...);
         },
         spec_.state_spec.AllValues());
     return state;
   }
+
+ private:
+  void PassResumeGate() {
+    if (resume_gate_.fetch_add(1) == 1) {
+      resume_hook_();
+    }
+  }
 };
 
 #endif  // ENVPOOL_CORE_ENV_H_
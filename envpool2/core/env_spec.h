@@ -27,7 +27,12 @@ auto common_config =
              "max_num_players"_.Bind(1), "thread_affinity_offset"_.Bind(-1),
              "base_path"_.Bind(std::string("envpool2")), "seed"_.Bind(42),
              "gym_reset_return_info"_.Bind(false),
-             "max_episode_steps"_.Bind(std::numeric_limits<int>::max()));
+             "max_episode_steps"_.Bind(std::numeric_limits<int>::max()),
+             "num_partitions"_.Bind(1), "deterministic"_.Bind(false),
+             "numa_policy"_.Bind(std::string("none")),
+             "huge_pages"_.Bind(false),
+             "schedule_policy"_.Bind(std::string("fifo")),
+             "lazy_init"_.Bind(false));
 // Note: this action order is hardcoded in async_envpool Send function
 // and env ParseAction function for performance
 auto common_action_spec = MakeDict("env_id"_.Bind(Spec<int>({})),
@@ -39,7 +44,8 @@ auto common_state_spec =
              "elapsed_step"_.Bind(Spec<int>({})), "done"_.Bind(Spec<bool>({})),
              "reward"_.Bind(Spec<float>({-1})),
              "discount"_.Bind(Spec<float>({-1}, {0.0, 1.0})),
-             "step_type"_.Bind(Spec<int>({})), "trunc"_.Bind(Spec<bool>({})));
+             "step_type"_.Bind(Spec<int8_t>({}, {0, 2})),
+             "trunc"_.Bind(Spec<bool>({})));
 
 /**
  * EnvSpec funciton, it constructs the env spec when a Config is passed.
@@ -77,6 +83,36 @@ class EnvSpec {
           std::to_string(config["num_envs"_]) +
           ", batch_size = " + std::to_string(config["batch_size"_]));
     }
+    if (config["num_partitions"_] < 1 || config["num_partitions"_] > 2) {
+      throw std::invalid_argument(
+          "Only num_partitions = 1 or 2 is supported, got num_partitions = " +
+          std::to_string(config["num_partitions"_]));
+    }
+    if (config["num_partitions"_] > 1 && config["max_num_players"_] != 1) {
+      throw std::invalid_argument(
+          "num_partitions > 1 requires max_num_players = 1, got "
+          "max_num_players = " +
+          std::to_string(config["max_num_players"_]));
+    }
+    if (config["deterministic"_] && config["max_num_players"_] != 1) {
+      throw std::invalid_argument(
+          "deterministic requires max_num_players = 1, got "
+          "max_num_players = " +
+          std::to_string(config["max_num_players"_]));
+    }
+    const std::string& numa_policy = config["numa_policy"_];
+    if (numa_policy != "none" && numa_policy != "node" &&
+        numa_policy != "interleave") {
+      throw std::invalid_argument(
+          "numa_policy must be none, node or interleave, got " + numa_policy);
+    }
+    const std::string& schedule_policy = config["schedule_policy"_];
+    if (schedule_policy != "fifo" && schedule_policy != "oldest" &&
+        schedule_policy != "cost") {
+      throw std::invalid_argument(
+          "schedule_policy must be fifo, oldest or cost, got " +
+          schedule_policy);
+    }
     if (config["batch_size"_] == 0) {
       config["batch_size"_] = config["num_envs"_];
     }
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2021 Garena Online Private Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENVPOOL_CORE_NUMA_H_
+#define ENVPOOL_CORE_NUMA_H_
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * NUMA nodes of the machine and the CPUs of each node this process may run
+ * on, read from the sysfs topology so that libnuma is not needed. Nodes
+ * without usable CPUs are left out. If the topology is not available, a
+ * single node with id -1 holds all usable CPUs.
+ */
+class NumaTopology {
+ public:
+  struct Node {
+    int id;
+    std::vector<int> cpus;
+  };
+  std::vector<Node> nodes;
+
+  static NumaTopology Detect(
+      const std::string& root = "/sys/devices/system/node") {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+      for (int c = 0; c < CPU_SETSIZE; ++c) {
+        CPU_SET(c, &allowed);
+      }
+    }
+    NumaTopology topo;
+    if (DIR* dir = opendir(root.c_str())) {
+      while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+            name.find_first_not_of("0123456789", 4) != std::string::npos) {
+          continue;
+        }
+        std::ifstream file(root + "/" + name + "/cpulist");
+        std::string list;
+        std::getline(file, list);
+        Node node{std::stoi(name.substr(4)), {}};
+        for (int c : ParseCpuList(list)) {
+          if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)) {
+            node.cpus.push_back(c);
+          }
+        }
+        if (!node.cpus.empty()) {
+          topo.nodes.push_back(std::move(node));
+        }
+      }
+      closedir(dir);
+    }
+    std::sort(topo.nodes.begin(), topo.nodes.end(),
+              [](const Node& a, const Node& b) { return a.id < b.id; });
+    if (topo.nodes.empty()) {
+      Node node{-1, {}};
+      for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &allowed)) {
+          node.cpus.push_back(c);
+        }
+      }
+      topo.nodes.push_back(std::move(node));
+    }
+    return topo;
+  }
+
+  /**
+   * Parse a sysfs cpu list such as "0-3,8,10-11".
+   */
+  static std::vector<int> ParseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      if (range.empty() || range == "\n") {
+        continue;
+      }
+      auto dash = range.find('-');
+      int first = std::atoi(range.c_str());
+      int last = dash == std::string::npos
+                     ? first
+                     : std::atoi(range.c_str() + dash + 1);
+      for (int c = first; c <= last; ++c) {
+        cpus.push_back(c);
+      }
+    }
+    return cpus;
+  }
+
+  /**
+   * Index into `nodes` of the node the calling thread is running on.
+   */
+  [[nodiscard]] std::size_t CurrentNode() const {
+    int cpu = sched_getcpu();
+    for (std::size_t n = 0; n < nodes.size(); ++n) {
+      const auto& cpus = nodes[n].cpus;
+      if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+        return n;
+      }
+    }
+    return 0;
+  }
+};
+
+/**
+ * Restrict `thread` to `cpus`. Returns false if the kernel refused.
+ */
+inline bool PinThread(pthread_t thread, const std::vector<int>& cpus) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  for (int c : cpus) {
+    CPU_SET(c, &cpuset);
+  }
+  return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset) == 0;
+}
+
+/**
+ * Apply the memory policy `mode` (MPOL_PREFERRED or MPOL_INTERLEAVE) over
+ * `node_ids` to the untouched pages at `addr`, e.g. as the `prepare` hook of a
+ * PageArena, so that their placement doesn't depend on which thread first
+ * writes them. If the kernel rejects the policy the pages follow first touch.
+ */
+inline void NumaBind(void* addr, std::size_t bytes, int mode,
+                     const std::vector<int>& node_ids) {
+  std::vector<unsigned long> mask;  // NOLINT
+  constexpr int kBits = sizeof(unsigned long) * CHAR_BIT;  // NOLINT
+  for (int id : node_ids) {
+    if (id < 0) {
+      continue;
+    }
+    mask.resize(std::max<std::size_t>(mask.size(), id / kBits + 1));
+    mask[id / kBits] |= 1UL << (id % kBits);
+  }
+  if (!mask.empty()) {
+    // the kernel reads one bit less than maxnode
+    syscall(SYS_mbind, addr, bytes, mode, mask.data(), mask.size() * kBits + 1,
+            0);
+  }
+}
+
+#endif  // ENVPOOL_CORE_NUMA_H_
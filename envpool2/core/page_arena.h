@@ -0,0 +1,210 @@
+/*
+ * Copyright 2021 Garena Online Private Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENVPOOL_CORE_PAGE_ARENA_H_
+#define ENVPOOL_CORE_PAGE_ARENA_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "envpool2/core/array.h"
+#include "envpool2/core/dict.h"
+#include "envpool2/core/spec.h"
+
+/**
+ * StateBuffer::Allocator that lays out all arrays of a buffer in one block of
+ * pages, each array aligned to 64 bytes, instead of one heap allocation per
+ * array. With `huge_pages`, blocks are taken from the reserved huge pages
+ * (MAP_HUGETLB), or else from normal pages advised for transparent huge
+ * pages, or else from normal pages.
+ *
+ * A block goes back to the arena when the last array pointing into it is
+ * released, and the next buffer of the same size reuses it after zeroing the
+ * used bytes, so the pages are only faulted in once. `prepare` is called on
+ * every new block before its pages are touched, e.g. to set a NUMA policy.
+ * Arenas must be created with std::make_shared.
+ */
+class PageArena : public std::enable_shared_from_this<PageArena> {
+ public:
+  enum class PageKind : uint8_t { kNormal, kTransparentHuge, kHuge };
+  using Prepare = std::function<void(void*, std::size_t)>;
+
+  static constexpr std::size_t kAlign = 64;
+  static constexpr std::size_t kHugePageSize = 2 << 20;
+
+ protected:
+  struct Block {
+    char* base;
+    std::size_t bytes;
+  };
+
+  bool huge_pages_;
+  Prepare prepare_;
+  std::size_t max_free_;
+  std::mutex mu_;
+  std::vector<Block> free_;
+  PageKind kind_{PageKind::kNormal};
+
+ public:
+  explicit PageArena(bool huge_pages, Prepare prepare = nullptr,
+                     std::size_t max_free = 8)
+      : huge_pages_(huge_pages),
+        prepare_(std::move(prepare)),
+        max_free_(max_free) {}
+
+  ~PageArena() {
+    for (const auto& block : free_) {
+      munmap(block.base, block.bytes);
+    }
+  }
+
+  /**
+   * Byte offsets of the arrays of `specs` in a block, and the bytes used.
+   */
+  static std::size_t Layout(const std::vector<ShapeSpec>& specs,
+                            std::vector<std::size_t>* offsets) {
+    std::size_t total = 0;
+    offsets->clear();
+    for (const auto& spec : specs) {
+      auto shape = spec.Shape();
+      offsets->push_back(total);
+      std::size_t bytes = Prod(shape.data(), shape.size()) * spec.element_size;
+      total += (bytes + kAlign - 1) / kAlign * kAlign;
+    }
+    return total;
+  }
+
+  std::vector<Array> Allocate(const std::vector<ShapeSpec>& specs) {
+    std::vector<std::size_t> offsets;
+    std::size_t used = Layout(specs, &offsets);
+    Block block = Acquire(used);
+    if (block.base == nullptr) {
+      return MakeArray(specs);
+    }
+    auto self = shared_from_this();
+    std::shared_ptr<char> lease(
+        block.base, [self, block](char* /*unused*/) { self->Release(block); });
+    std::vector<Array> ret;
+    ret.reserve(specs.size());
+    for (std::size_t i = 0; i < specs.size(); ++i) {
+      ret.emplace_back(specs[i], block.base + offsets[i],
+                       [lease](char* /*unused*/) {});
+    }
+    return ret;
+  }
+
+  /**
+   * Kind of pages of the most recently mapped block.
+   */
+  [[nodiscard]] PageKind Kind() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return kind_;
+  }
+
+ protected:
+  Block Acquire(std::size_t used) {
+    std::size_t page = huge_pages_ ? kHugePageSize : sysconf(_SC_PAGESIZE);
+    std::size_t bytes = std::max((used + page - 1) / page * page, page);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      for (std::size_t i = 0; i < free_.size(); ++i) {
+        if (free_[i].bytes == bytes) {
+          Block block = free_[i];
+          free_[i] = free_.back();
+          free_.pop_back();
+          std::memset(block.base, 0, used);
+          return block;
+        }
+      }
+    }
+    return Map(bytes);
+  }
+
+  Block Map(std::size_t bytes) {
+    PageKind kind = PageKind::kNormal;
+    void* p = MAP_FAILED;
+    char* base = nullptr;
+    if (huge_pages_) {
+      p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        kind = PageKind::kHuge;
+        base = static_cast<char*>(p);
+      }
+    }
+    if (p == MAP_FAILED && huge_pages_) {
+      // transparent huge pages only back aligned ranges, so over-map and
+      // trim to a huge page boundary
+      std::size_t mapped = bytes + kHugePageSize;
+      p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED) {
+        auto addr = reinterpret_cast<uintptr_t>(p);
+        auto aligned = (addr + kHugePageSize - 1) / kHugePageSize *
+                       kHugePageSize;
+        if (aligned > addr) {
+          munmap(p, aligned - addr);
+        }
+        if (aligned + bytes < addr + mapped) {
+          munmap(reinterpret_cast<void*>(aligned + bytes),
+                 addr + mapped - aligned - bytes);
+        }
+        base = reinterpret_cast<char*>(aligned);
+        if (madvise(base, bytes, MADV_HUGEPAGE) == 0) {
+          kind = PageKind::kTransparentHuge;
+        }
+      }
+    }
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        return Block{nullptr, 0};
+      }
+      base = static_cast<char*>(p);
+    }
+    if (prepare_) {
+      prepare_(base, bytes);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      kind_ = kind;
+    }
+    return Block{base, bytes};
+  }
+
+  void Release(const Block& block) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (free_.size() < max_free_) {
+        free_.push_back(block);
+        return;
+      }
+    }
+    munmap(block.base, block.bytes);
+  }
+};
+
+#endif  // ENVPOOL_CORE_PAGE_ARENA_H_
@@ -24,17 +24,23 @@
 
 #include <exception>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "envpool2/core/dlpack.h"
 #include "envpool2/core/envpool.h"
+#include "envpool2/core/remote_envpool.h"
+#include "envpool2/core/shm_envpool.h"
 
 namespace py = pybind11;
 
 /**
- * Convert Array to py::array, with py::capsule
+ * Convert Array to py::array, with py::capsule. The capsule may be given,
+ * when it already keeps the memory of `a` alive.
  */
 template <typename dtype>
 struct ArrayToNumpyHelper {
@@ -43,6 +49,9 @@ struct ArrayToNumpyHelper {
     auto capsule = py::capsule(ptr, [](void* ptr) {
       delete reinterpret_cast<std::shared_ptr<char>*>(ptr);
     });
+    return Convert(a, capsule);
+  }
+  static py::array Convert(const Array& a, const py::capsule& capsule) {
     return py::array(a.Shape(), reinterpret_cast<dtype*>(a.Data()), capsule);
   }
 };
@@ -74,6 +83,22 @@ struct ArrayToNumpyHelper<Container<dtype>> {
     return {py::dtype("object"), a.Shape(),
             reinterpret_cast<py::object*>(ptr->get()), capsule};
   }
+  static py::array Convert(const Array& a, const py::capsule& /*unused*/) {
+    return Convert(a);
+  }
+};
+
+/**
+ * PackedBits are handed to python as their uint8 bytes.
+ */
+template <>
+struct ArrayToNumpyHelper<PackedBits> {
+  static py::array Convert(const Array& a) {
+    return ArrayToNumpyHelper<uint8_t>::Convert(a);
+  }
+  static py::array Convert(const Array& a, const py::capsule& capsule) {
+    return ArrayToNumpyHelper<uint8_t>::Convert(a, capsule);
+  }
 };
 
 template <typename dtype>
@@ -124,6 +149,31 @@ struct SpecTupleHelper<Spec<Container<dtype>>> {
   }
 };
 
+/**
+ * Ragged is exported like Container, the inner spec being that of each row.
+ */
+template <typename dtype>
+struct SpecTupleHelper<Spec<Ragged<dtype>>> {
+  static decltype(auto) Make(const Spec<Ragged<dtype>>& spec) {
+    return std::make_tuple(py::dtype::of<dtype>(),
+                           std::make_tuple(spec.shape, spec.inner_spec.shape),
+                           spec.inner_spec.bounds,
+                           spec.inner_spec.elementwise_bounds);
+  }
+};
+
+/**
+ * PackedBits is exported as the uint8 array python receives; its shape is the
+ * number of bytes, not of flags.
+ */
+template <>
+struct SpecTupleHelper<Spec<PackedBits>> {
+  static decltype(auto) Make(const Spec<PackedBits>& spec) {
+    return std::make_tuple(py::dtype::of<uint8_t>(), spec.shape, spec.bounds,
+                           spec.elementwise_bounds);
+  }
+};
+
 template <typename... Spec>
 decltype(auto) ExportSpecs(const std::tuple<Spec...>& specs) {
   return std::apply(
@@ -168,22 +218,275 @@ template <typename EnvSpec>
 typename EnvSpec::ConfigValues PyEnvSpec<EnvSpec>::py_default_config_values =
     EnvSpec::kDefaultConfig.AllValues();
 
+template <typename Spec>
+py::object ToNumpyValue(const Array& a, const Spec& spec,
+                        const py::capsule& batch) {
+  return ArrayToNumpyHelper<typename Spec::dtype>::Convert(a, batch);
+}
+
+/**
+ * A ragged field is converted to a tuple (values, offsets): the rows of all its
+ * slots concatenated, and the int64 offsets of each slot's rows, so that slot
+ * `i` (in row-major order) is `values[offsets[i]:offsets[i + 1]]`.
+ */
+template <typename D>
+std::pair<Array, Array> FlattenRagged(const Array& a,
+                                      const Spec<Ragged<D>>& spec) {
+  Array values;
+  Array offsets(Spec<int64_t>({static_cast<int>(a.size) + 1}));
+  py::gil_scoped_release release;
+  const auto* slots = static_cast<const Ragged<D>*>(a.Data());
+  auto* offset = static_cast<int64_t*>(offsets.Data());
+  offset[0] = 0;
+  for (std::size_t i = 0; i < a.size; ++i) {
+    offset[i + 1] = offset[i] + slots[i].length;
+  }
+  std::vector<int> shape = spec.inner_spec.shape;
+  if (shape.empty()) {
+    shape.push_back(1);
+  }
+  shape[0] = static_cast<int>(offset[a.size]);
+  values = Array(ShapeSpec(sizeof(D), shape));
+  std::size_t row_bytes =
+      shape[0] == 0 ? 0 : values.size / shape[0] * sizeof(D);
+  auto* dst = static_cast<char*>(values.Data());
+  for (std::size_t i = 0; i < a.size; ++i) {
+    std::memcpy(dst + offset[i] * row_bytes, slots[i].data,
+                slots[i].length * row_bytes);
+  }
+  return {std::move(values), std::move(offsets)};
+}
+
+template <typename D>
+py::object ToNumpyValue(const Array& a, const Spec<Ragged<D>>& spec,
+                        const py::capsule& /*unused*/) {
+  auto [values, offsets] = FlattenRagged(a, spec);
+  return py::make_tuple(ArrayToNumpyHelper<D>::Convert(values),
+                        ArrayToNumpyHelper<int64_t>::Convert(offsets));
+}
+
+/**
+ * A "dltensor" capsule viewing `a`, see `dlpack::Wrap`. Unless a consumer
+ * took it over, the tensor is released with the capsule.
+ */
+inline py::capsule ToDLPackCapsule(const Array& a, dlpack::DataType dtype,
+                                   std::shared_ptr<const void> owner) {
+  dlpack::ManagedTensor* tensor = dlpack::Wrap(a, dtype, std::move(owner));
+  PyObject* capsule = PyCapsule_New(tensor, "dltensor", [](PyObject* self) {
+    if (PyCapsule_IsValid(self, "used_dltensor")) {
+      return;
+    }
+    auto* tensor = static_cast<dlpack::ManagedTensor*>(
+        PyCapsule_GetPointer(self, "dltensor"));
+    if (tensor == nullptr) {
+      PyErr_Clear();
+      return;
+    }
+    tensor->deleter(tensor);
+  });
+  if (capsule == nullptr) {
+    tensor->deleter(tensor);
+    throw py::error_already_set();
+  }
+  return py::reinterpret_steal<py::capsule>(capsule);
+}
+
+template <typename Spec>
+py::object ToDLPackValue(const Array& a, const Spec& spec,
+                         const std::shared_ptr<const void>& batch) {
+  return ToDLPackCapsule(a, dlpack::DataTypeOf<typename Spec::dtype>(), batch);
+}
+
 /**
- * Bind specs to arrs, and return py::array in ret
+ * Containers hold python-unrelated objects per slot, which DLPack can't
+ * describe, so they stay numpy object arrays.
+ */
+template <typename D>
+py::object ToDLPackValue(const Array& a, const Spec<Container<D>>& spec,
+                         const std::shared_ptr<const void>& /*unused*/) {
+  return ArrayToNumpyHelper<Container<D>>::Convert(a);
+}
+
+template <typename D>
+py::object ToDLPackValue(const Array& a, const Spec<Ragged<D>>& spec,
+                         const std::shared_ptr<const void>& /*unused*/) {
+  auto [values, offsets] = FlattenRagged(a, spec);
+  auto owner = std::make_shared<std::pair<Array, Array>>(values, offsets);
+  return py::make_tuple(
+      ToDLPackCapsule(values, dlpack::DataTypeOf<D>(), owner),
+      ToDLPackCapsule(offsets, dlpack::DataTypeOf<int64_t>(), owner));
+}
+
+/**
+ * Bind specs to arrs, and return py::array (or a tuple of them for ragged
+ * fields) in ret. All arrays of the batch share one capsule, which owns
+ * `arrs` and is released with the last of them.
  */
 template <typename... Spec>
-void ToNumpy(const std::vector<Array>& arrs, const std::tuple<Spec...>& specs,
-             std::vector<py::array>* ret) {
+void ToNumpy(std::vector<Array>&& arrs, const std::tuple<Spec...>& specs,
+             std::vector<py::object>* ret) {
+  auto* batch = new std::vector<Array>(std::move(arrs));
+  py::capsule capsule(batch, [](void* ptr) {
+    delete reinterpret_cast<std::vector<Array>*>(ptr);
+  });
   std::size_t index = 0;
   std::apply(
       [&](auto&&... spec) {
-        (ret->emplace_back(
-             ArrayToNumpyHelper<typename Spec::dtype>::Convert(arrs[index++])),
+        (ret->emplace_back(ToNumpyValue((*batch)[index++], spec, capsule)),
          ...);
       },
       specs);
 }
 
+/**
+ * Like ToNumpy, but returns DLPack capsules that view the memory of the batch,
+ * which is released when the consumers of all of them are done with it.
+ */
+template <typename... Spec>
+void ToDLPack(std::vector<Array>&& arrs, const std::tuple<Spec...>& specs,
+              std::vector<py::object>* ret) {
+  auto batch = std::make_shared<const std::vector<Array>>(std::move(arrs));
+  std::size_t index = 0;
+  std::apply(
+      [&](auto&&... spec) {
+        (ret->emplace_back(ToDLPackValue((*batch)[index++], spec, batch)),
+         ...);
+      },
+      specs);
+}
+
+/**
+ * Assembles the values of a received batch into the python api's output, so
+ * that `recv` doesn't rebuild the state tree in python. The layout is built
+ * once per pool class by the metaclass (see `python/data.py`): the flat
+ * indices and optree treespecs of the observation and the info, and the
+ * indices of the other outputs.
+ */
+class PyOutputLayout {
+ public:
+  enum Api { kGym, kGymnasium, kDm };
+
+ protected:
+  PyObject* source_{nullptr};
+  Api api_{kGym};
+  bool new_gym_api_{true};
+  py::object obs_spec_, info_spec_, timestep_;
+  std::vector<int> obs_idx_, info_idx_;
+  int reward_{0}, done_{0}, trunc_{0}, step_type_{0}, discount_{0};
+
+  static py::object Unflatten(const py::object& spec,
+                              const std::vector<int>& idx,
+                              const std::vector<py::object>& values) {
+    py::list leaves(idx.size());
+    for (std::size_t i = 0; i < idx.size(); ++i) {
+      leaves[i] = values[idx[i]];
+    }
+    return spec.attr("unflatten")(leaves);
+  }
+
+  /**
+   * Whether `format`, "numpy" or "dlpack", asks for DLPack capsules.
+   */
+  static bool IsDLPack(const std::string& format) {
+    if (format != "numpy" && format != "dlpack") {
+      throw std::invalid_argument(
+          "format must be \"numpy\" or \"dlpack\", got " + format);
+    }
+    return format == "dlpack";
+  }
+
+  [[nodiscard]] bool HasTerminated(bool reset) const {
+    return !reset && api_ != kDm && (api_ == kGymnasium || new_gym_api_);
+  }
+
+  /**
+   * done & ~trunc of a batch.
+   */
+  [[nodiscard]] Array Terminated(const std::vector<Array>& arrs) const {
+    const Array& done = arrs[done_];
+    const Array& trunc = arrs[trunc_];
+    Array ret(Spec<bool>({static_cast<int>(done.size)}));
+    const auto* dp = static_cast<const bool*>(done.Data());
+    const auto* tp = static_cast<const bool*>(trunc.Data());
+    auto* rp = static_cast<bool*>(ret.Data());
+    for (std::size_t i = 0; i < done.size; ++i) {
+      rp[i] = dp[i] && !tp[i];
+    }
+    return ret;
+  }
+
+ public:
+  /**
+   * Read `layout` unless it is the one already read.
+   */
+  void Update(const py::object& layout) {
+    if (layout.ptr() == source_) {
+      return;
+    }
+    auto api = layout.attr("api").cast<std::string>();
+    api_ = api == "dm" ? kDm : api == "gymnasium" ? kGymnasium : kGym;
+    new_gym_api_ = layout.attr("new_gym_api").cast<bool>();
+    obs_spec_ = layout.attr("obs_spec");
+    obs_idx_ = layout.attr("obs_idx").cast<std::vector<int>>();
+    info_spec_ = layout.attr("info_spec");
+    info_idx_ = layout.attr("info_idx").cast<std::vector<int>>();
+    timestep_ = layout.attr("timestep");
+    reward_ = layout.attr("reward").cast<int>();
+    done_ = layout.attr("done").cast<int>();
+    trunc_ = layout.attr("trunc").cast<int>();
+    step_type_ = layout.attr("step_type").cast<int>();
+    discount_ = layout.attr("discount").cast<int>();
+    source_ = layout.ptr();
+  }
+
+  /**
+   * Convert a received batch of `specs` to numpy arrays, or to DLPack
+   * capsules if `dlpack`, and build the output from them.
+   */
+  template <typename StateSpec>
+  py::object Build(std::vector<Array>&& arrs, const StateSpec& specs,
+                   bool reset, bool return_info, bool dlpack) const {
+    py::object terminated;
+    std::vector<py::object> values;
+    values.reserve(arrs.size());
+    if (HasTerminated(reset)) {
+      Array t = Terminated(arrs);
+      terminated = dlpack ? ToDLPackCapsule(t, dlpack::DataTypeOf<bool>(),
+                                            t.SharedPtr())
+                          : ArrayToNumpyHelper<bool>::Convert(t);
+    }
+    if (dlpack) {
+      ToDLPack(std::move(arrs), specs, &values);
+    } else {
+      ToNumpy(std::move(arrs), specs, &values);
+    }
+    return Build(values, reset, return_info, terminated);
+  }
+
+  py::object Build(const std::vector<py::object>& values, bool reset,
+                   bool return_info, const py::object& terminated) const {
+    py::object obs = Unflatten(obs_spec_, obs_idx_, values);
+    if (api_ == kDm) {
+      return timestep_(py::arg("step_type") = values[step_type_],
+                       py::arg("reward") = values[reward_],
+                       py::arg("discount") = values[discount_],
+                       py::arg("observation") = obs);
+    }
+    if (reset && api_ == kGym && !(return_info || new_gym_api_)) {
+      return obs;
+    }
+    py::object info = Unflatten(info_spec_, info_idx_, values);
+    if (reset) {
+      return py::make_tuple(obs, info);
+    }
+    if (api_ == kGym && !new_gym_api_) {
+      return py::make_tuple(obs, values[reward_], values[done_], info);
+    }
+    return py::make_tuple(obs, values[reward_], terminated, values[trunc_],
+                          info);
+  }
+};
+
 template <typename... Spec>
 void ToArray(const std::vector<py::array>& py_arrs,
              const std::tuple<Spec...>& specs, std::vector<Array>* ret) {
@@ -207,11 +510,17 @@ class PyEnvPool : public EnvPool {
   using PySpec = PyEnvSpec<typename EnvPool::Spec>;
 
   PySpec py_spec;
+  PyOutputLayout py_output;
   static std::vector<std::string> py_state_keys;
   static std::vector<std::string> py_action_keys;
 
-  explicit PyEnvPool(const PySpec& py_spec)
-      : EnvPool(py_spec), py_spec(py_spec) {}
+  /**
+   * Extra arguments are forwarded to `EnvPool`, e.g. the server addresses of
+   * a RemoteEnvPool.
+   */
+  template <typename... Args>
+  explicit PyEnvPool(const PySpec& py_spec, Args&&... args)
+      : EnvPool(py_spec, std::forward<Args>(args)...), py_spec(py_spec) {}
 
   /**
    * py api
@@ -224,22 +533,112 @@ class PyEnvPool : public EnvPool {
     EnvPool::Send(arr);  // delegate to the c++ api
   }
 
+  std::vector<Array> RecvArrays() {
+    py::gil_scoped_release release;
+    std::vector<Array> arr = EnvPool::Recv();
+    DCHECK_EQ(arr.size(), std::tuple_size_v<typename EnvPool::State::Keys>);
+    return arr;
+  }
+
   /**
    * py api
    */
-  std::vector<py::array> PyRecv() {
-    std::vector<Array> arr;
-    {
-      py::gil_scoped_release release;
-      arr = EnvPool::Recv();
-      DCHECK_EQ(arr.size(), std::tuple_size_v<typename EnvPool::State::Keys>);
-    }
-    std::vector<py::array> ret;
+  std::vector<py::object> PyRecv() {
+    std::vector<py::object> ret;
+    ret.reserve(EnvPool::State::kSize);
+    ToNumpy(RecvArrays(), py_spec.state_spec, &ret);
+    return ret;
+  }
+
+  /**
+   * py api
+   *
+   * PyRecv returning DLPack capsules instead of numpy arrays.
+   */
+  std::vector<py::object> PyRecvDLPack() {
+    std::vector<py::object> ret;
+    ret.reserve(EnvPool::State::kSize);
+    ToDLPack(RecvArrays(), py_spec.state_spec, &ret);
+    return ret;
+  }
+
+  /**
+   * py api
+   *
+   * Recv a batch and build the output of the python api, see PyOutputLayout.
+   */
+  py::object PyRecvTo(const py::object& layout, bool reset, bool return_info,
+                      const std::string& format) {
+    bool dlpack = PyOutputLayout::IsDLPack(format);
+    py_output.Update(layout);
+    return py_output.Build(RecvArrays(), py_spec.state_spec, reset,
+                           return_info, dlpack);
+  }
+
+  /**
+   * py api
+   *
+   * Fused send + recv for envs whose only action besides the ids is a single
+   * int per env, e.g. YGOPro's `action`. Both inputs must already be
+   * contiguous int32 arrays: they are copied into two new arrays on each
+   * call instead of being forcecast and kept alive with a GIL-acquiring
+   * deleter, and the GIL is released once for the whole step.
+   */
+  std::vector<py::object> PyStep(const py::array& action,
+                                const py::array& env_ids) {
+    std::vector<py::object> ret;
     ret.reserve(EnvPool::State::kSize);
-    ToNumpy(arr, py_spec.state_spec, &ret);
+    ToNumpy(StepArrays(action, env_ids), py_spec.state_spec, &ret);
     return ret;
   }
 
+  std::vector<Array> StepArrays(const py::array& action,
+                                const py::array& env_ids) {
+    using ActionValues = typename EnvPool::Spec::ActionSpec::Values;
+    using IntArray = py::array_t<int, py::array::c_style>;
+    if constexpr (std::tuple_size_v<ActionValues> == 3 &&
+                  std::is_same_v<
+                      typename std::tuple_element_t<2, ActionValues>::dtype,
+                      int>) {
+      if (py_spec.config["max_num_players"_] != 1 ||
+          !std::get<2>(py_spec.action_spec.AllValues()).shape.empty()) {
+        throw std::runtime_error(
+            "step fast path requires a single player and a scalar action");
+      }
+      if (!py::isinstance<IntArray>(action) ||
+          !py::isinstance<IntArray>(env_ids) || action.ndim() != 1 ||
+          env_ids.ndim() != 1 || action.shape(0) != env_ids.shape(0)) {
+        throw std::invalid_argument(
+            "action and env_id must be 1-d contiguous int32 arrays of the "
+            "same length");
+      }
+      int n = static_cast<int>(env_ids.shape(0));
+      Array ids(Spec<int>({n}));
+      Array act(Spec<int>({n}));
+      ids.Assign(static_cast<const int*>(env_ids.data()), n);
+      act.Assign(static_cast<const int*>(action.data()), n);
+      std::vector<Array> arr{ids, ids, act};
+      py::gil_scoped_release release;
+      EnvPool::Send(std::move(arr));
+      return EnvPool::Recv();
+    } else {
+      throw std::runtime_error(
+          "step fast path requires a single int32 action");
+    }
+  }
+
+  /**
+   * py api
+   *
+   * `PyStep` building the output of the python api, see PyOutputLayout.
+   */
+  py::object PyStepTo(const py::object& layout, const py::array& action,
+                      const py::array& env_ids) {
+    py_output.Update(layout);
+    return py_output.Build(StepArrays(action, env_ids), py_spec.state_spec,
+                           false, true, false);
+  }
+
   /**
    * py api
    */
@@ -249,6 +648,19 @@ class PyEnvPool : public EnvPool {
     py::gil_scoped_release release;
     EnvPool::Reset(arr);
   }
+
+  /**
+   * py api
+   */
+  void PyResize(std::size_t num_envs, std::size_t num_threads,
+                std::size_t batch_size) {
+    {
+      py::gil_scoped_release release;
+      EnvPool::Resize(num_envs, num_threads, batch_size);
+    }
+    py_spec.config = EnvPool::spec.config;
+    py_spec.py_config_values = py_spec.config.AllValues();
+  }
 };
 
 template <typename EnvPool>
@@ -258,6 +670,89 @@ template <typename EnvPool>
 std::vector<std::string> PyEnvPool<EnvPool>::py_action_keys =
     PyEnvPool<EnvPool>::PySpec::py_action_keys;
 
+/**
+ * Python client of a ShmEnvPoolServer serving `EnvPool`. It has the same
+ * private api as PyEnvPool, so the EnvPool metaclasses can wrap it.
+ */
+template <typename EnvPool>
+class PyShmEnvPoolClient : public ShmEnvPoolClient<typename EnvPool::Spec> {
+ public:
+  using Client = ShmEnvPoolClient<typename EnvPool::Spec>;
+  using PySpec = PyEnvSpec<typename EnvPool::Spec>;
+
+  PySpec py_spec;
+  PyOutputLayout py_output;
+
+  PyShmEnvPoolClient(const PySpec& py_spec, const std::string& name,
+                     int client_id)
+      : Client(py_spec, name, client_id), py_spec(py_spec) {}
+
+  void PySend(const std::vector<py::array>& action) {
+    std::vector<Array> arr;
+    arr.reserve(action.size());
+    ToArray(action, py_spec.action_spec, &arr);
+    py::gil_scoped_release release;
+    Client::Send(arr);
+  }
+
+  std::vector<Array> RecvArrays() {
+    py::gil_scoped_release release;
+    return Client::Recv();
+  }
+
+  std::vector<py::object> PyRecv() {
+    std::vector<py::object> ret;
+    ret.reserve(EnvPool::State::kSize);
+    ToNumpy(RecvArrays(), py_spec.state_spec, &ret);
+    return ret;
+  }
+
+  std::vector<py::object> PyRecvDLPack() {
+    std::vector<py::object> ret;
+    ret.reserve(EnvPool::State::kSize);
+    ToDLPack(RecvArrays(), py_spec.state_spec, &ret);
+    return ret;
+  }
+
+  py::object PyRecvTo(const py::object& layout, bool reset, bool return_info,
+                      const std::string& format) {
+    bool dlpack = PyOutputLayout::IsDLPack(format);
+    py_output.Update(layout);
+    return py_output.Build(RecvArrays(), py_spec.state_spec, reset,
+                           return_info, dlpack);
+  }
+
+  void PyReset(const py::array& env_ids) {
+    auto arr = NumpyToArrayIncRef<int>(env_ids);
+    py::gil_scoped_release release;
+    Client::Reset(arr);
+  }
+
+  std::vector<py::object> PyStep(const py::array& action,
+                                const py::array& env_ids) {
+    if (std::tuple_size_v<typename EnvPool::Spec::ActionSpec::Values> != 3) {
+      throw std::runtime_error(
+          "step fast path requires a single int32 action");
+    }
+    PySend({env_ids, env_ids, action});
+    return PyRecv();
+  }
+
+  py::object PyStepTo(const py::object& layout, const py::array& action,
+                      const py::array& env_ids) {
+    if (std::tuple_size_v<typename EnvPool::Spec::ActionSpec::Values> != 3) {
+      throw std::runtime_error(
+          "step fast path requires a single int32 action");
+    }
+    PySend({env_ids, env_ids, action});
+    py_output.Update(layout);
+    return py_output.Build(RecvArrays(), py_spec.state_spec, false, true,
+                           false);
+  }
+
+  [[nodiscard]] std::size_t PartitionOffset() const { return 0; }
+};
+
 py::object abc_meta = py::module::import("abc").attr("ABCMeta");
 
 /**
@@ -265,25 +760,80 @@ py::object abc_meta = py::module::import("abc").attr("ABCMeta");
  * It will register the envpool instance to the registry.
  * The static bool status is local to the translation unit.
  */
-#define REGISTER(MODULE, SPEC, ENVPOOL)                              \
-  py::class_<SPEC>(MODULE, "_" #SPEC, py::metaclass(abc_meta))       \
-      .def(py::init<const typename SPEC::ConfigValues&>())           \
-      .def_readonly("_config_values", &SPEC::py_config_values)       \
-      .def_readonly("_state_spec", &SPEC::py_state_spec)             \
-      .def_readonly("_action_spec", &SPEC::py_action_spec)           \
-      .def_readonly_static("_state_keys", &SPEC::py_state_keys)      \
-      .def_readonly_static("_action_keys", &SPEC::py_action_keys)    \
-      .def_readonly_static("_config_keys", &SPEC::py_config_keys)    \
-      .def_readonly_static("_default_config_values",                 \
-                           &SPEC::py_default_config_values);         \
-  py::class_<ENVPOOL>(MODULE, "_" #ENVPOOL, py::metaclass(abc_meta)) \
-      .def(py::init<const SPEC&>())                                  \
-      .def_readonly("_spec", &ENVPOOL::py_spec)                      \
-      .def("_recv", &ENVPOOL::PyRecv)                                \
-      .def("_send", &ENVPOOL::PySend)                                \
-      .def("_reset", &ENVPOOL::PyReset)                              \
-      .def_readonly_static("_state_keys", &ENVPOOL::py_state_keys)   \
-      .def_readonly_static("_action_keys",                           \
-                           &ENVPOOL::py_action_keys);                \
+#define REGISTER(MODULE, SPEC, ENVPOOL)                                     \
+  py::class_<SPEC>(MODULE, "_" #SPEC, py::metaclass(abc_meta))              \
+      .def(py::init<const typename SPEC::ConfigValues&>())                  \
+      .def_readonly("_config_values", &SPEC::py_config_values)              \
+      .def_readonly("_state_spec", &SPEC::py_state_spec)                    \
+      .def_readonly("_action_spec", &SPEC::py_action_spec)                  \
+      .def_readonly_static("_state_keys", &SPEC::py_state_keys)             \
+      .def_readonly_static("_action_keys", &SPEC::py_action_keys)           \
+      .def_readonly_static("_config_keys", &SPEC::py_config_keys)           \
+      .def_readonly_static("_default_config_values",                        \
+                           &SPEC::py_default_config_values);                \
+  py::class_<ENVPOOL>(MODULE, "_" #ENVPOOL, py::metaclass(abc_meta))        \
+      .def(py::init<const SPEC&>())                                         \
+      .def_readonly("_spec", &ENVPOOL::py_spec)                             \
+      .def("_recv", &ENVPOOL::PyRecv)                                       \
+      .def("_send", &ENVPOOL::PySend)                                       \
+      .def("_reset", &ENVPOOL::PyReset)                                     \
+      .def("_step", &ENVPOOL::PyStep)                                       \
+      .def("_recv_to", &ENVPOOL::PyRecvTo)                                  \
+      .def("_recv_dlpack", &ENVPOOL::PyRecvDLPack)                          \
+      .def("_step_to", &ENVPOOL::PyStepTo)                                  \
+      .def("_partition_offset", &ENVPOOL::PartitionOffset)                  \
+      .def("_resize", &ENVPOOL::PyResize)                                   \
+      .def_readonly_static("_state_keys", &ENVPOOL::py_state_keys)          \
+      .def_readonly_static("_action_keys",                                  \
+                           &ENVPOOL::py_action_keys);                       \
+  py::class_<ShmEnvPoolServer<ENVPOOL, SPEC>>(                              \
+      MODULE, "_" #ENVPOOL "ShmServer")                                     \
+      .def(py::init<const SPEC&, std::string, int, bool>(),                 \
+           py::arg("spec"), py::arg("name"), py::arg("num_clients"),        \
+           py::arg("unlink_existing") = false)                              \
+      .def("close", &ShmEnvPoolServer<ENVPOOL, SPEC>::Close,                \
+           py::call_guard<py::gil_scoped_release>());                       \
+  py::class_<PyShmEnvPoolClient<ENVPOOL>>(                                  \
+      MODULE, "_" #ENVPOOL "ShmClient", py::metaclass(abc_meta))            \
+      .def(py::init<const SPEC&, const std::string&, int>())                \
+      .def_readonly("_spec", &PyShmEnvPoolClient<ENVPOOL>::py_spec)         \
+      .def("_recv", &PyShmEnvPoolClient<ENVPOOL>::PyRecv)                   \
+      .def("_send", &PyShmEnvPoolClient<ENVPOOL>::PySend)                   \
+      .def("_reset", &PyShmEnvPoolClient<ENVPOOL>::PyReset)                 \
+      .def("_step", &PyShmEnvPoolClient<ENVPOOL>::PyStep)                   \
+      .def("_recv_to", &PyShmEnvPoolClient<ENVPOOL>::PyRecvTo)              \
+      .def("_recv_dlpack", &PyShmEnvPoolClient<ENVPOOL>::PyRecvDLPack)      \
+      .def("_step_to", &PyShmEnvPoolClient<ENVPOOL>::PyStepTo)              \
+      .def("_partition_offset",                                             \
+           &PyShmEnvPoolClient<ENVPOOL>::PartitionOffset)                   \
+      .def("_env_begin", &PyShmEnvPoolClient<ENVPOOL>::EnvBegin)            \
+      .def("_env_end", &PyShmEnvPoolClient<ENVPOOL>::EnvEnd)                \
+      .def_readonly_static("_state_keys", &ENVPOOL::py_state_keys)          \
+      .def_readonly_static("_action_keys", &ENVPOOL::py_action_keys);       \
+  using ENVPOOL##Remote = PyEnvPool<RemoteEnvPool<typename ENVPOOL::Spec>>; \
+  py::class_<ENVPOOL##Remote>(MODULE, "_" #ENVPOOL "Remote",                \
+                              py::metaclass(abc_meta))                      \
+      .def(py::init<const SPEC&, const std::vector<std::string>&>())        \
+      .def_readonly("_spec", &ENVPOOL##Remote::py_spec)                     \
+      .def("_recv", &ENVPOOL##Remote::PyRecv)                               \
+      .def("_send", &ENVPOOL##Remote::PySend)                               \
+      .def("_reset", &ENVPOOL##Remote::PyReset)                             \
+      .def("_step", &ENVPOOL##Remote::PyStep)                               \
+      .def("_recv_to", &ENVPOOL##Remote::PyRecvTo)                          \
+      .def("_recv_dlpack", &ENVPOOL##Remote::PyRecvDLPack)                  \
+      .def("_step_to", &ENVPOOL##Remote::PyStepTo)                          \
+      .def("_partition_offset", &ENVPOOL##Remote::PartitionOffset)          \
+      .def_readonly_static("_state_keys", &ENVPOOL::py_state_keys)          \
+      .def_readonly_static("_action_keys", &ENVPOOL::py_action_keys);       \
+  py::class_<RemoteEnvPoolServer<ENVPOOL, SPEC>>(                           \
+      MODULE, "_" #ENVPOOL "RemoteServer")                                  \
+      .def(py::init<const SPEC&, const std::string&,                        \
+                    const std::vector<std::string>&>(),                     \
+           py::arg("spec"), py::arg("address"),                             \
+           py::arg("compress_keys") = std::vector<std::string>())           \
+      .def("serve", &RemoteEnvPoolServer<ENVPOOL, SPEC>::Serve,             \
+           py::arg("max_sessions") = -1,                                    \
+           py::call_guard<py::gil_scoped_release>())                        \
+      .def("stop", &RemoteEnvPoolServer<ENVPOOL, SPEC>::Stop);
 
 #endif  // ENVPOOL_CORE_PY_ENVPOOL_H_
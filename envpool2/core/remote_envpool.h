@@ -0,0 +1,966 @@
+/*
+ * Copyright 2021 Garena Online Private Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENVPOOL_CORE_REMOTE_ENVPOOL_H_
+#define ENVPOOL_CORE_REMOTE_ENVPOOL_H_
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "envpool2/core/array.h"
+#include "envpool2/core/envpool.h"
+#include "envpool2/core/spec.h"
+
+/**
+ * Remote EnvPool
+ *
+ * RemoteEnvPoolServer wraps a pool behind a TCP or Unix socket, and
+ * RemoteEnvPool is an EnvPool whose Send / Recv / Reset talk to one or more
+ * such servers. Addresses are `tcp://host:port`, `host:port` or
+ * `unix:/path/to/socket`.
+ *
+ * Every message is a frame: a FrameHeader followed by `num_arrays` arrays,
+ * each an ArrayHeader, its dims and its raw bytes. Sends and resets are
+ * written without waiting for a reply, and the server streams a state frame
+ * for every batch its pool produces, so several batches can be in flight on
+ * one connection. Zero-heavy arrays such as `obs:cards_` can be sent run
+ * length encoded.
+ */
+
+namespace remote {
+
+constexpr uint32_t kMagic = 0x4d525045;  // "EPRM"
+constexpr uint32_t kVersion = 1;
+// larger frames are rejected before their payload is buffered
+constexpr uint64_t kMaxFrameBytes = static_cast<uint64_t>(1) << 32;
+
+enum FrameType : uint16_t {
+  kHello = 0,
+  kSend = 1,
+  kReset = 2,
+  kState = 3,
+  kError = 4,
+};
+
+enum Codec : uint8_t { kRaw = 0, kZeroRle = 1 };
+
+struct FrameHeader {
+  uint32_t magic;
+  uint16_t type;
+  uint16_t num_arrays;
+  // partition offset of a state frame
+  uint64_t aux;
+  uint64_t payload_bytes;
+};
+
+struct ArrayHeader {
+  uint8_t codec;
+  uint8_t ndim;
+  uint16_t element_size;
+  uint32_t reserved;
+  uint64_t raw_bytes;
+  uint64_t stored_bytes;
+};
+
+/**
+ * Run length encoding of zero bytes: a sequence of (u32 zeros, u32 literals,
+ * literal bytes). The card features are mostly zero, so this removes most of
+ * their size at memcpy speed.
+ */
+inline void ZeroRleEncode(const char* src, std::size_t n,
+                          std::vector<char>* out) {
+  constexpr std::size_t kMinZeros = 8;
+  constexpr std::size_t kMaxRun = UINT32_MAX;
+  std::size_t i = 0;
+  while (i < n) {
+    std::size_t zeros = 0;
+    while (i + zeros < n && src[i + zeros] == 0 && zeros < kMaxRun) {
+      ++zeros;
+    }
+    i += zeros;
+    std::size_t begin = i;
+    std::size_t run = 0;
+    // extend the literal until a run of zeros worth encoding starts
+    while (i < n && i - begin < kMaxRun) {
+      run = src[i] == 0 ? run + 1 : 0;
+      ++i;
+      if (run == kMinZeros) {
+        i -= kMinZeros;
+        break;
+      }
+    }
+    std::size_t literals = i - begin;
+    auto z = static_cast<uint32_t>(zeros);
+    auto l = static_cast<uint32_t>(literals);
+    std::size_t pos = out->size();
+    out->resize(pos + 8 + literals);
+    std::memcpy(out->data() + pos, &z, 4);
+    std::memcpy(out->data() + pos + 4, &l, 4);
+    std::memcpy(out->data() + pos + 8, src + begin, literals);
+  }
+}
+
+inline void ZeroRleDecode(const char* src, std::size_t n, char* dst,
+                          std::size_t raw) {
+  std::size_t i = 0;
+  std::size_t o = 0;
+  while (i < n) {
+    uint32_t zeros;
+    uint32_t literals;
+    if (i + 8 > n) {
+      throw std::runtime_error("Corrupted remote array");
+    }
+    std::memcpy(&zeros, src + i, 4);
+    std::memcpy(&literals, src + i + 4, 4);
+    i += 8;
+    if (o + zeros + literals > raw || i + literals > n) {
+      throw std::runtime_error("Corrupted remote array");
+    }
+    std::memset(dst + o, 0, zeros);
+    std::memcpy(dst + o + zeros, src + i, literals);
+    o += zeros + literals;
+    i += literals;
+  }
+  if (o != raw) {
+    throw std::runtime_error("Corrupted remote array");
+  }
+}
+
+class Socket {
+ protected:
+  int fd_{-1};
+
+ public:
+  Socket() = default;
+  explicit Socket(int fd) : fd_(fd) {}
+  ~Socket() { Close(); }
+  Socket(Socket&& other) noexcept : fd_(other.fd_) { other.fd_ = -1; }
+  Socket& operator=(Socket&& other) noexcept {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  [[nodiscard]] int Fd() const { return fd_; }
+
+  void Close() {
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  /**
+   * Wake up a thread blocked on this socket, which then sees EOF.
+   */
+  void Shutdown() const {
+    if (fd_ >= 0) {
+      shutdown(fd_, SHUT_RDWR);
+    }
+  }
+
+  static Socket Connect(const std::string& address) {
+    return Open(address, false);
+  }
+
+  static Socket Listen(const std::string& address) {
+    return Open(address, true);
+  }
+
+  [[nodiscard]] Socket Accept() const {
+    int fd = accept(fd_, nullptr, nullptr);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("accept: ") + strerror(errno));
+    }
+    SetNoDelay(fd);
+    return Socket(fd);
+  }
+
+  void WriteAll(const void* data, std::size_t n) const {
+    const char* p = static_cast<const char*>(data);
+    while (n > 0) {
+      ssize_t w = send(fd_, p, n, MSG_NOSIGNAL);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        throw std::runtime_error("Remote EnvPool connection closed");
+      }
+      p += w;
+      n -= w;
+    }
+  }
+
+  void ReadAll(void* data, std::size_t n) const {
+    char* p = static_cast<char*>(data);
+    while (n > 0) {
+      ssize_t r = recv(fd_, p, n, 0);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        throw std::runtime_error("Remote EnvPool connection closed");
+      }
+      p += r;
+      n -= r;
+    }
+  }
+
+ protected:
+  static void SetNoDelay(int fd) {
+    int one = 1;
+    // fails harmlessly on unix sockets
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  /**
+   * Unlink the unix socket at `path` if it is left over from a server that is
+   * gone, i.e. connecting to it is refused. A socket that is still served, or
+   * that can't be probed, is reported as in use; other files are kept and
+   * make `bind` fail.
+   */
+  static void RemoveStaleSocket(const std::string& path,
+                                const sockaddr_un& sa) {
+    struct stat st {};
+    if (lstat(path.c_str(), &st) != 0 || !S_ISSOCK(st.st_mode)) {
+      return;
+    }
+    Socket probe(socket(AF_UNIX, SOCK_STREAM, 0));
+    if (connect(probe.fd_, reinterpret_cast<const sockaddr*>(&sa),
+                sizeof(sa)) != 0 &&
+        errno == ECONNREFUSED) {
+      unlink(path.c_str());
+      return;
+    }
+    throw std::runtime_error("Cannot listen on unix:" + path +
+                             ": address in use");
+  }
+
+  static Socket Open(const std::string& address, bool listen_mode) {
+    std::string addr = address;
+    if (addr.rfind("unix:", 0) == 0) {
+      std::string path = addr.substr(5);
+      if (path.rfind("//", 0) == 0) {
+        path = path.substr(2);
+      }
+      sockaddr_un sa{};
+      if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+        throw std::invalid_argument("Invalid unix socket path " + path);
+      }
+      sa.sun_family = AF_UNIX;
+      std::memcpy(sa.sun_path, path.c_str(), path.size());
+      Socket sock(socket(AF_UNIX, SOCK_STREAM, 0));
+      if (listen_mode) {
+        RemoveStaleSocket(path, sa);
+        if (bind(sock.fd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+            listen(sock.fd_, 16) != 0) {
+          throw std::runtime_error("Cannot listen on " + address + ": " +
+                                   strerror(errno));
+        }
+      } else if (connect(sock.fd_, reinterpret_cast<sockaddr*>(&sa),
+                         sizeof(sa)) != 0) {
+        throw std::runtime_error("Cannot connect to " + address + ": " +
+                                 strerror(errno));
+      }
+      return sock;
+    }
+    if (addr.rfind("tcp://", 0) == 0) {
+      addr = addr.substr(6);
+    }
+    auto colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("Invalid address " + address);
+    }
+    std::string host = addr.substr(0, colon);
+    std::string port = addr.substr(colon + 1);
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listen_mode ? AI_PASSIVE : 0;
+    addrinfo* res = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                    &hints, &res) != 0) {
+      throw std::runtime_error("Cannot resolve " + address);
+    }
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> guard(res,
+                                                              freeaddrinfo);
+    for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+      Socket sock(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+      if (sock.fd_ < 0) {
+        continue;
+      }
+      if (listen_mode) {
+        int one = 1;
+        setsockopt(sock.fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(sock.fd_, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(sock.fd_, 16) == 0) {
+          return sock;
+        }
+      } else if (connect(sock.fd_, ai->ai_addr, ai->ai_addrlen) == 0) {
+        SetNoDelay(sock.fd_);
+        return sock;
+      }
+    }
+    throw std::runtime_error(std::string("Cannot ") +
+                             (listen_mode ? "listen on " : "connect to ") +
+                             address + ": " + strerror(errno));
+  }
+};
+
+/**
+ * Serializes a frame into a reusable buffer, so that it goes out with a
+ * single write.
+ */
+class FrameWriter {
+ protected:
+  std::vector<char> buf_;
+  std::vector<char> scratch_;
+
+ public:
+  void Begin(FrameType type, uint64_t aux = 0) {
+    buf_.resize(sizeof(FrameHeader));
+    FrameHeader h{kMagic, type, 0, aux, 0};
+    std::memcpy(buf_.data(), &h, sizeof(h));
+  }
+
+  void Add(const Array& a, bool compress = false) {
+    std::size_t raw = a.size * a.element_size;
+    const char* data = static_cast<const char*>(a.Data());
+    ArrayHeader ah{kRaw, static_cast<uint8_t>(a.ndim),
+                   static_cast<uint16_t>(a.element_size), 0, raw, raw};
+    if (compress) {
+      scratch_.clear();
+      ZeroRleEncode(data, raw, &scratch_);
+      if (scratch_.size() < raw) {
+        ah.codec = kZeroRle;
+        ah.stored_bytes = scratch_.size();
+        data = scratch_.data();
+      }
+    }
+    std::size_t pos = buf_.size();
+    buf_.resize(pos + sizeof(ah) + a.ndim * sizeof(uint64_t) +
+                ah.stored_bytes);
+    char* p = buf_.data() + pos;
+    std::memcpy(p, &ah, sizeof(ah));
+    p += sizeof(ah);
+    for (std::size_t d = 0; d < a.ndim; ++d) {
+      uint64_t dim = a.Shape(d);
+      std::memcpy(p, &dim, sizeof(dim));
+      p += sizeof(dim);
+    }
+    std::memcpy(p, data, ah.stored_bytes);
+    auto* h = reinterpret_cast<FrameHeader*>(buf_.data());
+    ++h->num_arrays;
+  }
+
+  void Write(const Socket& sock) {
+    auto* h = reinterpret_cast<FrameHeader*>(buf_.data());
+    h->payload_bytes = buf_.size() - sizeof(FrameHeader);
+    sock.WriteAll(buf_.data(), buf_.size());
+  }
+};
+
+struct Frame {
+  FrameType type;
+  uint64_t aux;
+  std::vector<Array> arrays;
+};
+
+inline Frame ReadFrame(const Socket& sock, std::vector<char>* buf) {
+  FrameHeader h{};
+  sock.ReadAll(&h, sizeof(h));
+  if (h.magic != kMagic) {
+    throw std::runtime_error("Invalid remote EnvPool frame");
+  }
+  if (h.payload_bytes > kMaxFrameBytes) {
+    throw std::runtime_error("Remote EnvPool frame of " +
+                             std::to_string(h.payload_bytes) +
+                             " bytes is too large");
+  }
+  buf->resize(h.payload_bytes);
+  sock.ReadAll(buf->data(), buf->size());
+  Frame frame{static_cast<FrameType>(h.type), h.aux, {}};
+  frame.arrays.reserve(h.num_arrays);
+  const char* p = buf->data();
+  const char* end = p + buf->size();
+  for (uint16_t i = 0; i < h.num_arrays; ++i) {
+    ArrayHeader ah{};
+    if (p + sizeof(ah) > end) {
+      throw std::runtime_error("Corrupted remote EnvPool frame");
+    }
+    std::memcpy(&ah, p, sizeof(ah));
+    p += sizeof(ah);
+    std::vector<int> shape(ah.ndim);
+    std::size_t size = ah.element_size;
+    if (p + ah.ndim * sizeof(uint64_t) > end) {
+      throw std::runtime_error("Corrupted remote EnvPool frame");
+    }
+    for (auto& dim : shape) {
+      uint64_t d;
+      std::memcpy(&d, p, sizeof(d));
+      p += sizeof(d);
+      if (d > INT_MAX || (d != 0 && size > SIZE_MAX / d)) {
+        throw std::runtime_error("Corrupted remote EnvPool frame");
+      }
+      dim = static_cast<int>(d);
+      size *= d;
+    }
+    if (size != ah.raw_bytes ||
+        static_cast<std::size_t>(end - p) < ah.stored_bytes ||
+        (ah.codec == kRaw && ah.stored_bytes != ah.raw_bytes) ||
+        (ah.codec != kRaw && ah.codec != kZeroRle)) {
+      throw std::runtime_error("Corrupted remote EnvPool frame");
+    }
+    Array a(ShapeSpec(ah.element_size, std::move(shape)));
+    if (a.size * a.element_size != ah.raw_bytes) {
+      throw std::runtime_error("Corrupted remote EnvPool frame");
+    }
+    if (ah.codec == kZeroRle) {
+      ZeroRleDecode(p, ah.stored_bytes, static_cast<char*>(a.Data()),
+                    ah.raw_bytes);
+    } else {
+      std::memcpy(a.Data(), p, ah.raw_bytes);
+    }
+    p += ah.stored_bytes;
+    frame.arrays.emplace_back(std::move(a));
+  }
+  if (frame.type == kError) {
+    std::string msg;
+    if (!frame.arrays.empty()) {
+      const Array& a = frame.arrays[0];
+      msg.assign(static_cast<const char*>(a.Data()), a.size);
+    }
+    throw std::runtime_error("Remote EnvPool server: " + msg);
+  }
+  return frame;
+}
+
+/**
+ * Fingerprint of the shapes and element sizes of the state and action specs,
+ * compared at connection time to catch mismatched configs.
+ */
+inline int64_t SpecHash(const std::vector<ShapeSpec>& states,
+                        const std::vector<ShapeSpec>& actions) {
+  uint64_t h = 1469598103934665603ULL;
+  auto mix = [&](int64_t v) {
+    h = (h ^ static_cast<uint64_t>(v)) * 1099511628211ULL;
+  };
+  for (const auto* specs : {&states, &actions}) {
+    mix(static_cast<int64_t>(specs->size()));
+    for (const ShapeSpec& s : *specs) {
+      mix(s.element_size);
+      for (int d : s.shape) {
+        mix(d);
+      }
+    }
+  }
+  return static_cast<int64_t>(h >> 1);
+}
+
+/**
+ * Set a config entry from its string form, for command line servers.
+ */
+template <typename Config>
+void SetConfig(Config* config, const std::string& key,
+               const std::string& value) {
+  auto keys = Config::AllKeys();
+  auto it = std::find(keys.begin(), keys.end(), key);
+  if (it == keys.end()) {
+    throw std::invalid_argument("Unknown config key " + key);
+  }
+  std::size_t index = it - keys.begin();
+  std::size_t i = 0;
+  auto set = [&](auto& v) {
+    using T = std::decay_t<decltype(v)>;
+    if constexpr (std::is_same_v<T, std::string>) {
+      v = value;
+    } else if constexpr (std::is_same_v<T, bool>) {
+      v = value == "1" || value == "true" || value == "True";
+    } else if constexpr (std::is_arithmetic_v<T>) {
+      std::istringstream is(value);
+      if (!(is >> v)) {
+        throw std::invalid_argument("Invalid value " + value + " of " + key);
+      }
+    } else {
+      throw std::invalid_argument("Config " + key +
+                                  " cannot be set from the command line");
+    }
+  };
+  std::apply([&](auto&... v) { ((i++ == index ? set(v) : void()), ...); },
+             config->AllValues());
+}
+
+}  // namespace remote
+
+/**
+ * Serves `Pool` to one RemoteEnvPool at a time. Each connection gets a fresh
+ * pool, so a client that reconnects never sees states of the previous one.
+ * States whose key is in `compress_keys` are sent zero run length encoded.
+ */
+template <typename Pool, typename PoolSpec = typename Pool::Spec>
+class RemoteEnvPoolServer {
+ protected:
+  PoolSpec spec_;
+  std::vector<bool> compress_;
+  remote::Socket listener_;
+  std::atomic<bool> stop_{false};
+  std::mutex session_mu_;
+  remote::Socket* session_{nullptr};
+
+ public:
+  RemoteEnvPoolServer(const PoolSpec& spec, const std::string& address,
+                      const std::vector<std::string>& compress_keys = {})
+      : spec_(spec), listener_(remote::Socket::Listen(address)) {
+    using StateValues = typename PoolSpec::StateSpec::Values;
+    if constexpr (HasContainer<StateValues>::value) {
+      throw std::invalid_argument(
+          "Container states cannot be sent to a remote EnvPool");
+    }
+    auto keys = PoolSpec::StateSpec::AllKeys();
+    compress_.resize(keys.size());
+    for (const auto& key : compress_keys) {
+      auto it = std::find(keys.begin(), keys.end(), key);
+      if (it == keys.end()) {
+        throw std::invalid_argument("Unknown state key " + key);
+      }
+      compress_[it - keys.begin()] = true;
+    }
+  }
+
+  /**
+   * Accept and serve connections one after another, until `Stop` is called
+   * or `max_sessions` connections have been served.
+   */
+  void Serve(int max_sessions = -1) {
+    for (int n = 0; !stop_ && n != max_sessions; ++n) {
+      remote::Socket sock;
+      try {
+        sock = listener_.Accept();
+      } catch (const std::exception& e) {
+        if (stop_) {
+          break;
+        }
+        throw;
+      }
+      {
+        std::lock_guard<std::mutex> lock(session_mu_);
+        if (stop_) {
+          break;
+        }
+        session_ = &sock;
+      }
+      Session(sock);
+      std::lock_guard<std::mutex> lock(session_mu_);
+      session_ = nullptr;
+    }
+  }
+
+  void Stop() {
+    stop_ = true;
+    listener_.Shutdown();
+    std::lock_guard<std::mutex> lock(session_mu_);
+    if (session_ != nullptr) {
+      session_->Shutdown();
+    }
+  }
+
+ protected:
+  void Session(const remote::Socket& sock) {
+    Pool pool(spec_);
+    std::size_t num_envs = spec_.config["num_envs"_];
+    std::size_t batch = spec_.config["batch_size"_] <= 0
+                            ? num_envs
+                            : spec_.config["batch_size"_];
+    auto action_specs = spec_.action_spec.template AllValues<ShapeSpec>();
+    remote::FrameWriter hello;
+    hello.Begin(remote::kHello);
+    Array info(Spec<int64_t>({4}));
+    auto* p = static_cast<int64_t*>(info.Data());
+    p[0] = remote::kVersion;
+    p[1] = static_cast<int64_t>(num_envs);
+    p[2] = static_cast<int64_t>(batch);
+    p[3] = remote::SpecHash(spec_.state_spec.template AllValues<ShapeSpec>(),
+                            action_specs);
+    hello.Add(info);
+    hello.Write(sock);
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::size_t in_flight = 0;
+    bool closed = false;
+    std::thread writer([&] {
+      remote::FrameWriter out;
+      for (;;) {
+        {
+          // only wait on the pool for batches that will complete
+          std::unique_lock<std::mutex> lock(mu);
+          cv.wait(lock, [&] { return closed || in_flight >= batch; });
+          if (in_flight < batch) {
+            return;
+          }
+          in_flight -= batch;
+        }
+        std::vector<Array> state = pool.Recv();
+        out.Begin(remote::kState, pool.PartitionOffset());
+        for (std::size_t i = 0; i < state.size(); ++i) {
+          out.Add(state[i], compress_[i]);
+        }
+        try {
+          out.Write(sock);
+        } catch (const std::exception& e) {
+          sock.Shutdown();
+        }
+      }
+    });
+
+    std::vector<char> buf;
+    remote::FrameWriter err;
+    try {
+      for (;;) {
+        remote::Frame frame = remote::ReadFrame(sock, &buf);
+        std::size_t rows = CheckRequest(frame, action_specs, num_envs);
+        if (frame.type == remote::kSend) {
+          pool.Send(std::move(frame.arrays));
+        } else {
+          pool.Reset(frame.arrays[0]);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          in_flight += rows;
+        }
+        cv.notify_one();
+      }
+    } catch (const std::invalid_argument& e) {
+      std::string msg = e.what();
+      Array a(Spec<char>({static_cast<int>(msg.size())}));
+      std::memcpy(a.Data(), msg.data(), msg.size());
+      err.Begin(remote::kError);
+      err.Add(a);
+      try {
+        err.Write(sock);
+      } catch (const std::exception& ignored) {
+      }
+    } catch (const std::exception& e) {
+      // the client went away
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      closed = true;
+    }
+    cv.notify_one();
+    writer.join();
+  }
+
+  /**
+   * Validate a request before handing it to the pool, which trusts its input.
+   * Returns the number of states it will produce.
+   */
+  static std::size_t CheckRequest(const remote::Frame& frame,
+                                  const std::vector<ShapeSpec>& specs,
+                                  std::size_t num_envs) {
+    if (frame.type != remote::kSend && frame.type != remote::kReset) {
+      throw std::invalid_argument("unexpected frame");
+    }
+    if (frame.arrays.empty() || frame.arrays[0].ndim != 1 ||
+        frame.arrays[0].element_size != sizeof(int)) {
+      throw std::invalid_argument("malformed env_id");
+    }
+    const Array& env_id = frame.arrays[0];
+    std::size_t rows = env_id.Shape(0);
+    const int* ids = static_cast<const int*>(env_id.Data());
+    for (std::size_t i = 0; i < rows; ++i) {
+      if (ids[i] < 0 || static_cast<std::size_t>(ids[i]) >= num_envs) {
+        throw std::invalid_argument("env_id out of range");
+      }
+    }
+    if (frame.type == remote::kReset) {
+      return rows;
+    }
+    if (frame.arrays.size() != specs.size()) {
+      throw std::invalid_argument("wrong number of actions");
+    }
+    for (std::size_t i = 0; i < specs.size(); ++i) {
+      const Array& a = frame.arrays[i];
+      const ShapeSpec& s = specs[i];
+      bool is_player = !s.shape.empty() && s.shape[0] == -1;
+      std::size_t inner = is_player ? s.shape.size() - 1 : s.shape.size();
+      bool ok = a.element_size == static_cast<std::size_t>(s.element_size) &&
+                a.ndim == inner + 1 &&
+                (is_player || a.Shape(0) == rows);
+      for (std::size_t d = 0; ok && d < inner; ++d) {
+        ok = a.Shape(d + 1) ==
+             static_cast<std::size_t>(s.shape[s.shape.size() - inner + d]);
+      }
+      if (!ok) {
+        throw std::invalid_argument("action " + std::to_string(i) +
+                                    " does not match the spec");
+      }
+    }
+    const Array& players = frame.arrays[1];
+    const int* player_env_id = static_cast<const int*>(players.Data());
+    for (std::size_t i = 0; i < players.Shape(0); ++i) {
+      if (player_env_id[i] < 0 ||
+          static_cast<std::size_t>(player_env_id[i]) >= num_envs) {
+        throw std::invalid_argument("players.env_id out of range");
+      }
+    }
+    return rows;
+  }
+};
+
+/**
+ * EnvPool backed by one or more RemoteEnvPoolServer. With several servers the
+ * envs are numbered consecutively in the order of `addresses`, and the spec's
+ * `num_envs` must be their total. Recv returns the batches of all servers in
+ * arrival order; a batch always comes from a single server.
+ */
+template <typename EnvSpec>
+class RemoteEnvPool : public EnvPool<EnvSpec> {
+ protected:
+  struct Connection {
+    remote::Socket sock;
+    int env_offset, num_envs;
+    std::thread reader;
+    remote::FrameWriter out;
+  };
+
+  std::vector<std::unique_ptr<Connection>> conns_;
+  std::vector<int> conn_of_env_;
+  std::vector<bool> is_player_action_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<remote::Frame> ready_;
+  std::exception_ptr error_;
+  std::size_t partition_offset_{0};
+
+ public:
+  using Spec = EnvSpec;
+
+  RemoteEnvPool(const EnvSpec& spec, const std::vector<std::string>& addresses)
+      : EnvPool<EnvSpec>(spec) {
+    auto action_specs = spec.action_spec.template AllValues<ShapeSpec>();
+    for (const ShapeSpec& s : action_specs) {
+      is_player_action_.push_back(!s.shape.empty() && s.shape[0] == -1);
+    }
+    int64_t hash = remote::SpecHash(
+        spec.state_spec.template AllValues<ShapeSpec>(), action_specs);
+    if (addresses.empty()) {
+      throw std::invalid_argument("No remote EnvPool address given");
+    }
+    std::vector<char> buf;
+    int total = 0;
+    for (const auto& address : addresses) {
+      auto conn = std::make_unique<Connection>();
+      conn->sock = remote::Socket::Connect(address);
+      remote::Frame hello = remote::ReadFrame(conn->sock, &buf);
+      const auto* info = static_cast<const int64_t*>(hello.arrays.at(0).Data());
+      if (hello.type != remote::kHello || info[0] != remote::kVersion ||
+          info[3] != hash) {
+        throw std::runtime_error("Remote EnvPool at " + address +
+                                 " does not match the spec of this pool");
+      }
+      conn->env_offset = total;
+      conn->num_envs = static_cast<int>(info[1]);
+      total += conn->num_envs;
+      conn_of_env_.insert(conn_of_env_.end(), conn->num_envs,
+                          static_cast<int>(conns_.size()));
+      conns_.emplace_back(std::move(conn));
+    }
+    if (total != spec.config["num_envs"_]) {
+      throw std::invalid_argument(
+          "num_envs must be the total of the remote pools, which is " +
+          std::to_string(total));
+    }
+    for (auto& conn : conns_) {
+      Connection* c = conn.get();
+      c->reader = std::thread([this, c] { Read(c); });
+    }
+  }
+
+  ~RemoteEnvPool() override {
+    for (auto& conn : conns_) {
+      conn->sock.Shutdown();
+    }
+    for (auto& conn : conns_) {
+      conn->reader.join();
+    }
+  }
+
+  void Send(const std::vector<Array>& action) override {
+    if (conns_.size() == 1) {
+      Write(conns_[0].get(), remote::kSend, action);
+      return;
+    }
+    const int* env_id = static_cast<const int*>(action[0].Data());
+    const int* player_env_id = static_cast<const int*>(action[1].Data());
+    for (std::size_t c = 0; c < conns_.size(); ++c) {
+      std::vector<int> rows;
+      std::vector<int> player_rows;
+      for (std::size_t i = 0; i < action[0].Shape(0); ++i) {
+        if (conn_of_env_.at(env_id[i]) == static_cast<int>(c)) {
+          rows.push_back(i);
+        }
+      }
+      if (rows.empty()) {
+        continue;
+      }
+      for (std::size_t i = 0; i < action[1].Shape(0); ++i) {
+        if (conn_of_env_.at(player_env_id[i]) == static_cast<int>(c)) {
+          player_rows.push_back(i);
+        }
+      }
+      std::vector<Array> part;
+      part.reserve(action.size());
+      for (std::size_t k = 0; k < action.size(); ++k) {
+        part.emplace_back(
+            Gather(action[k], is_player_action_[k] ? player_rows : rows));
+      }
+      Localize(&part[0], conns_[c]->env_offset);
+      Localize(&part[1], conns_[c]->env_offset);
+      Write(conns_[c].get(), remote::kSend, part);
+    }
+  }
+
+  void Send(std::vector<Array>&& action) override {
+    Send(static_cast<const std::vector<Array>&>(action));
+  }
+
+  std::vector<Array> Recv() override {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&] { return !ready_.empty() || error_ != nullptr; });
+    if (ready_.empty()) {
+      std::rethrow_exception(error_);
+    }
+    remote::Frame frame = std::move(ready_.front());
+    ready_.pop_front();
+    partition_offset_ = frame.aux;
+    return std::move(frame.arrays);
+  }
+
+  void Reset(const Array& env_ids) override {
+    if (conns_.size() == 1) {
+      Write(conns_[0].get(), remote::kReset, {env_ids});
+      return;
+    }
+    const int* ids = static_cast<const int*>(env_ids.Data());
+    for (std::size_t c = 0; c < conns_.size(); ++c) {
+      std::vector<int> rows;
+      for (std::size_t i = 0; i < env_ids.Shape(0); ++i) {
+        if (conn_of_env_.at(ids[i]) == static_cast<int>(c)) {
+          rows.push_back(i);
+        }
+      }
+      if (!rows.empty()) {
+        Array part = Gather(env_ids, rows);
+        Localize(&part, conns_[c]->env_offset);
+        Write(conns_[c].get(), remote::kReset, {part});
+      }
+    }
+  }
+
+  /**
+   * Partition offset of the last received batch, see AsyncEnvPool.
+   */
+  [[nodiscard]] std::size_t PartitionOffset() const {
+    return partition_offset_;
+  }
+
+ protected:
+  void Write(Connection* c, remote::FrameType type,
+             const std::vector<Array>& arrays) {
+    c->out.Begin(type);
+    for (const Array& a : arrays) {
+      c->out.Add(a);
+    }
+    c->out.Write(c->sock);
+  }
+
+  void Read(Connection* c) {
+    std::vector<char> buf;
+    try {
+      for (;;) {
+        remote::Frame frame = remote::ReadFrame(c->sock, &buf);
+        if (c->env_offset != 0) {
+          // info:env_id and info:players.env_id
+          Globalize(&frame.arrays[0], c->env_offset);
+          Globalize(&frame.arrays[1], c->env_offset);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mu_);
+          ready_.emplace_back(std::move(frame));
+        }
+        cv_.notify_one();
+      }
+    } catch (const std::exception& e) {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (error_ == nullptr) {
+        error_ = std::current_exception();
+      }
+      cv_.notify_all();
+    }
+  }
+
+  static Array Gather(const Array& a, const std::vector<int>& rows) {
+    std::vector<int> shape(a.Shape().begin(), a.Shape().end());
+    shape[0] = static_cast<int>(rows.size());
+    Array ret(ShapeSpec(static_cast<int>(a.element_size), shape));
+    std::size_t row_bytes = a.Shape(0) == 0 ? 0 : a.size / a.Shape(0) *
+                                                      a.element_size;
+    const char* src = static_cast<const char*>(a.Data());
+    char* dst = static_cast<char*>(ret.Data());
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+      std::memcpy(dst + i * row_bytes, src + rows[i] * row_bytes, row_bytes);
+    }
+    return ret;
+  }
+
+  static void Localize(Array* ids, int offset) {
+    int* p = static_cast<int*>(ids->Data());
+    for (std::size_t i = 0; i < ids->size; ++i) {
+      p[i] -= offset;
+    }
+  }
+
+  static void Globalize(Array* ids, int offset) { Localize(ids, -offset); }
+};
+
+#endif  // ENVPOOL_CORE_REMOTE_ENVPOOL_H_
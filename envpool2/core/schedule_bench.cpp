@@ -0,0 +1,144 @@
+// Compares the recv latency of the action queue's schedule policies in async
+// mode, e.g.
+//
+//   schedule_bench [NUM_ENVS] [BATCH] [NUM_THREADS] [NUM_BATCHES]
+//
+// The envs are DummyEnvs with a busy-wait step of 20us, except for one in
+// eight which takes ten times as long; which ones are slow changes every 500
+// batches. Another one in eight suspends its steps for 100us, as if waiting
+// for an opponent.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "envpool2/dummy/dummy_envpool.h"
+
+namespace {
+
+using dummy::DummyEnv;
+using dummy::DummyEnvSpec;
+
+std::atomic<std::size_t> regime{0};
+
+class BenchEnv : public DummyEnv {
+ protected:
+  std::thread opponent_;
+  std::optional<Action> action_;
+
+ public:
+  // suspending needs the envs to be stepped one by one
+  static constexpr std::size_t kMaxStepBatch = 1;
+  using Env<DummyEnvSpec>::StepBatch;
+  using DummyEnv::DummyEnv;
+
+  ~BenchEnv() override {
+    if (opponent_.joinable()) {
+      opponent_.join();
+    }
+  }
+
+  void Step(const Action& action) override {
+    if (env_id_ % 8 == 4 && CanSuspend()) {
+      action_.emplace(action);
+      if (opponent_.joinable()) {
+        opponent_.join();
+      }
+      Suspend();
+      opponent_ = std::thread([this] {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        Wake();
+      });
+      return;
+    }
+    Work();
+    DummyEnv::Step(action);
+  }
+
+  void Resume() override {
+    Work();
+    DummyEnv::Step(*action_);
+    action_.reset();
+  }
+
+ protected:
+  void Work() const {
+    bool slow = (env_id_ + regime) % 8 == 1;
+    auto until = std::chrono::steady_clock::now() +
+                 std::chrono::microseconds(slow ? 200 : 20);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+  }
+};
+
+void Run(const std::string& policy, int num_envs, int batch, int num_threads,
+         int num_batches) {
+  auto conf = DummyEnvSpec::kDefaultConfig;
+  conf["num_envs"_] = num_envs;
+  conf["batch_size"_] = batch;
+  conf["num_threads"_] = num_threads;
+  conf["schedule_policy"_] = policy;
+  DummyEnvSpec spec(conf);
+  AsyncEnvPool<BenchEnv> pool(spec);
+  std::vector<int> ids(num_envs);
+  for (int i = 0; i < num_envs; ++i) {
+    ids[i] = i;
+  }
+  Array env_ids(Spec<int>({num_envs}));
+  env_ids.Assign(ids.data(), num_envs);
+  pool.Reset(env_ids);
+  std::vector<double> latency;
+  auto start = std::chrono::steady_clock::now();
+  for (int b = 0; b < num_batches; ++b) {
+    regime = b / 500;
+    auto t = std::chrono::steady_clock::now();
+    auto state = pool.Recv();
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - t;
+    latency.push_back(elapsed.count());
+    int n = state[0].Shape(0);
+    int num_players = state[1].Shape(0);
+    std::vector<Array> action;
+    for (const auto& s : spec.action_spec.AllValues<ShapeSpec>()) {
+      ShapeSpec shape = s;
+      if (!shape.shape.empty() && shape.shape[0] == -1) {
+        shape.shape[0] = num_players;
+      } else {
+        shape = shape.Batch(n);
+      }
+      action.emplace_back(shape);
+    }
+    action[0].Assign(static_cast<int*>(state[0].Data()), n);
+    action[1].Assign(static_cast<int*>(state[1].Data()), num_players);
+    pool.Send(action);
+  }
+  std::chrono::duration<double> total =
+      std::chrono::steady_clock::now() - start;
+  pool.Recv();
+  std::sort(latency.begin(), latency.end());
+  std::printf("%-8s p50 %8.1f us  p99 %8.1f us  %10.0f steps/s\n",
+              policy.c_str(), latency[latency.size() / 2],
+              latency[latency.size() * 99 / 100],
+              static_cast<double>(num_batches) * batch / total.count());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int num_envs = argc > 1 ? std::atoi(argv[1]) : 64;
+  int batch = argc > 2 ? std::atoi(argv[2]) : 16;
+  int num_threads = argc > 3 ? std::atoi(argv[3])
+                             : static_cast<int>(std::min<unsigned>(
+                                   std::thread::hardware_concurrency(), 8));
+  int num_batches = argc > 4 ? std::atoi(argv[4]) : 3000;
+  for (const char* policy : {"fifo", "oldest", "cost"}) {
+    Run(policy, num_envs, batch, num_threads, num_batches);
+  }
+  return 0;
+}
@@ -0,0 +1,795 @@
+/*
+ * Copyright 2021 Garena Online Private Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENVPOOL_CORE_SHM_ENVPOOL_H_
+#define ENVPOOL_CORE_SHM_ENVPOOL_H_
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "envpool2/core/array.h"
+#include "envpool2/core/dict.h"
+#include "envpool2/core/spec.h"
+#include "envpool2/core/state_buffer_queue.h"
+
+/**
+ * Shared-memory EnvPool server
+ *
+ * One process owns an AsyncEnvPool and serves several client processes. Each
+ * client owns a contiguous range of envs and a POSIX shared memory segment
+ * `<name>.<client_id>` that holds
+ *
+ *   header | action area | published ring | release ring | state slots
+ *
+ * The envs of a client write their states directly into the state slots: the
+ * client's state queue in the pool allocates its StateBuffers there, so a
+ * received batch is a view of shared memory on both sides. Actions are small
+ * and copied out of the action area by the server. Both sides block on futexes
+ * in the header; server-side waits time out so that a dead client cannot hang
+ * the server.
+ *
+ * Only single player envs without Container states can be served.
+ */
+
+namespace shm {
+
+constexpr uint32_t kMagic = 0x45505348;  // "HSPE"
+constexpr uint32_t kVersion = 1;
+constexpr std::size_t kAlign = 64;
+// batches a client may hold at the same time before the server stalls
+constexpr uint32_t kClientSlots = 8;
+constexpr uint32_t kNoSlot = UINT32_MAX;
+
+enum ActionKind : int32_t { kStep = 0, kReset = 1 };
+
+inline std::size_t AlignUp(std::size_t n) {
+  return (n + kAlign - 1) / kAlign * kAlign;
+}
+
+inline void FutexWait(std::atomic<uint32_t>* addr, uint32_t expected,
+                      long timeout_ms) {  // NOLINT
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT, expected,
+          &ts, nullptr, 0);
+}
+
+inline void FutexWake(std::atomic<uint32_t>* addr) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+struct Header {
+  uint32_t magic;
+  uint32_t version;
+  int32_t env_begin, env_end, batch;
+  uint32_t num_slots, ring_size;
+  uint64_t action_bytes, slot_bytes;
+  uint64_t action_offset, published_offset, released_offset, slots_offset;
+  uint64_t total_bytes;
+  // client -> server: number of action requests written
+  alignas(kAlign) std::atomic<uint32_t> action_seq;
+  // server -> client: number of action requests consumed
+  alignas(kAlign) std::atomic<uint32_t> action_done;
+  // server -> client: number of batches published / consumed
+  alignas(kAlign) std::atomic<uint32_t> state_head;
+  alignas(kAlign) std::atomic<uint32_t> state_tail;
+  // client -> server: number of slots released / reclaimed
+  alignas(kAlign) std::atomic<uint32_t> release_head;
+  alignas(kAlign) std::atomic<uint32_t> release_tail;
+  // bumped whenever a slot is released or freed, waited on by the server when
+  // it runs out of slots
+  alignas(kAlign) std::atomic<uint32_t> slot_events;
+  std::atomic<uint32_t> closed;
+  std::atomic<uint32_t> error;
+};
+
+struct ActionHeader {
+  int32_t kind;
+  int32_t shared_rows;
+  int32_t player_rows;
+};
+
+struct Published {
+  uint32_t slot;
+  uint32_t rows;
+};
+
+/**
+ * Byte layout of the actions and of one state slot, derived from the spec so
+ * that the server and the clients compute the same offsets.
+ */
+struct Layout {
+  std::vector<ShapeSpec> action_specs, state_specs;
+  std::vector<std::size_t> action_offsets, state_offsets;
+  std::size_t action_bytes{0}, slot_bytes{0};
+
+  static std::size_t RowBytes(const ShapeSpec& spec) {
+    std::size_t n = spec.element_size;
+    for (std::size_t i = 1; i < spec.shape.size(); ++i) {
+      n *= spec.shape[i];
+    }
+    return n;
+  }
+
+  Layout(std::vector<ShapeSpec> actions, std::vector<ShapeSpec> states,
+         int num_envs, int batch) {
+    // actions have a leading dim of at most num_envs, as do the states of a
+    // batch once the player dim (-1) is resolved
+    for (auto& s : actions) {
+      s = (!s.shape.empty() && s.shape[0] == -1) ? s : s.Batch(-1);
+      action_offsets.push_back(action_bytes);
+      action_bytes += AlignUp(RowBytes(s) * num_envs);
+    }
+    for (auto& s : states) {
+      s = (!s.shape.empty() && s.shape[0] == -1) ? s : s.Batch(-1);
+      s.shape[0] = batch;
+      state_offsets.push_back(slot_bytes);
+      slot_bytes += AlignUp(RowBytes(s) * batch);
+    }
+    action_specs = std::move(actions);
+    state_specs = std::move(states);
+  }
+
+  [[nodiscard]] ShapeSpec ActionSpec(std::size_t i, int rows) const {
+    ShapeSpec s = action_specs[i];
+    s.shape[0] = rows;
+    return s;
+  }
+};
+
+/**
+ * A named shared memory mapping. The creator unlinks the name on destruction;
+ * the mapping itself lives until the last process unmaps it. Creating a
+ * segment whose name exists fails, unless `unlink_existing` is set to remove
+ * one left behind by a server that died.
+ */
+class Segment {
+ protected:
+  std::string name_;
+  char* base_{nullptr};
+  std::size_t size_{0};
+  bool owner_;
+
+ public:
+  Segment(std::string name, std::size_t size, bool unlink_existing = false)
+      : name_(std::move(name)), size_(size), owner_(true) {
+    if (unlink_existing) {
+      shm_unlink(name_.c_str());
+    }
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      throw std::runtime_error("Shared memory " + name_ +
+                               " already exists, is another server using it?");
+    }
+    if (fd < 0) {
+      throw std::runtime_error("Cannot create shared memory " + name_);
+    }
+    if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+      close(fd);
+      shm_unlink(name_.c_str());
+      throw std::runtime_error("Cannot resize shared memory " + name_);
+    }
+    Map(fd);
+  }
+
+  explicit Segment(std::string name) : name_(std::move(name)), owner_(false) {
+    int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open shared memory " + name_ +
+                               ", is the server running?");
+    }
+    struct stat st {};
+    fstat(fd, &st);
+    size_ = st.st_size;
+    Map(fd);
+  }
+
+  ~Segment() {
+    munmap(base_, size_);
+    if (owner_) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+
+  [[nodiscard]] char* Base() const { return base_; }
+  [[nodiscard]] std::size_t Size() const { return size_; }
+  [[nodiscard]] Header* Head() const {
+    return reinterpret_cast<Header*>(base_);
+  }
+
+ protected:
+  void Map(int fd) {
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      if (owner_) {
+        shm_unlink(name_.c_str());
+      }
+      throw std::runtime_error("Cannot map shared memory " + name_);
+    }
+    base_ = static_cast<char*>(p);
+  }
+};
+
+inline std::string SegmentName(const std::string& name, int client_id) {
+  return "/" + name + "." + std::to_string(client_id);
+}
+
+/**
+ * Server side bookkeeping of the state slots of one client. Slots are handed
+ * out to the state queue as StateBuffer storage and come back through the
+ * arrays' deleter once neither the queue nor the client uses them anymore.
+ */
+class SlotArena : public std::enable_shared_from_this<SlotArena> {
+ protected:
+  std::shared_ptr<Segment> segment_;
+  const Layout& layout_;
+  char* slots_;
+  std::mutex mu_;
+  std::vector<uint32_t> free_;
+  bool closed_{false};
+  // batches published to the client, kept alive until it releases them
+  std::mutex held_mu_;
+  std::vector<std::vector<Array>> held_;
+
+ public:
+  SlotArena(std::shared_ptr<Segment> segment, const Layout& layout)
+      : segment_(std::move(segment)),
+        layout_(layout),
+        slots_(segment_->Base() + segment_->Head()->slots_offset),
+        held_(segment_->Head()->num_slots) {
+    for (uint32_t i = segment_->Head()->num_slots; i > 0; --i) {
+      free_.push_back(i - 1);
+    }
+  }
+
+  /**
+   * StateBuffer::Allocator that places the buffer in a free slot, falling
+   * back to the heap once the arena is closed.
+   */
+  std::vector<Array> Allocate(const std::vector<ShapeSpec>& specs) {
+    uint32_t slot = Acquire();
+    if (slot == kNoSlot) {
+      return MakeArray(specs);
+    }
+    char* base = slots_ + slot * layout_.slot_bytes;
+    std::memset(base, 0, layout_.slot_bytes);
+    auto self = shared_from_this();
+    std::shared_ptr<char> lease(base, [self, slot](char* /*unused*/) {
+      self->Free(slot);
+    });
+    std::vector<Array> ret;
+    ret.reserve(specs.size());
+    for (std::size_t i = 0; i < specs.size(); ++i) {
+      ret.emplace_back(specs[i], base + layout_.state_offsets[i],
+                       [lease](char* /*unused*/) {});
+    }
+    return ret;
+  }
+
+  [[nodiscard]] uint32_t SlotOf(const void* data) const {
+    const char* p = static_cast<const char*>(data);
+    std::size_t span = layout_.slot_bytes * held_.size();
+    if (p < slots_ || p >= slots_ + span) {
+      return kNoSlot;
+    }
+    return (p - slots_) / layout_.slot_bytes;
+  }
+
+  void Hold(uint32_t slot, std::vector<Array> arr) {
+    std::lock_guard<std::mutex> lock(held_mu_);
+    held_[slot] = std::move(arr);
+  }
+
+  /**
+   * Drop the batches the client has released since the last call.
+   */
+  void Collect() {
+    Header* h = segment_->Head();
+    auto* ring = reinterpret_cast<uint32_t*>(segment_->Base() +
+                                             h->released_offset);
+    std::vector<std::vector<Array>> dropped;
+    {
+      std::lock_guard<std::mutex> lock(held_mu_);
+      uint32_t head = h->release_head.load(std::memory_order_acquire);
+      uint32_t tail = h->release_tail.load(std::memory_order_relaxed);
+      for (; tail != head; ++tail) {
+        uint32_t slot = ring[tail % h->num_slots];
+        if (slot < held_.size()) {
+          dropped.emplace_back(std::move(held_[slot]));
+        }
+      }
+      h->release_tail.store(tail, std::memory_order_release);
+    }
+    // the deleters of the dropped arrays take mu_
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      closed_ = true;
+    }
+    Notify(segment_->Head());
+  }
+
+  /**
+   * Wake up `Acquire`, after a slot is released by the client or freed here.
+   */
+  static void Notify(Header* h) {
+    h->slot_events.fetch_add(1, std::memory_order_release);
+    FutexWake(&h->slot_events);
+  }
+
+  /**
+   * Drop all published batches. Their deleters refer to this arena, so this
+   * breaks the cycle once nothing is published anymore.
+   */
+  void Clear() {
+    std::vector<std::vector<Array>> dropped(held_.size());
+    {
+      std::lock_guard<std::mutex> lock(held_mu_);
+      dropped.swap(held_);
+    }
+  }
+
+ protected:
+  uint32_t Acquire() {
+    Header* h = segment_->Head();
+    std::unique_lock<std::mutex> lock(mu_);
+    while (free_.empty() && !closed_) {
+      // read before collecting, so that any later release changes it
+      uint32_t seen = h->slot_events.load(std::memory_order_acquire);
+      lock.unlock();
+      Collect();
+      lock.lock();
+      if (free_.empty() && !closed_) {
+        lock.unlock();
+        FutexWait(&h->slot_events, seen, 100);
+        lock.lock();
+      }
+    }
+    if (free_.empty()) {
+      return kNoSlot;
+    }
+    uint32_t slot = free_.back();
+    free_.pop_back();
+    return slot;
+  }
+
+  void Free(uint32_t slot) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      free_.push_back(slot);
+    }
+    Notify(segment_->Head());
+  }
+};
+
+}  // namespace shm
+
+/**
+ * Serves the envs of `Pool` to `num_clients` processes through shared memory.
+ * The envs are split into contiguous ranges of the same size, and each client
+ * receives batches of `batch_size / num_clients` states. The segments of a
+ * server that died are left in /dev/shm and block a new server of the same
+ * name, unless it is created with `unlink_existing`.
+ */
+template <typename Pool, typename PoolSpec = typename Pool::Spec>
+class ShmEnvPoolServer {
+ protected:
+  struct Client {
+    std::shared_ptr<shm::Segment> segment;
+    std::shared_ptr<shm::SlotArena> arena;
+    std::size_t group;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::size_t in_flight{0};
+    std::thread action_thread, state_thread;
+  };
+
+  // declared first so that it outlives the state queues of the pool
+  std::unique_ptr<shm::Layout> layout_;
+  Pool pool_;
+  std::string name_;
+  std::vector<std::unique_ptr<Client>> clients_;
+  std::atomic<bool> stop_{false};
+
+ public:
+  ShmEnvPoolServer(const PoolSpec& spec, std::string name, int num_clients,
+                   bool unlink_existing = false)
+      : pool_(spec), name_(std::move(name)) {
+    using StateValues = typename PoolSpec::StateSpec::Values;
+    if constexpr (HasContainer<StateValues>::value) {
+      throw std::invalid_argument(
+          "Container states cannot be served through shared memory");
+    }
+    int num_envs = spec.config["num_envs"_];
+    int batch = spec.config["batch_size"_] <= 0 ? num_envs
+                                                : spec.config["batch_size"_];
+    if (num_clients <= 0 || num_envs % num_clients != 0 ||
+        batch % num_clients != 0) {
+      throw std::invalid_argument(
+          "num_envs and batch_size must be divisible by the number of "
+          "clients");
+    }
+    if (spec.config["max_num_players"_] != 1 ||
+        spec.config["num_partitions"_] != 1) {
+      throw std::invalid_argument(
+          "shared memory server requires max_num_players == 1 and "
+          "num_partitions == 1");
+    }
+    int range = num_envs / num_clients;
+    int client_batch = batch / num_clients;
+    layout_ = std::make_unique<shm::Layout>(
+        spec.action_spec.template AllValues<ShapeSpec>(),
+        spec.state_spec.template AllValues<ShapeSpec>(), range, client_batch);
+    auto num_slots = static_cast<uint32_t>(
+        StateBufferQueue::MaxLiveBuffers(client_batch, range) +
+        shm::kClientSlots);
+    for (int c = 0; c < num_clients; ++c) {
+      auto client = std::make_unique<Client>();
+      client->segment = CreateSegment(c, c * range, (c + 1) * range,
+                                      client_batch, num_slots,
+                                      unlink_existing);
+      client->arena =
+          std::make_shared<shm::SlotArena>(client->segment, *layout_);
+      auto arena = client->arena;
+      client->group = pool_.AddStateQueue(
+          c * range, (c + 1) * range, client_batch,
+          [arena](const std::vector<ShapeSpec>& specs) {
+            return arena->Allocate(specs);
+          });
+      clients_.emplace_back(std::move(client));
+    }
+    for (auto& client : clients_) {
+      Client* c = client.get();
+      c->action_thread = std::thread([this, c] { ServeActions(c); });
+      c->state_thread = std::thread([this, c] { ServeStates(c); });
+    }
+  }
+
+  ~ShmEnvPoolServer() { Close(); }
+
+  /**
+   * Stop serving. Clients blocked on this server get an exception.
+   */
+  void Close() {
+    if (stop_.exchange(true)) {
+      return;
+    }
+    for (auto& c : clients_) {
+      shm::Header* h = c->segment->Head();
+      h->closed.store(1, std::memory_order_release);
+      shm::FutexWake(&h->action_done);
+      shm::FutexWake(&h->state_head);
+      c->arena->Close();
+      {
+        std::lock_guard<std::mutex> lock(c->mu);
+      }
+      c->cv.notify_all();
+    }
+    for (auto& c : clients_) {
+      c->action_thread.join();
+      c->state_thread.join();
+      c->arena->Clear();
+    }
+  }
+
+ protected:
+  std::shared_ptr<shm::Segment> CreateSegment(int client_id, int begin,
+                                              int end, int batch,
+                                              uint32_t num_slots,
+                                              bool unlink_existing) {
+    std::size_t action_offset = shm::AlignUp(sizeof(shm::Header));
+    std::size_t published_offset = action_offset +
+                                   shm::AlignUp(sizeof(shm::ActionHeader)) +
+                                   layout_->action_bytes;
+    std::size_t released_offset =
+        published_offset +
+        shm::AlignUp(sizeof(shm::Published) * shm::kClientSlots);
+    std::size_t slots_offset =
+        released_offset + shm::AlignUp(sizeof(uint32_t) * num_slots);
+    std::size_t total = slots_offset + layout_->slot_bytes * num_slots;
+    auto segment = std::make_shared<shm::Segment>(
+        shm::SegmentName(name_, client_id), total, unlink_existing);
+    auto* h = new (segment->Base()) shm::Header{};
+    h->version = shm::kVersion;
+    h->env_begin = begin;
+    h->env_end = end;
+    h->batch = batch;
+    h->num_slots = num_slots;
+    h->ring_size = shm::kClientSlots;
+    h->action_bytes = layout_->action_bytes;
+    h->slot_bytes = layout_->slot_bytes;
+    h->action_offset = action_offset;
+    h->published_offset = published_offset;
+    h->released_offset = released_offset;
+    h->slots_offset = slots_offset;
+    h->total_bytes = total;
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = shm::kMagic;
+    return segment;
+  }
+
+  void ServeActions(Client* c) {
+    shm::Header* h = c->segment->Head();
+    char* area = c->segment->Base() + h->action_offset;
+    auto* ah = reinterpret_cast<shm::ActionHeader*>(area);
+    char* data = area + shm::AlignUp(sizeof(shm::ActionHeader));
+    uint32_t seen = 0;
+    while (!stop_) {
+      uint32_t seq = h->action_seq.load(std::memory_order_acquire);
+      if (seq == seen) {
+        shm::FutexWait(&h->action_seq, seen, 100);
+        continue;
+      }
+      int rows = ah->shared_rows;
+      const int* env_id = reinterpret_cast<const int*>(data);
+      bool valid = rows > 0 && rows <= h->env_end - h->env_begin &&
+                   ah->player_rows == rows;
+      for (int i = 0; valid && i < rows; ++i) {
+        valid = env_id[i] >= h->env_begin && env_id[i] < h->env_end;
+      }
+      if (!valid) {
+        h->error.store(1, std::memory_order_release);
+      } else if (ah->kind == shm::kReset) {
+        Array ids(Spec<int>({rows}));
+        ids.Assign(env_id, rows);
+        pool_.Reset(ids);
+      } else {
+        std::vector<Array> action;
+        action.reserve(layout_->action_specs.size());
+        for (std::size_t i = 0; i < layout_->action_specs.size(); ++i) {
+          Array a(layout_->ActionSpec(i, rows));
+          std::memcpy(a.Data(), data + layout_->action_offsets[i],
+                      a.size * a.element_size);
+          action.emplace_back(std::move(a));
+        }
+        pool_.Send(std::move(action));
+      }
+      if (valid) {
+        {
+          std::lock_guard<std::mutex> lock(c->mu);
+          c->in_flight += rows;
+        }
+        c->cv.notify_one();
+      }
+      seen = seq;
+      h->action_done.store(seq, std::memory_order_release);
+      shm::FutexWake(&h->action_done);
+    }
+  }
+
+  void ServeStates(Client* c) {
+    shm::Header* h = c->segment->Head();
+    auto* ring = reinterpret_cast<shm::Published*>(c->segment->Base() +
+                                                   h->published_offset);
+    auto batch = static_cast<std::size_t>(h->batch);
+    for (;;) {
+      {
+        // only wait on the queue for batches that will complete, so that
+        // Close never blocks on envs that were never stepped
+        std::unique_lock<std::mutex> lock(c->mu);
+        c->cv.wait(lock, [&] { return stop_ || c->in_flight >= batch; });
+        if (c->in_flight < batch) {
+          return;
+        }
+        c->in_flight -= batch;
+      }
+      std::vector<Array> arr = pool_.Recv(c->group);
+      c->arena->Collect();
+      uint32_t slot = c->arena->SlotOf(arr[0].Data());
+      if (slot == shm::kNoSlot) {
+        continue;
+      }
+      uint32_t head = h->state_head.load(std::memory_order_relaxed);
+      for (;;) {
+        uint32_t tail = h->state_tail.load(std::memory_order_acquire);
+        if (head - tail < h->ring_size || stop_) {
+          break;
+        }
+        shm::FutexWait(&h->state_tail, tail, 100);
+      }
+      if (stop_) {
+        return;
+      }
+      auto rows = static_cast<uint32_t>(arr[0].Shape(0));
+      c->arena->Hold(slot, std::move(arr));
+      ring[head % h->ring_size] = shm::Published{slot, rows};
+      h->state_head.store(head + 1, std::memory_order_release);
+      shm::FutexWake(&h->state_head);
+    }
+  }
+};
+
+/**
+ * Client of a ShmEnvPoolServer. `Send`, `Recv` and `Reset` have the same
+ * semantics as those of the pool, restricted to the envs of this client. The
+ * arrays returned by `Recv` are views of shared memory; the slot goes back to
+ * the server when the last of them is destroyed.
+ */
+template <typename EnvSpec>
+class ShmEnvPoolClient {
+ public:
+  EnvSpec spec;
+
+ protected:
+  std::shared_ptr<shm::Segment> segment_;
+  shm::Header* header_;
+  std::unique_ptr<shm::Layout> layout_;
+
+ public:
+  ShmEnvPoolClient(const EnvSpec& spec, const std::string& name,
+                   int client_id)
+      : spec(spec),
+        segment_(std::make_shared<shm::Segment>(
+            shm::SegmentName(name, client_id))),
+        header_(segment_->Head()) {
+    if (segment_->Size() < sizeof(shm::Header) ||
+        header_->magic != shm::kMagic || header_->version != shm::kVersion ||
+        header_->total_bytes != segment_->Size()) {
+      throw std::runtime_error("Invalid shared memory segment " +
+                               shm::SegmentName(name, client_id));
+    }
+    layout_ = std::make_unique<shm::Layout>(
+        spec.action_spec.template AllValues<ShapeSpec>(),
+        spec.state_spec.template AllValues<ShapeSpec>(),
+        header_->env_end - header_->env_begin, header_->batch);
+    if (layout_->action_bytes != header_->action_bytes ||
+        layout_->slot_bytes != header_->slot_bytes) {
+      throw std::runtime_error(
+          "The config of this client does not match the server's");
+    }
+  }
+
+  [[nodiscard]] int EnvBegin() const { return header_->env_begin; }
+  [[nodiscard]] int EnvEnd() const { return header_->env_end; }
+
+  void Send(const std::vector<Array>& action) {
+    int rows = action[0].Shape(0);
+    char* data = BeginRequest(shm::kStep, rows, action[1].Shape(0));
+    for (std::size_t i = 0; i < action.size(); ++i) {
+      const Array& a = action[i];
+      if (a.Shape(0) != static_cast<std::size_t>(rows)) {
+        throw std::invalid_argument("action rows must match env_id");
+      }
+      std::memcpy(data + layout_->action_offsets[i], a.Data(),
+                  a.size * a.element_size);
+    }
+    EndRequest();
+  }
+
+  void Reset(const Array& env_ids) {
+    int rows = env_ids.Shape(0);
+    char* data = BeginRequest(shm::kReset, rows, rows);
+    std::memcpy(data, env_ids.Data(), rows * sizeof(int));
+    EndRequest();
+  }
+
+  std::vector<Array> Recv() {
+    uint32_t tail = header_->state_tail.load(std::memory_order_relaxed);
+    for (;;) {
+      uint32_t head = header_->state_head.load(std::memory_order_acquire);
+      if (head != tail) {
+        break;
+      }
+      CheckOpen();
+      shm::FutexWait(&header_->state_head, head, 100);
+    }
+    auto* ring = reinterpret_cast<const shm::Published*>(
+        segment_->Base() + header_->published_offset);
+    shm::Published p = ring[tail % header_->ring_size];
+    header_->state_tail.store(tail + 1, std::memory_order_release);
+    shm::FutexWake(&header_->state_tail);
+    char* base = segment_->Base() + header_->slots_offset +
+                 p.slot * header_->slot_bytes;
+    auto segment = segment_;
+    uint32_t slot = p.slot;
+    std::shared_ptr<char> lease(base, [segment, slot](char* /*unused*/) {
+      Release(segment.get(), slot);
+    });
+    std::vector<Array> ret;
+    ret.reserve(layout_->state_specs.size());
+    for (std::size_t i = 0; i < layout_->state_specs.size(); ++i) {
+      ShapeSpec s = layout_->state_specs[i];
+      s.shape[0] = static_cast<int>(p.rows);
+      ret.emplace_back(s, base + layout_->state_offsets[i],
+                       [lease](char* /*unused*/) {});
+    }
+    return ret;
+  }
+
+ protected:
+  void CheckOpen() const {
+    if (header_->closed.load(std::memory_order_acquire) != 0) {
+      throw std::runtime_error("EnvPool shared memory server is closed");
+    }
+    if (header_->error.exchange(0) != 0) {
+      throw std::invalid_argument(
+          "EnvPool shared memory server rejected an action: env_id out of "
+          "this client's range [" +
+          std::to_string(header_->env_begin) + ", " +
+          std::to_string(header_->env_end) + ")");
+    }
+  }
+
+  char* BeginRequest(shm::ActionKind kind, int rows, int player_rows) {
+    // the server copies the previous request out before acknowledging it
+    uint32_t seq = header_->action_seq.load(std::memory_order_relaxed);
+    for (;;) {
+      uint32_t done = header_->action_done.load(std::memory_order_acquire);
+      if (done == seq) {
+        break;
+      }
+      CheckOpen();
+      shm::FutexWait(&header_->action_done, done, 100);
+    }
+    CheckOpen();
+    if (rows <= 0 || rows > header_->env_end - header_->env_begin) {
+      throw std::invalid_argument("invalid number of envs in request");
+    }
+    char* area = segment_->Base() + header_->action_offset;
+    auto* ah = reinterpret_cast<shm::ActionHeader*>(area);
+    ah->kind = kind;
+    ah->shared_rows = rows;
+    ah->player_rows = player_rows;
+    return area + shm::AlignUp(sizeof(shm::ActionHeader));
+  }
+
+  void EndRequest() {
+    header_->action_seq.fetch_add(1, std::memory_order_release);
+    shm::FutexWake(&header_->action_seq);
+  }
+
+  static void Release(shm::Segment* segment, uint32_t slot) {
+    // releases may come from any thread of the client process
+    static std::mutex mu;
+    std::lock_guard<std::mutex> lock(mu);
+    shm::Header* h = segment->Head();
+    auto* ring =
+        reinterpret_cast<uint32_t*>(segment->Base() + h->released_offset);
+    uint32_t head = h->release_head.load(std::memory_order_relaxed);
+    ring[head % h->num_slots] = slot;
+    h->release_head.store(head + 1, std::memory_order_release);
+    shm::SlotArena::Notify(h);
+  }
+};
+
+#endif  // ENVPOOL_CORE_SHM_ENVPOOL_H_
@@ -20,11 +20,13 @@
 #include <glog/logging.h>
 
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <limits>
 #include <memory>
 #include <numeric>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -90,6 +92,30 @@ class Spec : public ShapeSpec {
   }
 };
 
+/**
+ * Boolean flags stored 8 to a byte. `Spec<PackedBits>(shape)` holds
+ * `shape.back()` flags per row in `(shape.back() + 7) / 8` bytes, bit `i % 8`
+ * of byte `i / 8` being flag `i`, and is written with the bit accessors of
+ * `TArray<PackedBits>`. Python receives the packed uint8 array, which
+ * `np.unpackbits(a, axis=-1, count=n, bitorder="little")` expands.
+ */
+struct PackedBits {
+  uint8_t byte;
+};
+
+template <>
+class Spec<PackedBits> : public ShapeSpec {
+ public:
+  using dtype = PackedBits;  // NOLINT
+  int num_bits;
+  std::tuple<uint8_t, uint8_t> bounds = {0, 255};
+  std::tuple<std::vector<uint8_t>, std::vector<uint8_t>> elementwise_bounds;
+  explicit Spec(const std::vector<int>& bit_shape)
+      : ShapeSpec(sizeof(PackedBits), bit_shape), num_bits(bit_shape.back()) {
+    shape.back() = (num_bits + 7) / 8;
+  }
+};
+
 template <typename dtype>
 class TArray;
 
@@ -108,4 +134,68 @@ class Spec<Container<D>> : public ShapeSpec {
         inner_spec(std::move(inner_spec)) {}
 };
 
+class RaggedArena;
+
+/**
+ * Slot of a ragged field: a variable number of rows of `inner_spec`, which the
+ * env appends to the arena of its state buffer with `TArray::Emplace`. Unlike
+ * Container, python receives all the rows of a field in one flat array, see
+ * `ToNumpy`.
+ */
+template <typename D>
+struct Ragged {
+  using value_type = D;  // NOLINT
+  RaggedArena* arena;
+  D* data;
+  std::size_t length;
+};
+
+template <typename T>
+struct IsRagged : std::false_type {};
+template <typename D>
+struct IsRagged<Ragged<D>> : std::true_type {};
+
+template <typename D>
+class Spec<Ragged<D>> : public ShapeSpec {
+ public:
+  using dtype = Ragged<D>;  // NOLINT
+  Spec<D> inner_spec;
+  explicit Spec(const std::vector<int>& shape, const Spec<D>& inner_spec)
+      : ShapeSpec(sizeof(Ragged<D>), shape), inner_spec(inner_spec) {}
+  explicit Spec(std::vector<int>&& shape, Spec<D>&& inner_spec)
+      : ShapeSpec(sizeof(Ragged<D>), std::move(shape)),
+        inner_spec(std::move(inner_spec)) {}
+};
+
+/**
+ * Whether a tuple of `Spec<T>` has a Container or Ragged spec, whose arrays
+ * hold pointers and thus cannot be copied to another process.
+ */
+template <typename T>
+struct IsContainer : IsRagged<T> {};
+template <typename D>
+struct IsContainer<Container<D>> : std::true_type {};
+
+template <typename Specs>
+struct HasContainer;
+template <typename... S>
+struct HasContainer<std::tuple<S...>>
+    : std::disjunction<IsContainer<typename S::dtype>...> {};
+
+/**
+ * Whether the values of a spec can be moved to another row with `memcpy`, as
+ * StateBuffer does when it compacts a batch. A Container is a unique_ptr, which
+ * can be moved bytewise as long as the source row is then cleared.
+ */
+template <typename T>
+struct IsRelocatable : std::is_trivially_copyable<T> {};
+template <typename D>
+struct IsRelocatable<Container<D>> : std::true_type {};
+
+template <typename Specs>
+struct AllRelocatable;
+template <typename... S>
+struct AllRelocatable<std::tuple<S...>>
+    : std::conjunction<IsRelocatable<typename S::dtype>...> {};
+
 #endif  // ENVPOOL_CORE_SPEC_H_
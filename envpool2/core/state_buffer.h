@@ -21,8 +21,12 @@
 #define MOODYCAMEL_DELETE_FUNCTION = delete
 #endif
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -44,8 +48,15 @@ class StateBuffer {
   std::vector<Array> arrays_;
   std::vector<bool> is_player_state_;
   std::atomic<uint64_t> offsets_{0};
+  // number of rows of partition 1, which are filled from the tail
+  std::atomic<std::size_t> tail_count_{0};
   std::atomic<std::size_t> alloc_count_{0};
   std::atomic<std::size_t> done_count_{0};
+  // rows placed by AllocateAt, and which of them belong to partition 1
+  std::vector<uint8_t> row_partition_;
+  std::atomic<bool> has_placed_tail_{false};
+  // rows of the ragged fields
+  std::shared_ptr<RaggedArena> arena_;
   moodycamel::LightweightSemaphore sem_;
 
  public:
@@ -57,41 +68,67 @@ class StateBuffer {
   struct WritableSlice {
     std::vector<Array> arr;
     std::function<void()> done_write;
+    RaggedArena* arena{nullptr};
   };
 
+  /**
+   * Creates the zero-filled arrays of a buffer from their specs. The default
+   * allocates them on the heap; a custom allocator can place them elsewhere,
+   * e.g. in shared memory, and reclaim the memory in the arrays' deleter.
+   */
+  using Allocator =
+      std::function<std::vector<Array>(const std::vector<ShapeSpec>&)>;
+
   /**
    * Create a StateBuffer instance with the player_specs and shared_specs
    * provided.
    */
   StateBuffer(std::size_t batch, std::size_t max_num_players,
               const std::vector<ShapeSpec>& specs,
-              std::vector<bool> is_player_state)
+              std::vector<bool> is_player_state,
+              const Allocator& allocator = nullptr)
       : batch_(batch),
         max_num_players_(max_num_players),
-        arrays_(MakeArray(specs)),
-        is_player_state_(std::move(is_player_state)) {}
+        arrays_(allocator ? allocator(specs) : MakeArray(specs)),
+        is_player_state_(std::move(is_player_state)),
+        row_partition_(batch),
+        arena_(std::make_shared<RaggedArena>()) {}
 
   /**
    * Tries to allocate a piece of memory without lock.
    * If this buffer runs out of quota, an out_of_range exception is thrown.
    * Externally, caller has to catch the exception and handle accordingly.
+   *
+   * When `partition` is 0 or 1, the buffer is split into two contiguous
+   * sub-batches: partition 0 is filled from the head and partition 1 from the
+   * tail, so that the rows of each partition are adjacent after `Wait`. This is
+   * only supported for single player envs, and `order` is ignored.
    */
-  WritableSlice Allocate(std::size_t num_players, int order = -1) {
+  WritableSlice Allocate(std::size_t num_players, int order = -1,
+                         int partition = -1) {
     DCHECK_LE(num_players, max_num_players_);
     std::size_t alloc_count = alloc_count_.fetch_add(1);
     if (alloc_count < batch_) {
-      // Make a increment atomically on two uint32_t simultaneously
-      // This avoids lock
-      uint64_t increment = static_cast<uint64_t>(num_players) << 32 | 1;
-      uint64_t offsets = offsets_.fetch_add(increment);
-      uint32_t player_offset = offsets >> 32;
-      uint32_t shared_offset = offsets;
-      DCHECK_LE((std::size_t)shared_offset + 1, batch_);
-      DCHECK_LE((std::size_t)(player_offset + num_players),
-                batch_ * max_num_players_);
-      if (order != -1 && max_num_players_ == 1) {
-        // single player with sync setting: return ordered data
-        player_offset = shared_offset = order;
+      uint32_t player_offset;
+      uint32_t shared_offset;
+      if (partition == 1) {
+        DCHECK_EQ(max_num_players_, (std::size_t)1);
+        std::size_t tail_count = tail_count_.fetch_add(1);
+        player_offset = shared_offset = batch_ - 1 - tail_count;
+      } else {
+        // Make a increment atomically on two uint32_t simultaneously
+        // This avoids lock
+        uint64_t increment = static_cast<uint64_t>(num_players) << 32 | 1;
+        uint64_t offsets = offsets_.fetch_add(increment);
+        player_offset = offsets >> 32;
+        shared_offset = offsets;
+        DCHECK_LE((std::size_t)shared_offset + 1, batch_);
+        DCHECK_LE((std::size_t)(player_offset + num_players),
+                  batch_ * max_num_players_);
+        if (order != -1 && max_num_players_ == 1 && partition == -1) {
+          // single player with sync setting: return ordered data
+          player_offset = shared_offset = order;
+        }
       }
       std::vector<Array> state;
       state.reserve(arrays_.size());
@@ -105,12 +142,46 @@ class StateBuffer {
         }
       }
       return WritableSlice{.arr = std::move(state),
-                           .done_write = [this]() { Done(); }};
+                           .done_write = [this]() { Done(); },
+                           .arena = arena_.get()};
     }
     DLOG(INFO) << "Allocation failed, continue to the next block of memory";
     throw std::out_of_range("StateBuffer out of storage");
   }
 
+  /**
+   * Allocate the row at `order`, which the caller has reserved in advance so
+   * that the layout of the batch doesn't depend on the finishing order of the
+   * envs (see `deterministic` in AsyncEnvPool). Rows of partition 1 are moved
+   * behind those of partition 0 in `Wait`, keeping their relative order. Only
+   * supported for single player envs.
+   */
+  WritableSlice AllocateAt(std::size_t order, int partition = -1) {
+    DCHECK_EQ(max_num_players_, (std::size_t)1);
+    DCHECK_LT(order, batch_);
+    alloc_count_.fetch_add(1);
+    if (partition == 1) {
+      row_partition_[order] = 1;
+      tail_count_.fetch_add(1);
+      has_placed_tail_.store(true, std::memory_order_relaxed);
+    } else {
+      offsets_.fetch_add(static_cast<uint64_t>(1) << 32 | 1);
+    }
+    std::vector<Array> state;
+    state.reserve(arrays_.size());
+    for (std::size_t i = 0; i < arrays_.size(); ++i) {
+      const Array& a = arrays_[i];
+      if (is_player_state_[i]) {
+        state.emplace_back(a.Slice(order, order + 1));
+      } else {
+        state.emplace_back(a[order]);
+      }
+    }
+    return WritableSlice{.arr = std::move(state),
+                         .done_write = [this]() { Done(); },
+                         .arena = arena_.get()};
+  }
+
   [[nodiscard]] std::pair<uint32_t, uint32_t> Offsets() const {
     uint32_t player_offset = offsets_ >> 32;
     uint32_t shared_offset = offsets_;
@@ -128,6 +199,14 @@ class StateBuffer {
     }
   }
 
+  /**
+   * Number of rows that belong to partition 0, i.e. the offset at which the
+   * sub-batch of partition 1 starts. Only meaningful after `Wait`.
+   */
+  [[nodiscard]] std::size_t PartitionOffset() const {
+    return static_cast<uint32_t>(offsets_);
+  }
+
   /**
    * Blocks until the entire buffer is ready, aka, all quota has been
    * distributed out, and all user has called done.
@@ -142,6 +221,16 @@ class StateBuffer {
     uint64_t offsets = offsets_;
     uint32_t player_offset = (offsets >> 32);
     uint32_t shared_offset = offsets;
+    std::size_t tail_count = tail_count_;
+    if (has_placed_tail_.load(std::memory_order_relaxed)) {
+      GroupPlacedTail(shared_offset + tail_count);
+      player_offset += tail_count;
+      shared_offset += tail_count;
+    } else if (tail_count > 0) {
+      CompactTail(shared_offset, tail_count);
+      player_offset += tail_count;
+      shared_offset += tail_count;
+    }
     DCHECK_EQ((std::size_t)shared_offset, batch_ - additional_done_count);
     std::vector<Array> ret;
     ret.reserve(arrays_.size());
@@ -153,8 +242,70 @@ class StateBuffer {
         ret.emplace_back(a.Truncate(shared_offset));
       }
     }
+    if (!arena_->Empty()) {
+      // ragged slots point into the arena, which must outlive this buffer
+      for (auto& a : ret) {
+        a = a.KeepAlive(arena_);
+      }
+    }
     return ret;
   }
+
+ protected:
+  /**
+   * Move the rows of partition 1 right after partition 0. This is a no-op when
+   * the buffer is full, and only happens in sync mode when fewer envs than
+   * `batch_` have been stepped.
+   *
+   * Rows are moved one at a time with `memcpy`, and the rows left behind are
+   * zeroed, so that a Container in a moved row has a single owner (a zeroed
+   * unique_ptr is null). AsyncEnvPool checks that its state values allow this,
+   * see `AllRelocatable`.
+   */
+  void CompactTail(std::size_t head_count, std::size_t tail_count) {
+    std::size_t tail_start = batch_ - tail_count;
+    if (tail_start == head_count) {
+      return;
+    }
+    std::size_t vacated = std::max(head_count + tail_count, tail_start);
+    for (const Array& a : arrays_) {
+      std::size_t row_bytes = a.size / a.Shape(0) * a.element_size;
+      char* data = static_cast<char*>(a.Data());
+      for (std::size_t i = 0; i < tail_count; ++i) {
+        std::memcpy(data + (head_count + i) * row_bytes,
+                    data + (tail_start + i) * row_bytes, row_bytes);
+      }
+      std::memset(data + vacated * row_bytes, 0,
+                  (batch_ - vacated) * row_bytes);
+    }
+  }
+
+  /**
+   * Stable partition of the first `count` rows placed by AllocateAt, so that
+   * the rows of partition 1 follow those of partition 0.
+   */
+  void GroupPlacedTail(std::size_t count) {
+    std::vector<std::size_t> rows;
+    rows.reserve(count);
+    for (uint8_t p : {0, 1}) {
+      for (std::size_t i = 0; i < count; ++i) {
+        if (row_partition_[i] == p) {
+          rows.push_back(i);
+        }
+      }
+    }
+    std::vector<char> scratch;
+    for (const Array& a : arrays_) {
+      std::size_t row_bytes = a.size / a.Shape(0) * a.element_size;
+      char* data = static_cast<char*>(a.Data());
+      scratch.resize(count * row_bytes);
+      for (std::size_t i = 0; i < count; ++i) {
+        std::memcpy(scratch.data() + i * row_bytes, data + rows[i] * row_bytes,
+                    row_bytes);
+      }
+      std::memcpy(data, scratch.data(), count * row_bytes);
+    }
+  }
 };
 
 #endif  // ENVPOOL_CORE_STATE_BUFFER_H_
@@ -0,0 +1,91 @@
+// Compares the recv + copy throughput of state buffers allocated on the heap
+// and from a PageArena with normal and huge pages, e.g.
+//
+//   state_buffer_bench [BATCH] [NUM_BATCHES]
+//
+// The state layout follows YGOPro's observation. Each batch is filled row by
+// row, received and copied out, as the python side does with the arrays.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envpool2/core/page_arena.h"
+#include "envpool2/core/state_buffer_queue.h"
+
+static const char *KindName(PageArena::PageKind kind) {
+  switch (kind) {
+    case PageArena::PageKind::kHuge:
+      return "hugetlb";
+    case PageArena::PageKind::kTransparentHuge:
+      return "thp";
+    default:
+      return "normal";
+  }
+}
+
+static double Run(std::size_t batch, std::size_t num_batches,
+                  const std::vector<ShapeSpec> &specs,
+                  StateBuffer::Allocator allocator, std::size_t *bytes) {
+  StateBufferQueue queue(batch, batch, 1, specs, std::move(allocator));
+  std::vector<char> out;
+  *bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t b = 0; b < num_batches; ++b) {
+    for (std::size_t i = 0; i < batch; ++i) {
+      auto slice = queue.Allocate(1);
+      for (auto &a : slice.arr) {
+        std::memset(a.Data(), static_cast<int>(i), a.size * a.element_size);
+      }
+      slice.done_write();
+    }
+    std::size_t offset = 0;
+    for (const auto &a : queue.Wait()) {
+      std::size_t n = a.size * a.element_size;
+      out.resize(std::max(out.size(), offset + n));
+      std::memcpy(out.data() + offset, a.Data(), n);
+      offset += n;
+    }
+    *bytes += offset;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  std::size_t batch = argc > 1 ? std::atoi(argv[1]) : 1024;
+  std::size_t num_batches = argc > 2 ? std::atoi(argv[2]) : 500;
+  std::vector<ShapeSpec> specs{
+      {1, {-1, 160, 39}}, {1, {-1, 8}}, {1, {-1, 24, 13}}, {1, {-1, 32, 13}},
+      {1, {-1, 3}},       {1, {}},      {4, {}},           {4, {}},
+      {1, {}},            {1, {}},      {1, {}},           {4, {-1}},
+      {4, {}},            {1, {}},      {1, {}},           {1, {}}};
+  struct Variant {
+    std::string name;
+    std::shared_ptr<PageArena> arena;
+  };
+  std::vector<Variant> variants{
+      {"heap", nullptr},
+      {"arena", std::make_shared<PageArena>(false)},
+      {"arena+huge", std::make_shared<PageArena>(true)}};
+  for (const auto &v : variants) {
+    StateBuffer::Allocator allocator;
+    if (v.arena) {
+      allocator = [arena = v.arena](const std::vector<ShapeSpec> &s) {
+        return arena->Allocate(s);
+      };
+    }
+    std::size_t bytes;
+    double seconds = Run(batch, num_batches, specs, allocator, &bytes);
+    std::printf("%-12s %-8s %10.0f batches/s %8.2f GB/s\n", v.name.c_str(),
+                v.arena ? KindName(v.arena->Kind()) : "-",
+                num_batches / seconds, bytes / seconds / 1e9);
+  }
+  return 0;
+}
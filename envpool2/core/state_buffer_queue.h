@@ -35,6 +35,8 @@ class StateBufferQueue {
   std::size_t max_num_players_;
   std::vector<bool> is_player_state_;
   std::vector<ShapeSpec> specs_;
+  StateBuffer::Allocator allocator_;
+  bool ordered_;
   std::size_t queue_size_;
   std::vector<std::unique_ptr<StateBuffer>> queue_;
   std::atomic<uint64_t> alloc_count_, done_ptr_, alloc_tail_;
@@ -47,7 +49,9 @@ class StateBufferQueue {
  public:
   StateBufferQueue(std::size_t batch_env, std::size_t num_envs,
                    std::size_t max_num_players,
-                   const std::vector<ShapeSpec>& specs)
+                   const std::vector<ShapeSpec>& specs,
+                   StateBuffer::Allocator allocator = nullptr,
+                   bool ordered = false)
       : batch_(batch_env),
         max_num_players_(max_num_players),
         is_player_state_(Transform(specs,
@@ -64,6 +68,8 @@ class StateBufferQueue {
                            }
                            return s.Batch(batch_);
                          })),
+        allocator_(std::move(allocator)),
+        ordered_(ordered),
         // two times enough buffer for all the envs
         queue_size_((num_envs / batch_env + 2) * 2),
         queue_(queue_size_),  // circular buffer
@@ -77,16 +83,13 @@ class StateBufferQueue {
     // alloc_tail_ = num_envs / batch_env + 2;
     for (auto& q : queue_) {
       q = std::make_unique<StateBuffer>(batch_, max_num_players_, specs_,
-                                        is_player_state_);
+                                        is_player_state_, allocator_);
     }
-    std::size_t processor_count = std::thread::hardware_concurrency();
-    // hardcode here :(
-    std::size_t create_buffer_thread_num = std::max(1UL, processor_count / 64);
-    for (std::size_t i = 0; i < create_buffer_thread_num; ++i) {
+    for (std::size_t i = 0; i < CreateBufferThreadNum(); ++i) {
       create_buffer_thread_.emplace_back(std::thread([&]() {
         while (true) {
           stock_buffer_.Put(std::make_unique<StateBuffer>(
-              batch_, max_num_players_, specs_, is_player_state_));
+              batch_, max_num_players_, specs_, is_player_state_, allocator_));
           if (quit_) {
             break;
           }
@@ -106,12 +109,43 @@ class StateBufferQueue {
     }
   }
 
+  static std::size_t CreateBufferThreadNum() {
+    std::size_t processor_count = std::thread::hardware_concurrency();
+    // hardcode here :(
+    return std::max(1UL, processor_count / 64);
+  }
+
+  /**
+   * Upper bound of the state buffers that are alive at the same time inside a
+   * queue: the circular queue, the stock and one in construction per stock
+   * thread. Arrays returned by `Wait` are not counted.
+   */
+  static std::size_t MaxLiveBuffers(std::size_t batch_env,
+                                    std::size_t num_envs) {
+    return (num_envs / batch_env + 2) * 4 + CreateBufferThreadNum();
+  }
+
+  /**
+   * Number of consecutive rows an ordered queue can place ahead of the batch
+   * at its head. Orders passed to `Allocate` wrap around at this value.
+   */
+  [[nodiscard]] std::size_t Window() const { return queue_size_ * batch_; }
+
   /**
    * Allocate slice of memory for the current env to write.
    * This function is used from the producer side.
    * It is safe to access from multiple threads.
+   *
+   * In an ordered queue, `order` is the position of the state in the stream
+   * of all states modulo `Window()`: it selects both the batch and the row.
    */
-  StateBuffer::WritableSlice Allocate(std::size_t num_players, int order = -1) {
+  StateBuffer::WritableSlice Allocate(std::size_t num_players, int order = -1,
+                                      int partition = -1) {
+    if (ordered_) {
+      DCHECK_GE(order, 0);
+      std::size_t offset = order / batch_;
+      return queue_[offset]->AllocateAt(order % batch_, partition);
+    }
     std::size_t pos = alloc_count_.fetch_add(1);
     std::size_t offset = (pos / batch_) % queue_size_;
     // if (pos % batch_ == 0) {
@@ -124,7 +158,7 @@ class StateBufferQueue {
     //       new StateBuffer(batch_, max_num_players_, specs_,
     //       is_player_state_));
     // }
-    return queue_[offset]->Allocate(num_players, order);
+    return queue_[offset]->Allocate(num_players, order, partition);
   }
 
   /**
@@ -135,12 +169,19 @@ class StateBufferQueue {
    * Wait should be accessed from only one thread.
    * If Wait is accessed from multiple threads, it is only safe if the finish
    * time of each state buffer is in the same order as the allocation time.
+   *
+   * If `partition_offset` is given, it receives the number of leading rows that
+   * belong to partition 0 (see `StateBuffer::Allocate`).
    */
-  std::vector<Array> Wait(std::size_t additional_done_count = 0) {
+  std::vector<Array> Wait(std::size_t additional_done_count = 0,
+                          std::size_t* partition_offset = nullptr) {
     std::unique_ptr<StateBuffer> newbuf = stock_buffer_.Get();
     std::size_t pos = done_ptr_.fetch_add(1);
     std::size_t offset = pos % queue_size_;
     auto arr = queue_[offset]->Wait(additional_done_count);
+    if (partition_offset != nullptr) {
+      *partition_offset = queue_[offset]->PartitionOffset();
+    }
     if (additional_done_count > 0) {
       // move pointer to the next block
       alloc_count_.fetch_add(additional_done_count);
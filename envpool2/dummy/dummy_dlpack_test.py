@@ -0,0 +1,90 @@
+# Copyright 2021 Garena Online Private Limited
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Test for recv(format="dlpack")."""
+
+import ctypes
+import gc
+
+import numpy as np
+import torch
+from absl.testing import absltest
+
+import envpool2
+
+
+class _DLTensor(ctypes.Structure):
+  _fields_ = [
+    ("data", ctypes.c_void_p),
+    ("device_type", ctypes.c_int32),
+    ("device_id", ctypes.c_int32),
+    ("ndim", ctypes.c_int32),
+    ("code", ctypes.c_uint8),
+    ("bits", ctypes.c_uint8),
+    ("lanes", ctypes.c_uint16),
+    ("shape", ctypes.POINTER(ctypes.c_int64)),
+    ("strides", ctypes.POINTER(ctypes.c_int64)),
+    ("byte_offset", ctypes.c_uint64),
+  ]
+
+
+def _capsule_data(capsule: object) -> int:
+  """Address of the memory a "dltensor" capsule points to."""
+  get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+  get_pointer.restype = ctypes.c_void_p
+  get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+  return _DLTensor.from_address(get_pointer(capsule, b"dltensor")).data
+
+
+class _DLPackTest(absltest.TestCase):
+
+  def test_from_dlpack_does_not_copy(self) -> None:
+    env = envpool2.make_gymnasium("Dummy-v0", num_envs=4, batch_size=4)
+    env.async_reset()
+    obs, info = env.recv(reset=True, format="dlpack")
+    capsule = info["env_id"]
+    data = _capsule_data(capsule)
+    env_id = torch.from_dlpack(capsule)
+    self.assertEqual(env_id.data_ptr(), data)
+    self.assertEqual(env_id.dtype, torch.int32)
+    np.testing.assert_array_equal(np.sort(env_id.numpy()), np.arange(4))
+    raw = torch.from_dlpack(obs["raw"])
+    self.assertEqual(tuple(raw.shape), (4, 10))
+    # the tensors keep the state buffer alive, not the pool
+    del env, obs, info, capsule
+    gc.collect()
+    np.testing.assert_array_equal(np.sort(env_id.numpy()), np.arange(4))
+    np.testing.assert_array_equal(raw[:, 0].numpy(), np.zeros(4))
+
+  def test_step_output(self) -> None:
+    env = envpool2.make_gymnasium("Dummy-v0", num_envs=4, batch_size=4)
+    env.async_reset()
+    env.recv(reset=True)
+    env.send({
+      "list_action": np.zeros((4, 6)),
+      "players.action": np.zeros(4, dtype=np.int32),
+      "players.id": np.zeros(4, dtype=np.int32),
+    })
+    _, reward, terminated, truncated, _ = env.recv(format="dlpack")
+    self.assertEqual(torch.from_dlpack(reward).dtype, torch.float32)
+    self.assertEqual(torch.from_dlpack(terminated).dtype, torch.bool)
+    self.assertEqual(torch.from_dlpack(truncated).shape[0], 4)
+
+  def test_bad_format(self) -> None:
+    env = envpool2.make_gymnasium("Dummy-v0", num_envs=4, batch_size=4)
+    env.async_reset()
+    self.assertRaises(ValueError, env.recv, format="torch")
+
+
+if __name__ == "__main__":
+  absltest.main()
@@ -17,6 +17,10 @@
 
 #include <memory>
 
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #include "envpool2/core/async_envpool.h"
 #include "envpool2/core/env.h"
 
@@ -38,10 +42,19 @@ class DummyEnvFns {
    * 4. thread_affinity_offset: sets the thread affinity of the threads
    * 5. base_path: contains the path of the envpool python package
    * 6. seed: random seed
+   * 7. num_partitions: split each batch into contiguous sub-batches by a key
+   * passed to `Allocate`, only 1 or 2 are supported
+   * 8. numa_policy: "none", or one worker group per NUMA node with the state
+   * buffers placed on one node ("node") or interleaved ("interleave")
+   * 9. huge_pages: lay out each state buffer in one block of huge pages
+   * 10. schedule_policy: order in which the workers take the actions, "fifo",
+   * "oldest" (oldest batch first) or "cost" (slowest envs of a batch first)
+   * 11. lazy_init: construct each env on its first reset instead of with the
+   * pool
    *
    * These's also single env specific configurations
    *
-   * 7. max_num_players: defines the number of players in a single env.
+   * 12. max_num_players: defines the number of players in a single env.
    *
    */
   static decltype(auto) DefaultConfig() {
@@ -76,7 +89,7 @@ class DummyEnvFns {
   template <typename Config>
   static decltype(auto) StateSpec(const Config& conf) {
     return MakeDict("obs:raw"_.Bind(Spec<int>({-1, conf["state_num"_]})),
-                    "obs:dyn"_.Bind(Spec<Container<int>>(
+                    "obs:dyn"_.Bind(Spec<Ragged<int>>(
                         {-1}, Spec<int>({-1, conf["state_num"_]}))),
                     "info:players.done"_.Bind(Spec<bool>({-1})),
                     "info:players.id"_.Bind(
@@ -122,7 +135,8 @@ class DummyEnv : public Env<DummyEnvSpec> {
    * Initilize the env, in this function we perform tasks like loading the game
    * rom etc.
    */
-  DummyEnv(const Spec& spec, int env_id) : Env<DummyEnvSpec>(spec, env_id) {
+  DummyEnv(std::shared_ptr<const Spec> spec, int env_id)
+      : Env<DummyEnvSpec>(std::move(spec), env_id) {
     if (seed_ < 1) {
       seed_ = 1;
     }
@@ -150,16 +164,13 @@ class DummyEnv : public Env<DummyEnvSpec> {
       state["obs:raw"_](i, 0) = state_;
       state["obs:raw"_](i, 1) = 0;
       state["reward"_][i] = -i;
-      // dynamic array
-      Container<int>& dyn = state["obs:dyn"_][i];
-      // new spec
+      // dynamic array, its number of rows changes from one state to another
       auto dyn_spec = ::Spec<int>({env_id_ + 1, spec_.config["state_num"_]});
-      // use this spec to create an array
-      auto* array = new TArray<int>(dyn_spec);
+      // allocate the rows in the state buffer, python receives the rows of
+      // all players in one flat array plus their offsets
+      TArray<int> dyn = state["obs:dyn"_][i].Emplace(dyn_spec);
       // perform some normal array writing
-      array->Fill(env_id_);
-      // finally pass it to dynamic array
-      dyn.reset(array);
+      dyn.Fill(env_id_);
     }
   }
 
@@ -171,6 +182,73 @@ class DummyEnv : public Env<DummyEnvSpec> {
    *
    */
   void Step(const Action& action) override {
+    // Check if actions can successfully pass into envpool
+    CheckListAction(action);
+    Advance(action);
+  }
+
+  /**
+   * Optionally, an env with a cheap step can let each worker step up to
+   * `kMaxStepBatch` envs in one call of `StepBatch`, which must have the same
+   * effect as calling `Step` on each of them. Here the action checks of all
+   * envs are done first, with AVX if available, and the states are written
+   * afterwards.
+   */
+  static constexpr std::size_t kMaxStepBatch = 16;
+
+  static void StepBatch(DummyEnv* const* envs, const Action* actions,
+                        std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      const auto* x =
+          static_cast<const double*>(actions[i]["list_action"_].Data());
+      if (!IsUniform(x)) {
+        // report the mismatch in the same way as `Step`
+        CheckListAction(actions[i]);
+      }
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      envs[i]->Advance(actions[i]);
+    }
+  }
+
+  /**
+   * Whether the single env has ended the current episode.
+   */
+  bool IsDone() override { return state_ >= seed_; }
+
+ protected:
+  static void CheckListAction(const Action& action) {
+    double x = action["list_action"_][0];
+
+    for (int i = 0; i < 6; ++i) {
+      double y = action["list_action"_][i];
+      CHECK_EQ(x, y);
+    }
+  }
+
+  /**
+   * Whether the 6 values of a list action are all equal.
+   */
+  static bool IsUniform(const double* x) {
+#ifdef __AVX__
+    __m256d first = _mm256_set1_pd(x[0]);
+    __m256d head = _mm256_cmp_pd(_mm256_loadu_pd(x), first, _CMP_EQ_OQ);
+    __m128d tail =
+        _mm_cmpeq_pd(_mm_loadu_pd(x + 4), _mm256_castpd256_pd128(first));
+    return _mm256_movemask_pd(head) == 0xf && _mm_movemask_pd(tail) == 0x3;
+#else
+    bool uniform = true;
+    for (int i = 1; i < 6; ++i) {
+      uniform &= x[i] == x[0];
+    }
+    return uniform;
+#endif
+  }
+
+  /**
+   * The rest of `Step` once the action is checked.
+   */
+  void Advance(const Action& action) {
     ++state_;
     int num_players =
         max_num_players_ <= 1 ? 1 : state_ % (max_num_players_ - 1) + 1;
@@ -183,14 +261,6 @@ class DummyEnv : public Env<DummyEnvSpec> {
       }
     }
 
-    // Check if actions can successfully pass into envpool
-    double x = action["list_action"_][0];
-
-    for (int i = 0; i < 6; ++i) {
-      double y = action["list_action"_][i];
-      CHECK_EQ(x, y);
-    }
-
     // Ask envpool to allocate a piece of memory where we can write the state
     // after reset.
     auto state = Allocate(num_players);
@@ -202,17 +272,10 @@ class DummyEnv : public Env<DummyEnvSpec> {
       state["obs:raw"_](i, 0) = state_;
       state["obs:raw"_](i, 1) = action_num;
       state["reward"_][i] = -i;
-      Container<int>& dyn = state["obs:dyn"_][i];
       auto dyn_spec = ::Spec<int>({env_id_ + 1, spec_.config["state_num"_]});
-      dyn = std::make_unique<TArray<int>>(dyn_spec);
-      dyn->Fill(env_id_);
+      state["obs:dyn"_][i].Emplace(dyn_spec).Fill(env_id_);
     }
   }
-
-  /**
-   * Whether the single env has ended the current episode.
-   */
-  bool IsDone() override { return state_ >= seed_; }
 };
 
 /**
@@ -14,7 +14,7 @@
 """Helper function for data convertion."""
 
 from collections import namedtuple
-from typing import Any, Dict, List, Tuple, Type
+from typing import Any, Dict, List, NamedTuple, Optional, Tuple, Type
 
 import dm_env
 import gym
@@ -152,3 +152,52 @@ def gym_structure(
 
 
 gymnasium_structure = gym_structure
+
+
+class OutputLayout(NamedTuple):
+  """Where the outputs of ``recv`` are in the flat state list.
+
+  Built once per EnvPool class and read by the C++ ``_recv_to``, which then
+  assembles the output without rebuilding the state tree in python.
+  """
+
+  api: str
+  new_gym_api: bool
+  obs_spec: PyTreeSpec
+  obs_idx: List[int]
+  info_spec: Optional[PyTreeSpec]
+  info_idx: List[int]
+  timestep: Any
+  reward: int
+  done: int
+  trunc: int
+  step_type: int
+  discount: int
+
+
+def output_layout(
+  api: str,
+  state_idx: List[int],
+  treespec: PyTreeSpec,
+  new_gym_api: bool = True,
+) -> OutputLayout:
+  """Compute the OutputLayout of the state tree given by ``treespec``."""
+  # the leaves of this tree are the indices into the flat state list
+  state = optree.tree_unflatten(treespec, state_idx)
+  if api == "dm":
+    obs_idx, obs_spec = optree.tree_flatten(state.State)
+    return OutputLayout(
+      api, new_gym_api, obs_spec, obs_idx, None, [], dm_env.TimeStep,
+      state.reward, state.done, state.trunc, state.step_type, state.discount
+    )
+  obs_idx, obs_spec = optree.tree_flatten(state["obs"])
+  info = state["info"]
+  if api == "gym" and not new_gym_api:
+    info["TimeLimit.truncated"] = state["trunc"]
+  info["elapsed_step"] = state["elapsed_step"]
+  info_idx, info_spec = optree.tree_flatten(info)
+  return OutputLayout(
+    api, new_gym_api, obs_spec, obs_idx, info_spec, info_idx, None,
+    state["reward"], state["done"], state["trunc"], state["step_type"],
+    state["discount"]
+  )
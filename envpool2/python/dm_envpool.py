@@ -21,7 +21,7 @@ import numpy as np
 import optree
 from dm_env import TimeStep
 
-from .data import dm_structure
+from .data import dm_structure, output_layout
 from .envpool import EnvPoolMixin
 from .utils import check_key_duplication
 
@@ -86,6 +86,7 @@ class DMEnvPoolMeta(ABCMeta):
       return timestep
 
     attrs["_to"] = _to_dm
+    attrs["_output_layout"] = output_layout("dm", state_idx, treepsec)
     subcls = super().__new__(cls, name, parents, attrs)
 
     def init(self: Any, spec: Any) -> None:
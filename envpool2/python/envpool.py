@@ -25,6 +25,14 @@ from dm_env import TimeStep
 from .protocol import EnvPool, EnvSpec
 
 
+def _slice_rows(value: Any, start: Optional[int], stop: Optional[int]) -> Any:
+  if isinstance(value, tuple):
+    # ragged field: (values, offsets), slot i is values[offsets[i]:offsets[i+1]]
+    values, offsets = value
+    return values, offsets[start:None if stop is None else stop + 1]
+  return value[start:stop]
+
+
 class EnvPoolMixin(ABC):
   """Mixin class for EnvPool, exposed to EnvPoolMeta."""
 
@@ -101,6 +109,23 @@ class EnvPoolMixin(ABC):
     return self.config["batch_size"] > 0 and self.config[
       "num_envs"] != self.config["batch_size"]
 
+  def resize(
+    self: EnvPool,
+    num_envs: int,
+    num_threads: int = 0,
+    batch_size: int = 0,
+  ) -> None:
+    """Change the number of envs and threads between a recv and a send.
+
+    The steps in flight are finished and received by the next recv calls in
+    batches of the old size. Envs with ids from ``num_envs`` on are removed.
+    The new ones have to be reset before they are stepped, as after
+    construction. ``batch_size=0`` keeps the batch size in async mode.
+    """
+    self._resize(num_envs, num_threads, batch_size)
+    if hasattr(self, "_all_env_ids"):
+      del self._all_env_ids
+
   def seed(self: EnvPool, seed: Optional[Union[int, List[int]]] = None) -> None:
     """Set the seed for all environments (abandoned)."""
     warnings.warn(
@@ -123,10 +148,34 @@ class EnvPoolMixin(ABC):
     self: EnvPool,
     reset: bool = False,
     return_info: bool = True,
+    format: str = "numpy",
   ) -> Union[TimeStep, Tuple]:
-    """Recv a batch state from EnvPool."""
+    """Recv a batch state from EnvPool.
+
+    With ``format="dlpack"`` the arrays are DLPack capsules that view the
+    state buffer, e.g. for ``torch.from_dlpack`` without a copy. The buffer is
+    released once all consumers of its capsules are done with them.
+    """
+    return self._recv_to(self._output_layout, reset, return_info, format)
+
+  def recv_partitioned(
+    self: EnvPool,
+    reset: bool = False,
+    return_info: bool = True,
+  ) -> Tuple[Union[TimeStep, Tuple], Union[TimeStep, Tuple]]:
+    """Recv a batch state and split it into the two partitions.
+
+    Requires ``num_partitions=2``. Each partition is a contiguous view of the
+    received batch, so no gather is performed.
+    """
     state_list = self._recv()
-    return self._to(state_list, reset, return_info)
+    offset = self._partition_offset()
+    head = [_slice_rows(s, None, offset) for s in state_list]
+    tail = [_slice_rows(s, offset, None) for s in state_list]
+    return (
+      self._to(head, reset, return_info),
+      self._to(tail, reset, return_info),
+    )
 
   def async_reset(self: EnvPool) -> None:
     """Follows the async semantics, reset the envs in env_ids."""
@@ -138,9 +187,29 @@ class EnvPoolMixin(ABC):
     env_id: Optional[np.ndarray] = None,
   ) -> Union[TimeStep, Tuple]:
     """Perform one step with multiple environments in EnvPool."""
+    if self._can_fuse_step(action):
+      if env_id is None:
+        env_id = self.all_env_ids
+      elif env_id.dtype != np.int32 or not env_id.flags.c_contiguous:
+        env_id = np.ascontiguousarray(env_id, dtype=np.int32)
+      return self._step_to(self._output_layout, action, env_id)
     self.send(action, env_id)
     return self.recv(reset=False, return_info=True)
 
+  def _can_fuse_step(self: EnvPool, action: Any) -> bool:
+    """Whether ``action`` can go through the fused C++ ``_step``."""
+    if not hasattr(self, "_fused_step"):
+      spec = self._spec._action_spec
+      self._fused_step = (
+        len(spec) == 3 and spec[-1][0] == np.int32 and
+        len(spec[-1][1]) == 0 and self.config["max_num_players"] == 1
+      )
+    return (
+      self._fused_step and isinstance(action, np.ndarray) and
+      action.dtype == np.int32 and action.ndim == 1 and
+      action.flags.c_contiguous
+    )
+
   def reset(
     self: EnvPool,
     env_id: Optional[np.ndarray] = None,
@@ -21,7 +21,7 @@ import numpy as np
 import optree
 from packaging import version
 
-from .data import gym_structure
+from .data import gym_structure, output_layout
 from .envpool import EnvPoolMixin
 from .utils import check_key_duplication
 
@@ -95,6 +95,9 @@ class GymEnvPoolMeta(ABCMeta, gym.Env.__class__):
       return state["obs"], state["reward"], state["done"], info
 
     attrs["_to"] = _to_gym
+    attrs["_output_layout"] = output_layout(
+      "gym", state_idx, treepsec, new_gym_api
+    )
     subcls = super().__new__(cls, name, parents, attrs)
 
     def init(self: Any, spec: Any) -> None:
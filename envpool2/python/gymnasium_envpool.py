@@ -20,7 +20,7 @@ import gymnasium
 import numpy as np
 import optree
 
-from .data import gymnasium_structure
+from .data import gymnasium_structure, output_layout
 from .envpool import EnvPoolMixin
 from .utils import check_key_duplication
 
@@ -88,6 +88,7 @@ class GymnasiumEnvPoolMeta(ABCMeta, gymnasium.Env.__class__):
       return state["obs"], state["reward"], terminated, state["trunc"], info
 
     attrs["_to"] = _to_gymnasium
+    attrs["_output_layout"] = output_layout("gymnasium", state_idx, treepsec)
     subcls = super().__new__(cls, name, parents, attrs)
 
     def init(self: Any, spec: Any) -> None:
@@ -157,6 +157,28 @@ class EnvPool(Protocol):
   def _reset(self, env_id: np.ndarray) -> None:
     """Cpp private _reset method."""
 
+  def _partition_offset(self) -> int:
+    """Cpp private _partition_offset method."""
+
+  def _resize(self, num_envs: int, num_threads: int, batch_size: int) -> None:
+    """Cpp private _resize method."""
+
+  def _step(self, action: np.ndarray, env_id: np.ndarray) -> List[np.ndarray]:
+    """Cpp private _step method, a fused _send and _recv."""
+
+  def _recv_to(
+    self, layout: Any, reset: bool, return_info: bool, format: str
+  ) -> Union[TimeStep, Tuple]:
+    """Cpp private _recv method that also builds the output, like _to."""
+
+  def _recv_dlpack(self) -> List[Any]:
+    """Cpp private _recv method returning DLPack capsules."""
+
+  def _step_to(
+    self, layout: Any, action: np.ndarray, env_id: np.ndarray
+  ) -> Union[TimeStep, Tuple]:
+    """Cpp private _step method that also builds the output, like _to."""
+
   def _from(
     self,
     action: Union[Dict[str, Any], np.ndarray],
@@ -194,6 +216,14 @@ class EnvPool(Protocol):
   def action_spec(self) -> Union[dm_env.specs.Array, Tuple]:
     """Dm action spec."""
 
+  def resize(
+    self,
+    num_envs: int,
+    num_threads: int = 0,
+    batch_size: int = 0,
+  ) -> None:
+    """Envpool resize interface."""
+
   def seed(self, seed: Optional[Union[int, List[int]]] = None) -> None:
     """Set the seed for all environments."""
 
@@ -212,6 +242,7 @@ class EnvPool(Protocol):
     self,
     reset: bool = False,
     return_info: bool = True,
+    format: str = "numpy",
   ) -> Union[TimeStep, Tuple]:
     """Envpool recv wrapper."""
 
@@ -18,6 +18,7 @@ import os
 from typing import Any, Dict, List, Tuple
 
 import gym
+import numpy as np
 from packaging import version
 
 base_path = os.path.abspath(os.path.dirname(__file__))
@@ -46,8 +47,7 @@ class EnvRegistry:
       "gymnasium": (import_path, gymnasium_cls)
     }
 
-  def make(self, task_id: str, env_type: str, **kwargs: Any) -> Any:
-    """Make envpool."""
+  def _check_gym_kwargs(self, kwargs: Dict[str, Any]) -> None:
     new_gym_api = version.parse(gym.__version__) >= version.parse("0.26.0")
     if "gym_reset_return_info" not in kwargs:
       kwargs["gym_reset_return_info"] = new_gym_api
@@ -58,6 +58,10 @@ class EnvRegistry:
         "after resets."
       )
 
+  def make(self, task_id: str, env_type: str, **kwargs: Any) -> Any:
+    """Make envpool."""
+    self._check_gym_kwargs(kwargs)
+
     assert task_id in self.specs, \
       f"{task_id} is not supported, `envpool.list_all_envs()` may help."
     assert env_type in ["dm", "gym", "gymnasium"]
@@ -66,6 +70,121 @@ class EnvRegistry:
     import_path, envpool_cls = self.envpools[task_id][env_type]
     return getattr(importlib.import_module(import_path), envpool_cls)(spec)
 
+  def make_shm_server(
+    self,
+    task_id: str,
+    name: str,
+    num_clients: int,
+    unlink_existing: bool = False,
+    **kwargs: Any
+  ) -> Any:
+    """Serve the envs of task_id to other processes through shared memory.
+
+    The envs are split evenly into ``num_clients`` contiguous ranges, each
+    client receiving batches of ``batch_size // num_clients`` states. The
+    server runs in background threads until it is closed or collected.
+    Creating a server fails if its shared memory segments already exist;
+    ``unlink_existing`` removes those left behind by a server that died.
+    """
+    self._check_gym_kwargs(kwargs)
+    spec = self.make_spec(task_id, **kwargs)
+    module, pool_cls = self._pool_module(task_id, "dm")
+    server_cls = getattr(module, pool_cls.__mro__[1].__name__ + "ShmServer")
+    return server_cls(spec, name, num_clients, unlink_existing)
+
+  def make_shm_client(
+    self,
+    task_id: str,
+    name: str,
+    client_id: int,
+    env_type: str = "gym",
+    **kwargs: Any
+  ) -> Any:
+    """Attach to the envs served by ``make_shm_server`` as client_id.
+
+    The kwargs must produce the same config as the server's. The returned
+    envpool only sees the envs of its range, and the states it receives are
+    views of shared memory.
+    """
+    self._check_gym_kwargs(kwargs)
+    assert env_type in ["dm", "gym", "gymnasium"]
+    spec = self.make_spec(task_id, **kwargs)
+    module, pool_cls = self._pool_module(task_id, env_type)
+    client_base = getattr(module, pool_cls.__mro__[1].__name__ + "ShmClient")
+
+    def all_env_ids(self: Any) -> np.ndarray:
+      if not hasattr(self, "_all_env_ids"):
+        self._all_env_ids = np.arange(
+          self._env_begin(), self._env_end(), dtype=np.int32
+        )
+      return self._all_env_ids
+
+    return self._wrap_pool(
+      pool_cls, client_base, "ShmClient", {
+        "all_env_ids": property(all_env_ids),
+        "__len__": lambda self: self._env_end() - self._env_begin(),
+      }, spec, name, client_id
+    )
+
+  def make_remote_server(
+    self,
+    task_id: str,
+    address: str,
+    compress_keys: Tuple[str, ...] = (),
+    **kwargs: Any
+  ) -> Any:
+    """Serve the envs of task_id on a tcp (host:port) or unix: address.
+
+    Call ``serve()`` on the result to accept connections; states whose key is
+    in ``compress_keys`` are sent compressed.
+    """
+    self._check_gym_kwargs(kwargs)
+    spec = self.make_spec(task_id, **kwargs)
+    module, pool_cls = self._pool_module(task_id, "dm")
+    server_cls = getattr(module, pool_cls.__mro__[1].__name__ + "RemoteServer")
+    return server_cls(spec, address, list(compress_keys))
+
+  def make_remote(
+    self,
+    task_id: str,
+    addresses: List[str],
+    env_type: str = "gym",
+    **kwargs: Any
+  ) -> Any:
+    """Make an envpool whose envs run on the servers at ``addresses``.
+
+    The envs of the servers are numbered in the order of ``addresses``, and
+    ``num_envs`` must be their total.
+    """
+    self._check_gym_kwargs(kwargs)
+    assert env_type in ["dm", "gym", "gymnasium"]
+    spec = self.make_spec(task_id, **kwargs)
+    module, pool_cls = self._pool_module(task_id, env_type)
+    remote_base = getattr(module, pool_cls.__mro__[1].__name__ + "Remote")
+    return self._wrap_pool(
+      pool_cls, remote_base, "Remote", {}, spec, list(addresses)
+    )
+
+  def _wrap_pool(
+    self, pool_cls: Any, base: Any, suffix: str, attrs: Dict[str, Any],
+    spec: Any, *args: Any
+  ) -> Any:
+    # give `base` the python api of `pool_cls`, whose __init__ only takes spec
+    cls = type(pool_cls)(
+      pool_cls.__name__.replace("EnvPool", suffix), (base,), attrs
+    )
+    pool = cls.__new__(cls)
+    base.__init__(pool, spec, *args)
+    pool.spec = spec
+    return pool
+
+  def _pool_module(self, task_id: str, env_type: str) -> Tuple[Any, Any]:
+    assert task_id in self.specs, \
+      f"{task_id} is not supported, `envpool.list_all_envs()` may help."
+    import_path, envpool_cls = self.envpools[task_id][env_type]
+    module = importlib.import_module(import_path)
+    return module, getattr(module, envpool_cls)
+
   def make_dm(self, task_id: str, **kwargs: Any) -> Any:
     """Make dm_env compatible envpool."""
     return self.make(task_id, "dm", **kwargs)
@@ -94,6 +213,8 @@ class EnvRegistry:
       assert 0 <= kwargs["batch_size"] <= kwargs["num_envs"]
     if "max_num_players" in kwargs:
       assert 1 <= kwargs["max_num_players"]
+    if "num_partitions" in kwargs:
+      assert kwargs["num_partitions"] in [1, 2]
 
     spec_cls = getattr(importlib.import_module(import_path), spec_cls)
     config = spec_cls.gen_config(**kwargs)
@@ -112,4 +233,8 @@ make_dm = registry.make_dm
 make_gym = registry.make_gym
 make_gymnasium = registry.make_gymnasium
 make_spec = registry.make_spec
+make_shm_server = registry.make_shm_server
+make_shm_client = registry.make_shm_client
+make_remote_server = registry.make_remote_server
+make_remote = registry.make_remote
 list_all_envs = registry.list_all_envs
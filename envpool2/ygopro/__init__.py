@@ -2,8 +2,15 @@ from envpool2.python.api import py_env
 
 from .ygopro_envpool import (
   _YGOProEnvPool,
+  _YGOProEnvPoolRemote,
+  _YGOProEnvPoolRemoteServer,
+  _YGOProEnvPoolShmClient,
+  _YGOProEnvPoolShmServer,
   _YGOProEnvSpec,
+  arena,
   init_module,
+  msg_stats,
+  reset_msg_stats,
 )
 
 (
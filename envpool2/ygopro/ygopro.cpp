@@ -7,5 +7,13 @@ using YGOProEnvPool = PyEnvPool<ygopro::YGOProEnvPool>;
 PYBIND11_MODULE(ygopro_envpool, m) {
   REGISTER(m, YGOProEnvSpec, YGOProEnvPool)
 
-  m.def("init_module", &ygopro::init_module);
+  m.def("init_module", &ygopro::init_module, py::arg("db_path"),
+        py::arg("code_list_file"), py::arg("decks"), py::arg("registry") = "",
+        py::call_guard<py::gil_scoped_release>());
+  m.def("msg_stats", &ygopro::msg_stats);
+  m.def("reset_msg_stats", &ygopro::reset_msg_stats);
+  m.def("arena", &ygopro::arena, py::arg("decks"), py::arg("num_games"),
+        py::arg("player0") = "greedy", py::arg("player1") = "greedy",
+        py::arg("num_threads") = 0, py::arg("seed") = 0,
+        py::arg("registry") = "", py::call_guard<py::gil_scoped_release>());
 }
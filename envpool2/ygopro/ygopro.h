@@ -2,13 +2,29 @@
 #define ENVPOOL_YGOPRO_YGOPRO_H_
 
 // clang-format off
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <fstream>
 #include <shared_mutex>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <SQLiteCpp/SQLiteCpp.h>
 #include <SQLiteCpp/VariadicBind.h>
 #include <ankerl/unordered_dense.h>
+#include <glog/logging.h>
 
 #include "envpool2/core/async_envpool.h"
 #include "envpool2/core/env.h"
@@ -905,27 +921,114 @@ struct card_script {
   int len;
 };
 
-static ankerl::unordered_dense::map<CardCode, Card> cards_;
-static ankerl::unordered_dense::map<CardCode, CardId> card_ids_;
-static ankerl::unordered_dense::map<CardCode, card_data> cards_data_;
 static ankerl::unordered_dense::map<std::string, card_script> cards_script_;
-static ankerl::unordered_dense::map<std::string, std::vector<CardCode>>
-    main_decks_;
-static ankerl::unordered_dense::map<std::string, std::vector<CardCode>>
-    extra_decks_;
-static std::vector<std::string> deck_names_;
+
+// The cards, decks and code list loaded by init_module. A registry is never
+// changed once published: each env pins the current one at Reset and keeps it
+// for the whole episode, so a new one takes effect for new episodes only.
+struct CardRegistry {
+  uint64_t version = 0;
+  ankerl::unordered_dense::map<CardCode, Card> cards;
+  ankerl::unordered_dense::map<CardCode, CardId> card_ids;
+  ankerl::unordered_dense::map<CardCode, card_data> cards_data;
+  ankerl::unordered_dense::map<std::string, std::vector<CardCode>> main_decks;
+  ankerl::unordered_dense::map<std::string, std::vector<CardCode>> extra_decks;
+  std::vector<std::string> deck_names;
+};
+
+using CardRegistries =
+    ankerl::unordered_dense::map<std::string,
+                                 std::shared_ptr<const CardRegistry>>;
+
+// the published registries by name, replaced as a whole with
+// std::atomic_store; registries_mtx only orders the publishers
+static std::shared_ptr<const CardRegistries> registries_ =
+    std::make_shared<const CardRegistries>();
+static std::mutex registries_mtx;
+static std::atomic<uint64_t> registry_version_{0};
+
+// the registry of the duel run by this thread, see RegistryScope
+static thread_local const CardRegistry *active_registry_ = nullptr;
+
+static uint64_t publish_registry(const std::string &name,
+                                 std::shared_ptr<CardRegistry> registry) {
+  std::lock_guard<std::mutex> lock(registries_mtx);
+  registry->version = ++registry_version_;
+  auto registries = std::make_shared<CardRegistries>(
+      *std::atomic_load(&registries_));
+  (*registries)[name] = std::move(registry);
+  std::atomic_store(&registries_,
+                    std::shared_ptr<const CardRegistries>(registries));
+  return registry_version_;
+}
+
+inline std::shared_ptr<const CardRegistry>
+load_registry(const std::string &name) {
+  auto registries = std::atomic_load(&registries_);
+  auto it = registries->find(name);
+  if (it == registries->end()) {
+    throw std::runtime_error("Card registry \"" + name +
+                             "\" not found, call init_module first");
+  }
+  return it->second;
+}
+
+// Makes `registry` the one read by the card lookups and the card reader of
+// ygopro-core on this thread, while the scope lives.
+class RegistryScope {
+  const CardRegistry *prev_;
+
+public:
+  explicit RegistryScope(const CardRegistry *registry)
+      : prev_(active_registry_) {
+    active_registry_ = registry;
+  }
+  ~RegistryScope() { active_registry_ = prev_; }
+  RegistryScope(const RegistryScope &) = delete;
+  RegistryScope &operator=(const RegistryScope &) = delete;
+};
+
+// number of handled messages and time spent in their handlers (in ns) by
+// message type, accumulated over all envs with `profile_messages` enabled
+static std::array<std::atomic<uint64_t>, 256> msg_counts_;
+static std::array<std::atomic<uint64_t>, 256> msg_times_ns_;
+
+// returns (message, count, seconds) for all handled message types
+static std::vector<std::tuple<std::string, uint64_t, double>> msg_stats() {
+  std::vector<std::tuple<std::string, uint64_t, double>> stats;
+  for (int i = 0; i < 256; ++i) {
+    uint64_t count = msg_counts_[i];
+    if (count == 0) {
+      continue;
+    }
+    stats.emplace_back(msg_to_string(i), count, msg_times_ns_[i] * 1e-9);
+  }
+  return stats;
+}
+
+static void reset_msg_stats() {
+  for (int i = 0; i < 256; ++i) {
+    msg_counts_[i] = 0;
+    msg_times_ns_[i] = 0;
+  }
+}
 
 
-inline const Card &c_get_card(CardCode code) { return cards_.at(code); }
+inline const Card &c_get_card(CardCode code) {
+  return active_registry_->cards.at(code);
+}
 
-inline CardId &c_get_card_id(CardCode code) { return card_ids_.at(code); }
+inline const CardId &c_get_card_id(CardCode code) {
+  return active_registry_->card_ids.at(code);
+}
 
-inline void sort_extra_deck(std::vector<CardCode> &deck) {
+inline void sort_extra_deck(const CardRegistry &registry,
+                            std::vector<CardCode> &deck) {
   std::vector<CardCode> c;
   std::vector<std::pair<CardCode, int>> fusion, xyz, synchro, link;
 
   for (auto code : deck) {
-    const Card &cc = c_get_card(code);
+    const Card &cc = registry.cards.at(code);
     if (cc.type() & TYPE_FUSION) {
       fusion.push_back({code, cc.level()});
     } else if (cc.type() & TYPE_XYZ) {
@@ -964,28 +1067,33 @@ inline void sort_extra_deck(std::vector<CardCode> &deck) {
   deck = c;
 }
 
-inline void preload_deck(const SQLite::Database &db,
+inline void preload_deck(const SQLite::Database &db, CardRegistry &registry,
                          const std::vector<CardCode> &deck) {
   for (const auto &code : deck) {
-    auto it = cards_.find(code);
-    if (it == cards_.end()) {
-      cards_[code] = db_query_card(db, code);
-      if (card_ids_.find(code) == card_ids_.end()) {
+    auto it = registry.cards.find(code);
+    if (it == registry.cards.end()) {
+      registry.cards[code] = db_query_card(db, code);
+      if (registry.card_ids.find(code) == registry.card_ids.end()) {
         throw std::runtime_error("Card not found in code list: " +
                                  std::to_string(code));
       }
     }
 
-    auto it2 = cards_data_.find(code);
-    if (it2 == cards_data_.end()) {
-      cards_data_[code] = db_query_card_data(db, code);
+    auto it2 = registry.cards_data.find(code);
+    if (it2 == registry.cards_data.end()) {
+      registry.cards_data[code] = db_query_card_data(db, code);
     }
   }
 }
 
 inline uint32 card_reader_callback(CardCode code, card_data *card) {
-  auto it = cards_data_.find(code);
-  if (it == cards_data_.end()) {
+  if (active_registry_ == nullptr) {
+    throw std::runtime_error("Card read outside of a duel: " +
+                             std::to_string(code));
+  }
+  const auto &cards_data = active_registry_->cards_data;
+  auto it = cards_data.find(code);
+  if (it == cards_data.end()) {
     throw std::runtime_error("Card not found: " + std::to_string(code));
   }
   *card = it->second;
@@ -1027,9 +1135,14 @@ inline byte *script_reader_callback(const char *name, int *lenptr) {
   return it->second.buf;
 }
 
-static void init_module(const std::string &db_path,
-                        const std::string &code_list_file,
-                        const std::map<std::string, std::string> &decks) {
+// Loads the card DB, code list and decks into a new registry and publishes it
+// as `registry`, replacing the one of that name. Envs running pick it up at
+// their next Reset. Returns the version of the new registry.
+static uint64_t init_module(const std::string &db_path,
+                            const std::string &code_list_file,
+                            const std::map<std::string, std::string> &decks,
+                            const std::string &registry = "") {
+  auto reg = std::make_shared<CardRegistry>();
   // parse code from code_list_file
   std::ifstream file(code_list_file);
   std::string line;
@@ -1037,7 +1150,7 @@ static void init_module(const std::string &db_path,
   while (std::getline(file, line)) {
     i++;
     CardCode code = std::stoul(line);
-    card_ids_[code] = i;
+    reg->card_ids[code] = i;
   }
 
   SQLite::Database db(db_path, SQLite::OPEN_READONLY);
@@ -1045,22 +1158,23 @@ static void init_module(const std::string &db_path,
   for (const auto &[name, deck] : decks) {
     std::vector<CardCode> main_deck = read_main_deck(deck);
     std::vector<CardCode> extra_deck = read_extra_deck(deck);
-    main_decks_[name] = main_deck;
-    extra_decks_[name] = extra_deck;
+    reg->main_decks[name] = main_deck;
+    reg->extra_decks[name] = extra_deck;
     if (name[0] != '_') {
-      deck_names_.push_back(name);
+      reg->deck_names.push_back(name);
     }
 
-    preload_deck(db, main_deck);
-    preload_deck(db, extra_deck);
+    preload_deck(db, *reg, main_deck);
+    preload_deck(db, *reg, extra_deck);
   }
 
-  for (auto &[name, deck] : extra_decks_) {
-    sort_extra_deck(deck);
+  for (auto &[name, deck] : reg->extra_decks) {
+    sort_extra_deck(*reg, deck);
   }
 
   set_card_reader(card_reader_callback);
   set_script_reader(script_reader_callback);
+  return publish_registry(registry, std::move(reg));
 }
 
 inline std::string getline() {
@@ -1118,6 +1232,18 @@ public:
   const std::string &nickname() const { return nickname_; }
 
   virtual int think(const std::vector<std::string> &options) = 0;
+
+  // Whether think may block for long, e.g. on user input or a remote peer.
+  // The env then asks through think_async and suspends instead of holding
+  // the worker thread.
+  virtual bool blocking() const { return false; }
+
+  // Decide in the background and pass the chosen index to `done`, which may
+  // be called from any thread, also before think_async returns.
+  virtual void think_async(const std::vector<std::string> &options,
+                           std::function<void(int)> done) {
+    done(think(options));
+  }
 };
 
 class GreedyAI : public Player {
@@ -1148,11 +1274,33 @@ public:
 
 class HumanPlayer : public Player {
 protected:
+  // reads the answer of think_async from stdin
+  std::thread reader_;
+
 public:
   HumanPlayer(const std::string &nickname, int init_lp, PlayerId duel_player,
               bool verbose = false)
       : Player(nickname, init_lp, duel_player, verbose) {}
 
+  ~HumanPlayer() override {
+    if (reader_.joinable()) {
+      reader_.join();
+    }
+  }
+
+  bool blocking() const override { return true; }
+
+  void think_async(const std::vector<std::string> &options,
+                   std::function<void(int)> done) override {
+    // the previous reader has called its `done`, so it is about to finish
+    if (reader_.joinable()) {
+      reader_.join();
+    }
+    reader_ = std::thread([this, options, done = std::move(done)] {
+      done(think(options));
+    });
+  }
+
   int think(const std::vector<std::string> &options) override {
     while (true) {
       std::string input = getline();
@@ -1182,7 +1330,13 @@ public:
                     "play_mode"_.Bind(std::string("bot")),
                     "verbose"_.Bind(false), "max_options"_.Bind(16),
                     "max_cards"_.Bind(75), "n_history_actions"_.Bind(16),
-                    "max_multi_select"_.Bind(5));
+                    "max_multi_select"_.Bind(5), "option_paging"_.Bind(false),
+                    "record_path"_.Bind(std::string("")),
+                    "replay_path"_.Bind(std::string("")),
+                    "profile_messages"_.Bind(false),
+                    "step_timeout_ms"_.Bind(0), "max_process_calls"_.Bind(0),
+                    "watchdog_path"_.Bind(std::string("")),
+                    "card_registry"_.Bind(std::string("")));
   }
   template <typename Config>
   static decltype(auto) StateSpec(const Config &conf) {
@@ -1194,10 +1348,14 @@ public:
             Spec<uint8_t>({conf["max_options"_], n_action_feats})),
         "obs:h_actions_"_.Bind(
             Spec<uint8_t>({conf["n_history_actions"_], n_action_feats})),
-        "info:num_options"_.Bind(Spec<int>({}, {0, conf["max_options"_] - 1})),
-        "info:to_play"_.Bind(Spec<int>({}, {0, 1})),
-        "info:is_selfplay"_.Bind(Spec<int>({}, {0, 1})),
-        "info:win_reason"_.Bind(Spec<int>({}, {-1, 1})));
+        "obs:mask_"_.Bind(Spec<PackedBits>({conf["max_options"_]})),
+        "info:num_options"_.Bind(
+            Spec<uint8_t>({}, {0, conf["max_options"_] - 1})),
+        "info:truncated_options"_.Bind(Spec<int>({})),
+        "info:recorded_action"_.Bind(Spec<int>({})),
+        "info:to_play"_.Bind(Spec<int8_t>({}, {0, 1})),
+        "info:is_selfplay"_.Bind(Spec<int8_t>({}, {0, 1})),
+        "info:win_reason"_.Bind(Spec<int8_t>({}, {-1, 1})));
   }
   template <typename Config>
   static decltype(auto) ActionSpec(const Config &conf) {
@@ -1236,10 +1394,305 @@ inline std::vector<PlayMode> parse_play_modes(const std::string &play_mode) {
   return modes;
 }
 
+// A finished duel in the replay format. Records are appended to a replay file
+// back to back, each one laid out as (all little-endian):
+//   u32 magic, u32 size of the record in bytes, u64 duel seed,
+//   u8 play mode, u8 ai player, u8 winner, u8 win reason,
+//   u16 main deck size x 2, u16 extra deck size x 2, u32 number of actions,
+//   u32 card codes of the decks (main0, extra0, main1, extra1),
+//   u16 actions
+// The decks are stored after shuffling, so that the duel is re-simulated with
+// only the seed and the actions. Actions taken through `Step` have
+// kAgentAction set, the others are made by the built-in players.
+struct DuelRecord {
+  static constexpr uint32_t kMagic = 0x31524759; // "YGR1"
+  static constexpr uint16_t kAgentAction = 0x8000;
+  static constexpr int kHeaderSize = 32;
+
+  uint64_t seed = 0;
+  uint8_t play_mode = 0;
+  uint8_t ai_player = 0;
+  uint8_t winner = 0;
+  uint8_t win_reason = 0;
+  std::vector<CardCode> main_decks[2];
+  std::vector<CardCode> extra_decks[2];
+  std::vector<uint16_t> actions;
+
+  std::string serialize() const {
+    std::string buf;
+    auto put = [&buf](const auto &v) {
+      buf.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+    auto put_all = [&buf](const auto &vec) {
+      buf.append(reinterpret_cast<const char *>(vec.data()),
+                 vec.size() * sizeof(vec[0]));
+    };
+    put(kMagic);
+    put(uint32_t(0));
+    put(seed);
+    put(play_mode);
+    put(ai_player);
+    put(winner);
+    put(win_reason);
+    for (int i = 0; i < 2; ++i) {
+      put(uint16_t(main_decks[i].size()));
+      put(uint16_t(extra_decks[i].size()));
+    }
+    put(uint32_t(actions.size()));
+    for (int i = 0; i < 2; ++i) {
+      put_all(main_decks[i]);
+      put_all(extra_decks[i]);
+    }
+    put_all(actions);
+    uint32_t size = buf.size();
+    std::memcpy(&buf[4], &size, sizeof(size));
+    return buf;
+  }
+
+  // parses the record at `data` and returns its size in bytes
+  uint32_t deserialize(const char *data, size_t len) {
+    auto check = [len](size_t n) {
+      if (n > len) {
+        throw std::runtime_error("Truncated duel record");
+      }
+    };
+    check(kHeaderSize);
+    size_t p = 0;
+    auto get = [data, &p](auto &v) {
+      std::memcpy(&v, data + p, sizeof(v));
+      p += sizeof(v);
+    };
+    auto get_all = [data, &p](auto &vec, size_t n) {
+      vec.resize(n);
+      std::memcpy(vec.data(), data + p, n * sizeof(vec[0]));
+      p += n * sizeof(vec[0]);
+    };
+    uint32_t magic, size, n_actions;
+    uint16_t n_main[2], n_extra[2];
+    get(magic);
+    if (magic != kMagic) {
+      throw std::runtime_error("Invalid duel record");
+    }
+    get(size);
+    check(size);
+    get(seed);
+    get(play_mode);
+    get(ai_player);
+    get(winner);
+    get(win_reason);
+    for (int i = 0; i < 2; ++i) {
+      get(n_main[i]);
+      get(n_extra[i]);
+    }
+    get(n_actions);
+    for (int i = 0; i < 2; ++i) {
+      get_all(main_decks[i], n_main[i]);
+      get_all(extra_decks[i], n_extra[i]);
+    }
+    get_all(actions, n_actions);
+    if (p != size) {
+      throw std::runtime_error("Corrupted duel record");
+    }
+    return size;
+  }
+};
+
+// Appends duel records to a file, shared by all the envs recording to it.
+class ReplayWriter {
+  std::mutex mtx_;
+  std::FILE *file_;
+
+public:
+  explicit ReplayWriter(const std::string &path)
+      : file_(std::fopen(path.c_str(), "ab")) {
+    if (file_ == nullptr) {
+      throw std::runtime_error("Cannot open replay file " + path);
+    }
+  }
+
+  ~ReplayWriter() { std::fclose(file_); }
+
+  void write(const DuelRecord &record) {
+    auto buf = record.serialize();
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::fwrite(buf.data(), 1, buf.size(), file_);
+    std::fflush(file_);
+  }
+};
+
+// A memory-mapped replay file. Envs replaying the same file take its records
+// in turn, so that replaying is spread over the worker threads.
+class ReplayReader {
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  std::vector<size_t> offsets_;
+  std::atomic<size_t> next_{0};
+
+public:
+  explicit ReplayReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open replay file " + path);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Cannot mmap replay file " + path);
+      }
+      data_ = static_cast<const char *>(p);
+    }
+    close(fd);
+    // index the records, a partially written record at the end is ignored
+    size_t offset = 0;
+    while (offset + DuelRecord::kHeaderSize <= size_) {
+      uint32_t size;
+      std::memcpy(&size, data_ + offset + 4, sizeof(size));
+      if ((size < DuelRecord::kHeaderSize) || (offset + size > size_)) {
+        break;
+      }
+      offsets_.push_back(offset);
+      offset += size;
+    }
+    if (offsets_.empty()) {
+      throw std::runtime_error("No duel record in replay file " + path);
+    }
+  }
+
+  ~ReplayReader() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  size_t size() const { return offsets_.size(); }
+
+  // reads the next record, wraps around after the last one
+  void next(DuelRecord &record) {
+    size_t offset = offsets_[next_.fetch_add(1) % offsets_.size()];
+    record.deserialize(data_ + offset, size_ - offset);
+  }
+};
+
+// replay files are opened once per process and shared by the envs
+template <typename T>
+inline std::shared_ptr<T> open_replay_file(const std::string &path) {
+  static std::mutex mtx;
+  static std::map<std::string, std::weak_ptr<T>> files;
+  std::lock_guard<std::mutex> lock(mtx);
+  auto file = files[path].lock();
+  if (file == nullptr) {
+    file = std::make_shared<T>(path);
+    files[path] = file;
+  }
+  return file;
+}
+
+// A size of ObsLayout that is only known from the config
+constexpr int kDynamic = -1;
+
+// columns of obs:cards_
+constexpr int kCardFeats = 39;
+
+// Row-major view of a uint8 feature matrix with `Cols` columns, or with the
+// columns of `arr` if Cols is kDynamic. Indexing it is plain pointer
+// arithmetic, while indexing a TArray builds a temporary Array per element.
+template <int Cols> class FeatView {
+  uint8_t *data_;
+  int cols_;
+
+public:
+  explicit FeatView(const TArray<uint8_t> &arr)
+      : data_(static_cast<uint8_t *>(arr.Data())), cols_(arr.Shape(1)) {}
+
+  int cols() const { return Cols == kDynamic ? cols_ : Cols; }
+
+  uint8_t &operator()(int i, int j) const { return data_[i * cols() + j]; }
+
+  uint8_t *row(int i) const { return data_ + i * cols(); }
+
+  // the action features follow the 2 * max_multi_select card index bytes
+  int action_offset() const { return cols() - 9; }
+};
+
+// Sizes of the observation, fixed at compile time unless kDynamic. The
+// observation writers are instantiated for every layout in FixedObsLayouts
+// and for the dynamic one, and each state is written with the fixed layout
+// that matches the config if there is one.
+template <int MaxOptions, int MaxCards, int MaxMultiSelect, int NHistory>
+class ObsLayout {
+  int max_options_, max_cards_, max_multi_select_, n_history_actions_;
+
+  static constexpr int pick(int fixed, int value) {
+    return fixed == kDynamic ? value : fixed;
+  }
+
+public:
+  static constexpr int kActionFeats =
+      MaxMultiSelect == kDynamic ? kDynamic : 9 + MaxMultiSelect * 2;
+  using ActionView = FeatView<kActionFeats>;
+
+  template <typename Config>
+  explicit ObsLayout(const Config &conf)
+      : max_options_(conf["max_options"_]), max_cards_(conf["max_cards"_]),
+        max_multi_select_(conf["max_multi_select"_]),
+        n_history_actions_(conf["n_history_actions"_]) {}
+
+  template <int... Sizes>
+  explicit ObsLayout(const ObsLayout<Sizes...> &layout)
+      : max_options_(layout.max_options()), max_cards_(layout.max_cards()),
+        max_multi_select_(layout.max_multi_select()),
+        n_history_actions_(layout.n_history_actions()) {}
+
+  // whether the fixed sizes agree with those of `layout`
+  template <typename Layout> static bool matches(const Layout &layout) {
+    return pick(MaxOptions, layout.max_options()) == layout.max_options() &&
+           pick(MaxCards, layout.max_cards()) == layout.max_cards() &&
+           pick(MaxMultiSelect, layout.max_multi_select()) ==
+               layout.max_multi_select() &&
+           pick(NHistory, layout.n_history_actions()) ==
+               layout.n_history_actions();
+  }
+
+  int max_options() const { return pick(MaxOptions, max_options_); }
+  int max_cards() const { return pick(MaxCards, max_cards_); }
+  int max_multi_select() const {
+    return pick(MaxMultiSelect, max_multi_select_);
+  }
+  int n_history_actions() const { return pick(NHistory, n_history_actions_); }
+};
+
+using DynamicObsLayout = ObsLayout<kDynamic, kDynamic, kDynamic, kDynamic>;
+
+// the default config, add production configs here
+using FixedObsLayouts = std::tuple<ObsLayout<16, 75, 5, 16>>;
+
+// Calls `f` with the first of FixedObsLayouts that matches `layout`, or with
+// `layout` itself if none does.
+template <std::size_t I = 0, typename F>
+void visit_obs_layout(const DynamicObsLayout &layout, F &&f) {
+  if constexpr (I == std::tuple_size_v<FixedObsLayouts>) {
+    f(layout);
+  } else {
+    using Layout = std::tuple_element_t<I, FixedObsLayouts>;
+    if (Layout::matches(layout)) {
+      f(Layout(layout));
+    } else {
+      visit_obs_layout<I + 1>(layout, std::forward<F>(f));
+    }
+  }
+}
+
 class YGOProEnv : public Env<YGOProEnvSpec> {
 protected:
   std::string deck1_;
   std::string deck2_;
+  // the card registry of the current episode, pinned at Reset
+  const std::string registry_name_;
+  std::shared_ptr<const CardRegistry> registry_;
   std::vector<uint32> main_deck0_;
   std::vector<uint32> main_deck1_;
   std::vector<uint32> extra_deck0_;
@@ -1259,7 +1712,10 @@ protected:
   PlayerId ai_player_;
 
   intptr_t pduel_;
-  Player *players_[2]; //  abstract class must be pointer
+  Player *players_[2]{nullptr, nullptr}; //  abstract class must be pointer
+
+  // both players are built-in players, see play_arena_duel
+  bool arena_ = false;
 
   std::uniform_int_distribution<uint64_t> dist_int_;
   bool done_{true};
@@ -1279,12 +1735,68 @@ protected:
   int msg_;
   std::vector<std::string> options_;
   PlayerId to_play_;
-  std::function<void(int)> callback_;
+
+  // Where handle_messages stopped: at the end of the message buffer, at a
+  // decision of the agent, or at a decision of a blocking player, for which
+  // the env suspends until think_async answers with `opponent_idx_`.
+  enum class Stop : uint8_t { kDrained, kAgent, kWaiting };
+  int opponent_idx_;
+  // whether the suspended step is a Reset
+  bool resuming_reset_ = false;
+
+  // With option paging, a decision with more than max_options options is shown
+  // max_options - 1 options at a time, and the last action moves to the next
+  // page. Otherwise the options beyond max_options are dropped.
+  const bool option_paging_;
+  int option_page_ = 0;
+  int page_begin_ = 0;
+  int page_size_ = 0;
+  // number of options in the current page, the next page action follows them
+  int page_options_ = 0;
+  bool has_next_page_ = false;
+
+  // Response of an option, either an integer or `size` bytes starting at
+  // `value` in `resp_bytes_`. Responses are encoded together with the options
+  // into storage that is reused across decisions, so answering a decision
+  // only copies bytes.
+  struct Response {
+    bool is_int;
+    int32_t value;
+    uint8_t size;
+  };
+  std::vector<Response> responses_;
+  std::vector<uint8_t> resp_bytes_;
 
   byte data_[4096];
   int dp_ = 0;
   int dl_ = 0;
 
+  // Finished duels are appended to recorder_ when record_path is set. With
+  // replay_path set, the env re-simulates the recorded duels instead, and
+  // only stops at the decisions taken through Step.
+  std::shared_ptr<ReplayWriter> recorder_;
+  std::shared_ptr<ReplayReader> replayer_;
+  DuelRecord record_;
+  size_t replay_pos_ = 0;
+
+  // per message type statistics of handle_message, flushed to the global
+  // counters at the end of each duel
+  const bool profile_messages_;
+  std::array<uint64_t, 256> msg_count_{};
+  std::array<uint64_t, 256> msg_time_ns_{};
+
+  // Watchdog of runaway duels, e.g. a script that never stops or built-in
+  // players answering each other forever. A Reset, Step or Resume whose
+  // `process` calls exceed step_timeout_ms or max_process_calls (0 for no
+  // limit) ends the duel as truncated, and the duel is appended to
+  // watchdog_ when watchdog_path is set so that it can be replayed.
+  const int step_timeout_ms_;
+  const int max_process_calls_;
+  std::shared_ptr<ReplayWriter> watchdog_;
+  std::chrono::steady_clock::time_point step_deadline_;
+  int process_calls_ = 0;
+  bool truncated_ = false;
+
   byte query_buf_[4096];
   int qdp_ = 0;
 
@@ -1302,6 +1814,8 @@ protected:
   uint64_t reset_time_count_ = 0;
 
   const int n_history_actions_;
+  // sizes of the observation, see visit_obs_layout
+  const DynamicObsLayout layout_;
 
   // circular buffer for history actions of player 0
   TArray<uint8_t> history_actions_0_;
@@ -1316,26 +1830,51 @@ protected:
   std::vector<std::string> revealed_;
 
 public:
-  YGOProEnv(const Spec &spec, int env_id)
-      : Env<YGOProEnvSpec>(spec, env_id),
-        max_episode_steps_(spec.config["max_episode_steps"_]),
+  YGOProEnv(std::shared_ptr<const Spec> spec, int env_id)
+      : Env<YGOProEnvSpec>(std::move(spec), env_id),
+        deck1_(spec_.config["deck1"_]), deck2_(spec_.config["deck2"_]),
+        registry_name_(spec_.config["card_registry"_]),
+        play_modes_(parse_play_modes(spec_.config["play_mode"_])),
+        player_(spec_.config["player"_]), verbose_(spec_.config["verbose"_]),
+        max_episode_steps_(spec_.config["max_episode_steps"_]),
         elapsed_step_(max_episode_steps_ + 1), dist_int_(0, 0xffffffff),
-        deck1_(spec.config["deck1"_]), deck2_(spec.config["deck2"_]),
-        player_(spec.config["player"_]),
-        play_modes_(parse_play_modes(spec.config["play_mode"_])),
-        verbose_(spec.config["verbose"_]),
-        n_history_actions_(spec.config["n_history_actions"_]) {
-    int max_options = spec.config["max_options"_];
-    int n_action_feats = spec.state_spec["obs:actions_"_].shape[1];
+        option_paging_(spec_.config["option_paging"_]),
+        profile_messages_(spec_.config["profile_messages"_]),
+        step_timeout_ms_(spec_.config["step_timeout_ms"_]),
+        max_process_calls_(spec_.config["max_process_calls"_]),
+        n_history_actions_(spec_.config["n_history_actions"_]),
+        layout_(spec_.config) {
+    int max_options = spec_.config["max_options"_];
+    if (max_options > 255) {
+      // info:num_options is a uint8
+      throw std::invalid_argument("max_options must be at most 255");
+    }
+    int n_action_feats = spec_.state_spec["obs:actions_"_].shape[1];
     h_card_ids_0_.resize(max_options);
     h_card_ids_1_.resize(max_options);
     history_actions_0_ = TArray<uint8_t>(Array(
         ShapeSpec(sizeof(uint8_t), {n_history_actions_, n_action_feats})));
     history_actions_1_ = TArray<uint8_t>(Array(
         ShapeSpec(sizeof(uint8_t), {n_history_actions_, n_action_feats})));
+    const std::string &record_path = spec_.config["record_path"_];
+    const std::string &replay_path = spec_.config["replay_path"_];
+    if (!record_path.empty() && !replay_path.empty()) {
+      throw std::invalid_argument("Can't record and replay at the same time");
+    }
+    if (!record_path.empty()) {
+      recorder_ = open_replay_file<ReplayWriter>(record_path);
+    }
+    if (!replay_path.empty()) {
+      replayer_ = open_replay_file<ReplayReader>(replay_path);
+    }
+    const std::string &watchdog_path = spec_.config["watchdog_path"_];
+    if (!watchdog_path.empty()) {
+      watchdog_ = open_replay_file<ReplayWriter>(watchdog_path);
+    }
   }
 
   ~YGOProEnv() {
+    flush_msg_stats();
     for (int i = 0; i < 2; i++) {
       if (players_[i] != nullptr) {
         delete players_[i];
@@ -1358,28 +1897,126 @@ public:
 
   void Reset() override {
     // clock_t start = clock();
-    if (random_mode()) {
-      play_mode_ = play_modes_[dist_int_(gen_) % play_modes_.size()];
+    registry_ = load_registry(registry_name_);
+    RegistryScope scope(registry_.get());
+    arm_watchdog();
+    flush_msg_stats();
+    if (replayer_ != nullptr) {
+      replayer_->next(record_);
+      replay_pos_ = 0;
+      play_mode_ = PlayMode(record_.play_mode);
+      ai_player_ = record_.ai_player;
     } else {
-      play_mode_ = play_modes_[0];
-    }
-
-    if (play_mode_ != kSelfPlay) {
-      if (player_ == -1) {
-        ai_player_ = dist_int_(gen_) % 2;
+      if (random_mode()) {
+        play_mode_ = play_modes_[dist_int_(gen_) % play_modes_.size()];
       } else {
-        ai_player_ = player_;
+        play_mode_ = play_modes_[0];
       }
-    }
 
-    turn_count_ = 0;
+      if (play_mode_ != kSelfPlay) {
+        if (player_ == -1) {
+          ai_player_ = dist_int_(gen_) % 2;
+        } else {
+          ai_player_ = player_;
+        }
+      }
+    }
 
     history_actions_0_.Zero();
     history_actions_1_.Zero();
     ha_p_0_ = 0;
     ha_p_1_ = 0;
 
-    unsigned long duel_seed = dist_int_(gen_);
+    unsigned long duel_seed =
+        replayer_ != nullptr ? record_.seed : dist_int_(gen_);
+    // the seed is kept for the watchdog even without tracing
+    record_.seed = duel_seed;
+    if (tracing()) {
+      record_.play_mode = play_mode_;
+      record_.ai_player = ai_player_;
+      record_.actions.clear();
+    }
+
+    new_duel(duel_seed);
+
+    if (!next()) {
+      resuming_reset_ = true;
+      return;
+    }
+    finish_reset();
+
+    // double seconds = static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+    // // update reset_time by moving average
+    // reset_time_ = reset_time_* (static_cast<double>(reset_time_count_) /
+    // (reset_time_count_ + 1)) + seconds / (reset_time_count_ + 1);
+    // reset_time_count_++;
+    // if (reset_time_count_ % 20 == 0) {
+    //   printf("Reset time: %.3f\n", reset_time_);
+    // }
+  }
+
+  void finish_reset() {
+    // a reset cut short by the watchdog ends the episode right away
+    done_ = truncated_;
+    elapsed_step_ = 0;
+    WriteState(0.0);
+  }
+
+  // Continues a Reset or Step suspended on a blocking player once it has
+  // answered.
+  void Resume() override {
+    RegistryScope scope(registry_.get());
+    arm_watchdog();
+    apply_decision(opponent_idx_);
+    Stop stop = handle_messages();
+    if (stop == Stop::kWaiting || (stop == Stop::kDrained && !next())) {
+      return;
+    }
+    if (resuming_reset_) {
+      finish_reset();
+    } else {
+      finish_step();
+    }
+  }
+
+  // Plays a duel between two built-in players ("greedy" or "random") with the
+  // cards of `registry` to the end without writing any state, returns the
+  // winner.
+  PlayerId play_arena_duel(std::shared_ptr<const CardRegistry> registry,
+                           const std::string &deck0, const std::string &deck1,
+                           const std::string &player0,
+                           const std::string &player1, uint64_t seed) {
+    arena_ = true;
+    registry_ = std::move(registry);
+    RegistryScope scope(registry_.get());
+    deck1_ = deck0;
+    deck2_ = deck1;
+    gen_.seed(seed);
+    play_mode_ = kGreedyBot;
+    new_duel(dist_int_(gen_));
+    for (PlayerId i = 0; i < 2; i++) {
+      const auto &type = i == 0 ? player0 : player1;
+      std::string nickname = i == 0 ? "Alice" : "Bob";
+      Player *player;
+      if (type == "greedy") {
+        player = new GreedyAI(nickname, lp_[i], i, verbose_);
+      } else if (type == "random") {
+        player = new RandomAI(max_options(), dist_int_(gen_), nickname, lp_[i],
+                              i, verbose_);
+      } else {
+        throw std::invalid_argument("Unknown arena player: " + type);
+      }
+      delete players_[i];
+      players_[i] = player;
+    }
+    next();
+    return winner_;
+  }
+
+  int turn_count() const { return turn_count_; }
+
+  void new_duel(unsigned long duel_seed) {
+    turn_count_ = 0;
 
     std::unique_lock<std::shared_timed_mutex> ulock(duel_mtx);
     pduel_ = create_duel(duel_seed);
@@ -1400,7 +2037,17 @@ public:
         players_[i] = new GreedyAI(nickname, init_lp, i, verbose_);
       }
       set_player_info(pduel_, i, init_lp, 5, 1);
-      load_deck(i);
+      if (replayer_ != nullptr) {
+        (i == 0 ? main_deck0_ : main_deck1_) = record_.main_decks[i];
+        (i == 0 ? extra_deck0_ : extra_deck1_) = record_.extra_decks[i];
+        new_deck_cards(i);
+      } else {
+        load_deck(i);
+      }
+      if (tracing()) {
+        record_.main_decks[i] = i == 0 ? main_deck0_ : main_deck1_;
+        record_.extra_decks[i] = i == 0 ? extra_deck0_ : extra_deck1_;
+      }
       lp_[i] = players_[i]->init_lp_;
     }
 
@@ -1412,23 +2059,75 @@ public:
     int32_t options = ((rules & 0xFF) << 16) + (0 & 0xFFFF);
     start_duel(pduel_, options);
     duel_started_ = true;
+    truncated_ = false;
     winner_ = 255;
     win_reason_ = 255;
+  }
 
-    next();
+  // the duel is kept in record_ for the recorder or the watchdog
+  bool tracing() const { return recorder_ != nullptr || watchdog_ != nullptr; }
 
-    done_ = false;
-    elapsed_step_ = 0;
-    WriteState(0.0);
+  void arm_watchdog() {
+    process_calls_ = 0;
+    if (step_timeout_ms_ > 0) {
+      step_deadline_ = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(step_timeout_ms_);
+    }
+  }
 
-    // double seconds = static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
-    // // update reset_time by moving average
-    // reset_time_ = reset_time_* (static_cast<double>(reset_time_count_) /
-    // (reset_time_count_ + 1)) + seconds / (reset_time_count_ + 1);
-    // reset_time_count_++;
-    // if (reset_time_count_ % 20 == 0) {
-    //   printf("Reset time: %.3f\n", reset_time_);
-    // }
+  bool watchdog_expired() {
+    if (arena_) {
+      return false;
+    }
+    ++process_calls_;
+    if (max_process_calls_ > 0 && process_calls_ > max_process_calls_) {
+      return true;
+    }
+    return step_timeout_ms_ > 0 &&
+           std::chrono::steady_clock::now() > step_deadline_;
+  }
+
+  // Ends the current duel without a winner, see step_timeout_ms_.
+  void truncate_duel() {
+    truncated_ = true;
+    _duel_end(255, 255);
+    if (watchdog_ != nullptr) {
+      record_.winner = winner_;
+      record_.win_reason = win_reason_;
+      watchdog_->write(record_);
+    } else {
+      LOG(WARNING) << "Duel of env " << env_id_ << " with seed "
+                   << record_.seed << " truncated after " << process_calls_
+                   << " process calls";
+    }
+  }
+
+  // the next action of the replayed duel, `agent` tells whether it is expected
+  // to be taken through Step
+  int next_recorded_action(bool agent) {
+    if (replay_pos_ >= record_.actions.size()) {
+      throw std::runtime_error("Replay diverged from the recorded duel");
+    }
+    uint16_t action = record_.actions[replay_pos_++];
+    if (bool(action & DuelRecord::kAgentAction) != agent) {
+      throw std::runtime_error("Replay diverged from the recorded duel");
+    }
+    return action & ~DuelRecord::kAgentAction;
+  }
+
+  void flush_msg_stats() {
+    if (!profile_messages_) {
+      return;
+    }
+    for (int i = 0; i < 256; ++i) {
+      if (msg_count_[i] == 0) {
+        continue;
+      }
+      msg_counts_[i] += msg_count_[i];
+      msg_times_ns_[i] += msg_time_ns_[i];
+      msg_count_[i] = 0;
+      msg_time_ns_[i] = 0;
+    }
   }
 
   void update_h_card_ids(PlayerId player, int idx) {
@@ -1446,15 +2145,33 @@ public:
     if (ha_p < 0) {
       ha_p = n_history_actions_ - 1;
     }
-    _set_obs_action(history_actions, ha_p, msg_, options_[idx], {}, h_card_ids[idx]);
+    visit_obs_layout(layout_, [&](const auto &layout) {
+      using Layout = std::decay_t<decltype(layout)>;
+      _set_obs_action(typename Layout::ActionView(history_actions), ha_p, msg_,
+                      options_[page_begin_ + idx], {}, h_card_ids[idx]);
+    });
   }
 
   void Step(const Action &action) override {
     // clock_t start = clock();
+    RegistryScope scope(registry_.get());
+    arm_watchdog();
 
-    int idx = action["action"_];
-    callback_(idx);
+    int idx = replayer_ != nullptr ? next_recorded_action(true)
+                                   : int(action["action"_]);
+    if (tracing()) {
+      record_.actions.push_back(idx | DuelRecord::kAgentAction);
+    }
+    if (has_next_page_ && (idx == page_options_)) {
+      // show the next page of options, the duel does not advance
+      int n_pages = (options_.size() + page_size_ - 1) / page_size_;
+      option_page_ = (option_page_ + 1) % n_pages;
+      WriteState(0.0);
+      return;
+    }
     update_history_actions(to_play_, idx);
+    idx += page_begin_;
+    respond(idx);
 
     PlayerId player = to_play_;
 
@@ -1462,11 +2179,26 @@ public:
       show_decision(idx);
     }
 
-    next();
+    if (!next()) {
+      resuming_reset_ = false;
+      return;
+    }
+    finish_step();
+
+    // double seconds = static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+    // // update step_time by moving average
+    // step_time_ = step_time_* (static_cast<double>(step_time_count_) /
+    // (step_time_count_ + 1)) + seconds / (step_time_count_ + 1);
+    // step_time_count_++;
+    // if (step_time_count_ % 500 == 0) {
+    //   printf("Step time: %.3f\n", step_time_);
+    // }
+  }
 
+  void finish_step() {
     float reward = 0;
     int reason = 0;
-    if (done_) {
+    if (done_ && !truncated_) {
       float base_reward = 1.0;
       int win_turn = turn_count_ - winner_;
       if (win_turn <= 5) {
@@ -1488,36 +2220,35 @@ public:
       } else if (win_reason_ == 0x02) {
         reason = -1;
       }
+
+      if (recorder_ != nullptr) {
+        record_.winner = winner_;
+        record_.win_reason = win_reason_;
+        recorder_->write(record_);
+      }
     }
 
     WriteState(reward, win_reason_);
-
-    // double seconds = static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
-    // // update step_time by moving average
-    // step_time_ = step_time_* (static_cast<double>(step_time_count_) /
-    // (step_time_count_ + 1)) + seconds / (step_time_count_ + 1);
-    // step_time_count_++;
-    // if (step_time_count_ % 500 == 0) {
-    //   printf("Step time: %.3f\n", step_time_);
-    // }
   }
 
 private:
   using SpecIndex = ankerl::unordered_dense::map<std::string, uint16_t>;
 
-  void _set_obs_cards(TArray<uint8_t> &f_cards,
+  template <typename Layout>
+  void _set_obs_cards(const Layout &layout,
+                      const FeatView<kCardFeats> &f_cards,
                       SpecIndex &spec2index, PlayerId to_play) {
+    static constexpr std::array<std::pair<uint8_t, bool>, 7> configs = {{
+        {LOCATION_DECK, true},   {LOCATION_HAND, true},
+        {LOCATION_MZONE, false}, {LOCATION_SZONE, false},
+        {LOCATION_GRAVE, false}, {LOCATION_REMOVED, false},
+        {LOCATION_EXTRA, true},
+    }};
     for (auto pi = 0; pi < 2; pi++) {
       const PlayerId player = (to_play + pi) % 2;
       const bool opponent = pi == 1;
-      int offset = opponent ? spec_.config["max_cards"_] : 0;
-      std::vector<std::pair<uint8_t, bool>> configs = {
-          {LOCATION_DECK, true},   {LOCATION_HAND, true},
-          {LOCATION_MZONE, false}, {LOCATION_SZONE, false},
-          {LOCATION_GRAVE, false}, {LOCATION_REMOVED, false},
-          {LOCATION_EXTRA, true},
-      };
-      for (auto &[location, hidden_for_opponent] : configs) {
+      int offset = opponent ? layout.max_cards() : 0;
+      for (auto [location, hidden_for_opponent] : configs) {
         // check this
         if (opponent && (location == LOCATION_HAND) &&
             (revealed_.size() != 0)) {
@@ -1553,7 +2284,8 @@ private:
     }
   }
 
-  void _set_obs_card_(TArray<uint8_t> &f_cards, int offset, const Card &c, bool hide) {
+  void _set_obs_card_(const FeatView<kCardFeats> &f_cards, int offset,
+                      const Card &c, bool hide) {
     uint8_t location = c.location_;
     bool overlay = location & LOCATION_OVERLAY;
     if (overlay) {
@@ -1619,7 +2351,8 @@ private:
     feat(6) = (me == tp_) ? 1 : 0;
   }
 
-  void _set_obs_action_spec(TArray<uint8_t> &feat, int i, int j,
+  template <typename Feat>
+  void _set_obs_action_spec(const Feat &feat, int i, int j,
                             const std::string &spec, const SpecIndex &spec2index,
                             const std::vector<CardId> &card_ids) {
     uint16_t idx = spec2index.empty() ? card_ids[j] : spec2index.at(spec);
@@ -1627,51 +2360,58 @@ private:
     feat(i, 2*j + 1) = static_cast<uint8_t>(idx & 0xff);
   }
 
-  int _obs_action_feat_offset() const {
-    return spec_.config["max_multi_select"_] * 2;
-  }
-
-  void _set_obs_action_msg(TArray<uint8_t> &feat, int i, int msg) {
-    feat(i, _obs_action_feat_offset()) = msg2id.at(msg);
+  template <typename Feat>
+  void _set_obs_action_msg(const Feat &feat, int i, int msg) {
+    feat(i, feat.action_offset()) = msg2id.at(msg);
   }
 
-  void _set_obs_action_act(TArray<uint8_t> &feat, int i, char act,
+  template <typename Feat>
+  void _set_obs_action_act(const Feat &feat, int i, char act,
                            uint8_t act_offset = 0) {
-    feat(i, _obs_action_feat_offset() + 1) = cmd_act2id.at(act) + act_offset;
+    feat(i, feat.action_offset() + 1) = cmd_act2id.at(act) + act_offset;
   }
 
-  void _set_obs_action_yesno(TArray<uint8_t> &feat, int i, char yesno) {
-    feat(i, _obs_action_feat_offset() + 2) = cmd_yesno2id.at(yesno);
+  template <typename Feat>
+  void _set_obs_action_yesno(const Feat &feat, int i, char yesno) {
+    feat(i, feat.action_offset() + 2) = cmd_yesno2id.at(yesno);
   }
 
-  void _set_obs_action_phase(TArray<uint8_t> &feat, int i, char phase) {
-    feat(i, _obs_action_feat_offset() + 3) = cmd_phase2id.at(phase);
+  template <typename Feat>
+  void _set_obs_action_phase(const Feat &feat, int i, char phase) {
+    feat(i, feat.action_offset() + 3) = cmd_phase2id.at(phase);
   }
 
-  void _set_obs_action_cancel_finish(TArray<uint8_t> &feat, int i, char c) {
-    uint8_t v = c == 'c' ? 1 : (c == 'f' ? 2 : 0);
-    feat(i, _obs_action_feat_offset() + 4) = v;
+  // 'c' for cancel, 'f' for finish and 'p' for the next page of options
+  template <typename Feat>
+  void _set_obs_action_cancel_finish(const Feat &feat, int i, char c) {
+    uint8_t v = c == 'c' ? 1 : (c == 'f' ? 2 : (c == 'p' ? 3 : 0));
+    feat(i, feat.action_offset() + 4) = v;
   }
 
-  void _set_obs_action_position(TArray<uint8_t> &feat, int i, char position) {
+  template <typename Feat>
+  void _set_obs_action_position(const Feat &feat, int i, char position) {
     position = 1 << (position - '1');
-    feat(i, _obs_action_feat_offset() + 5) = position2id.at(position);
+    feat(i, feat.action_offset() + 5) = position2id.at(position);
   }
 
-  void _set_obs_action_option(TArray<uint8_t> &feat, int i, char option) {
-    feat(i, _obs_action_feat_offset() + 6) = option - '0';
+  template <typename Feat>
+  void _set_obs_action_option(const Feat &feat, int i, char option) {
+    feat(i, feat.action_offset() + 6) = option - '0';
   }
 
-  void _set_obs_action_place(TArray<uint8_t> &feat, int i,
+  template <typename Feat>
+  void _set_obs_action_place(const Feat &feat, int i,
                              const std::string &spec) {
-    feat(i, _obs_action_feat_offset() + 7) = cmd_place2id.at(spec);
+    feat(i, feat.action_offset() + 7) = cmd_place2id.at(spec);
   }
 
-  void _set_obs_action_attrib(TArray<uint8_t> &feat, int i, uint8_t attrib) {
-    feat(i, _obs_action_feat_offset() + 8) = attribute2id.at(attrib);
+  template <typename Feat>
+  void _set_obs_action_attrib(const Feat &feat, int i, uint8_t attrib) {
+    feat(i, feat.action_offset() + 8) = attribute2id.at(attrib);
   }
 
-  void _set_obs_action(TArray<uint8_t> &feat, int i, int msg,
+  template <typename Feat>
+  void _set_obs_action(const Feat &feat, int i, int msg,
                        const std::string &option, const SpecIndex &spec2index,
                        const std::vector<CardId> &card_ids) {
     _set_obs_action_msg(feat, i, msg);
@@ -1771,7 +2511,7 @@ private:
       offset++;
     }
     auto [loc, seq, pos] = spec_to_ls(spec.substr(offset));
-    return card_ids_.at(get_card_code(player, loc, seq));
+    return c_get_card_id(get_card_code(player, loc, seq));
   }
 
   std::vector<CardId> parse_card_ids(const std::string &option,
@@ -1818,36 +2558,78 @@ private:
     return card_ids;
   }
 
-  void _set_obs_actions(TArray<uint8_t> &feat, const SpecIndex &spec2index,
-                        int msg, const std::vector<std::string> &options) {
-    for (int i = 0; i < options.size(); ++i) {
-      _set_obs_action(feat, i, msg, options[i], spec2index, {});
+  template <typename Feat>
+  void _set_obs_actions(const Feat &feat, const SpecIndex &spec2index,
+                        int msg, const std::vector<std::string> &options,
+                        int begin, int n) {
+    for (int i = 0; i < n; ++i) {
+      _set_obs_action(feat, i, msg, options[begin + i], spec2index, {});
     }
   }
 
+  // bit i of mask (little-endian within each byte) is set for legal action i
+  void _set_obs_mask(TArray<PackedBits> &mask, int n_options) {
+    mask.SetFirstBits(n_options);
+  }
+
   void WriteState(float reward, int win_reason = 0) {
-    State state = Allocate();
+    // partition the batch by seat when num_partitions == 2
+    State state = Allocate(1, to_play_);
 
     int n_options = options_.size();
     state["reward"_] = reward;
-    state["info:to_play"_] = int(to_play_);
-    state["info:is_selfplay"_] = int(play_mode_ == kSelfPlay);
+    state["info:to_play"_] = to_play_;
+    if ((replayer_ != nullptr) && (replay_pos_ < record_.actions.size()) &&
+        (record_.actions[replay_pos_] & DuelRecord::kAgentAction)) {
+      state["info:recorded_action"_] =
+          record_.actions[replay_pos_] & ~DuelRecord::kAgentAction;
+    } else {
+      state["info:recorded_action"_] = -1;
+    }
+    state["info:is_selfplay"_] = play_mode_ == kSelfPlay;
     state["info:win_reason"_] = win_reason;
+    if (truncated_) {
+      state["trunc"_] = true;
+    }
 
     if (n_options == 0) {
       state["info:num_options"_] = 1;
+      _set_obs_mask(state["obs:mask_"_], 1);
       state["obs:global_"_][7] = uint8_t(1);
       return;
     }
 
+    visit_obs_layout(layout_, [&](const auto &layout) {
+      _write_obs(state, layout, n_options);
+    });
+  }
+
+  template <typename Layout>
+  void _write_obs(State &state, const Layout &layout, int n_options) {
+    FeatView<kCardFeats> cards(state["obs:cards_"_]);
+    typename Layout::ActionView actions(state["obs:actions_"_]);
     SpecIndex spec2index;
-    _set_obs_cards(state["obs:cards_"_], spec2index, to_play_);
+    _set_obs_cards(layout, cards, spec2index, to_play_);
 
     _set_obs_global(state["obs:global_"_], to_play_);
 
-    // we can't shuffle because idx must be stable in callback
-    if (n_options > max_options()) {
-      options_.resize(max_options());
+    int truncated = 0;
+    page_begin_ = 0;
+    has_next_page_ = false;
+    int max_options = layout.max_options();
+    if (n_options > max_options) {
+      if (option_paging_) {
+        page_size_ = max_options - 1;
+        page_begin_ = option_page_ * page_size_;
+        n_options = std::min(page_size_, n_options - page_begin_);
+        page_options_ = n_options;
+        has_next_page_ = true;
+      } else {
+        // we can't shuffle because idx must be stable in responses_
+        truncated = n_options - max_options;
+        options_.resize(max_options);
+        n_options = max_options;
+      }
     }
 
     // print spec2index
@@ -1855,24 +2637,31 @@ private:
     //   printf("%s %d\n", key.c_str(), val);
     // }
 
-    _set_obs_actions(state["obs:actions_"_], spec2index, msg_, options_);
+    _set_obs_actions(actions, spec2index, msg_, options_, page_begin_,
+                     n_options);
+    if (has_next_page_) {
+      _set_obs_action_msg(actions, n_options, msg_);
+      _set_obs_action_cancel_finish(actions, n_options, 'p');
+      n_options++;
+    }
 
-    n_options = options_.size();
     state["info:num_options"_] = n_options;
+    state["info:truncated_options"_] = truncated;
+    _set_obs_mask(state["obs:mask_"_], n_options);
 
     // update h_card_ids from state
     auto &h_card_ids = to_play_ == 0 ? h_card_ids_0_ : h_card_ids_1_;
 
     for (int i = 0; i < n_options; ++i) {
       std::vector<CardId> card_ids;
-      for (int j = 0; j < spec_.config["max_multi_select"_]; ++j) {
-        uint8_t spec_index = state["obs:actions_"_](i, 2*j+1);
+      for (int j = 0; j < layout.max_multi_select(); ++j) {
+        uint8_t spec_index = actions(i, 2*j+1);
         if (spec_index == 0) {
           break;
         }
         // because of na_card_embed, we need to subtract 1
-        uint16_t card_id1 = static_cast<uint16_t>(state["obs:cards_"_](spec_index - 1, 0));
-        uint16_t card_id2 = static_cast<uint16_t>(state["obs:cards_"_](spec_index - 1, 1));
+        uint16_t card_id1 = cards(spec_index - 1, 0);
+        uint16_t card_id2 = cards(spec_index - 1, 1);
         card_ids.push_back((card_id1 << 8) + card_id2);
       }
       h_card_ids[i] = card_ids;
@@ -1883,13 +2672,52 @@ private:
     const auto &ha_p = to_play_ == 0 ? ha_p_0_ : ha_p_1_;
     const auto &history_actions =
         to_play_ == 0 ? history_actions_0_ : history_actions_1_;
-    int n1 = n_history_actions_ - ha_p;
-    int n_action_feats = state["obs:actions_"_].Shape()[1];
+    typename Layout::ActionView history(history_actions);
+    int n1 = layout.n_history_actions() - ha_p;
+    int n_action_feats = actions.cols();
 
-    state["obs:h_actions_"_].Assign(
-      (uint8_t *)history_actions[ha_p].Data(), n_action_feats * n1);
-    state["obs:h_actions_"_][n1].Assign(
-      (uint8_t *)history_actions.Data(), n_action_feats * ha_p);
+    state["obs:h_actions_"_].Assign(history.row(ha_p), n_action_feats * n1);
+    state["obs:h_actions_"_][n1].Assign(history.row(0),
+                                        n_action_feats * ha_p);
+  }
+
+  void add_response(int32_t resp) { responses_.push_back({true, resp, 0}); }
+
+  void add_response(std::initializer_list<uint8_t> resp) {
+    responses_.push_back(
+        {false, int32_t(resp_bytes_.size()), uint8_t(resp.size())});
+    resp_bytes_.insert(resp_bytes_.end(), resp);
+  }
+
+  // response of selecting the cards in `comb`, after `n_skip` cards that
+  // must be selected
+  void add_response(const std::vector<int> &comb, int n_skip = 0) {
+    int size = n_skip + comb.size();
+    responses_.push_back(
+        {false, int32_t(resp_bytes_.size()), uint8_t(size + 1)});
+    resp_bytes_.push_back(size);
+    resp_bytes_.insert(resp_bytes_.end(), n_skip, 0);
+    resp_bytes_.insert(resp_bytes_.end(), comb.begin(), comb.end());
+  }
+
+  void respond(int idx) {
+    if (idx < 0 || idx >= responses_.size()) {
+      throw std::runtime_error("Invalid option " + std::to_string(idx) +
+                               " for " + msg_to_string(msg_));
+    }
+    if (verbose_ && (msg_ == MSG_SELECT_OPTION)) {
+      players_[to_play_]->notify("You selected option " + options_[idx] + ".");
+      players_[1 - to_play_]->notify(players_[to_play_]->nickname_ +
+                                     " selected option " + options_[idx] +
+                                     ".");
+    }
+    const auto &resp = responses_[idx];
+    if (resp.is_int) {
+      set_responsei(pduel_, resp.value);
+      return;
+    }
+    std::memcpy(resp_buf_, resp_bytes_.data() + resp.value, resp.size);
+    set_responseb(pduel_, resp_buf_);
   }
 
   void show_decision(int idx) {
@@ -1911,17 +2739,25 @@ private:
 
     if (deck == "random") {
       // generate random deck name
-      std::uniform_int_distribution<uint64_t> dist_int(0, deck_names_.size() - 1);
-      deck = deck_names_[dist_int(gen_)];
+      const auto &deck_names = registry_->deck_names;
+      std::uniform_int_distribution<uint64_t> dist_int(0, deck_names.size() - 1);
+      deck = deck_names[dist_int(gen_)];
     }
 
-    main_deck = main_decks_.at(deck);
-    extra_deck = extra_decks_.at(deck);
+    main_deck = registry_->main_decks.at(deck);
+    extra_deck = registry_->extra_decks.at(deck);
 
     if (shuffle) {
       std::shuffle(main_deck.begin(), main_deck.end(), gen_);
     }
 
+    new_deck_cards(player);
+  }
+
+  void new_deck_cards(PlayerId player) {
+    const auto &main_deck = player == 0 ? main_deck0_ : main_deck1_;
+    const auto &extra_deck = player == 0 ? extra_deck0_ : extra_deck1_;
+
     // add main deck in reverse order following ygopro
     // but since we have shuffled deck, so just add in order
     for (int i = 0; i < main_deck.size(); i++) {
@@ -1936,11 +2772,18 @@ private:
     }
   }
 
-  void next() {
+  // Runs the duel until the agent has to decide or the duel is over. Returns
+  // false if it stopped at a decision of a blocking player instead, and the
+  // env is suspended until Resume.
+  bool next() {
     while (duel_started_) {
       if (eng_flag_ == PROCESSOR_END) {
         break;
       }
+      if (watchdog_expired()) {
+        truncate_duel();
+        break;
+      }
       uint32_t res = process(pduel_);
       dl_ = res & PROCESSOR_BUFFER_LEN;
       eng_flag_ = res & PROCESSOR_FLAG;
@@ -1950,33 +2793,58 @@ private:
       }
       get_message(pduel_, data_);
       dp_ = 0;
-      while (dp_ != dl_) {
-        handle_message();
-        if (options_.empty()) {
-          continue;
-        }
-        if ((play_mode_ == kSelfPlay) || (to_play_ == ai_player_)) {
-          if (options_.size() == 1) {
-            callback_(0);
-            update_h_card_ids(to_play_, 0);
-            update_history_actions(to_play_, 0);
-            if (verbose_) {
-              show_decision(0);
-            }
-          } else {
-            return;
-          }
-        } else {
-          auto idx = players_[to_play_]->think(options_);
-          callback_(idx);
-          if (verbose_) {
-            show_decision(idx);
-          }
-        }
+      Stop stop = handle_messages();
+      if (stop != Stop::kDrained) {
+        return stop == Stop::kAgent;
       }
     }
     done_ = true;
     options_.clear();
+    return true;
+  }
+
+  Stop handle_messages() {
+    while (dp_ != dl_) {
+      handle_message();
+      if (options_.empty()) {
+        continue;
+      }
+      if (!arena_ && ((play_mode_ == kSelfPlay) || (to_play_ == ai_player_))) {
+        if (options_.size() == 1) {
+          respond(0);
+          update_h_card_ids(to_play_, 0);
+          update_history_actions(to_play_, 0);
+          if (verbose_) {
+            show_decision(0);
+          }
+        } else {
+          return Stop::kAgent;
+        }
+      } else if (replayer_ == nullptr && players_[to_play_]->blocking() &&
+                 CanSuspend()) {
+        Suspend();
+        players_[to_play_]->think_async(options_, [this](int idx) {
+          opponent_idx_ = idx;
+          Wake();
+        });
+        return Stop::kWaiting;
+      } else {
+        apply_decision(replayer_ != nullptr
+                           ? next_recorded_action(false)
+                           : players_[to_play_]->think(options_));
+      }
+    }
+    return Stop::kDrained;
+  }
+
+  void apply_decision(int idx) {
+    if (tracing()) {
+      record_.actions.push_back(idx);
+    }
+    respond(idx);
+    if (verbose_) {
+      show_decision(idx);
+    }
   }
 
   uint8_t read_u8() { return data_[dp_++]; }
@@ -2194,1706 +3062,1691 @@ private:
 
   void handle_message() {
     msg_ = int(data_[dp_++]);
-    options_ = {};
+    options_.clear();
+    option_page_ = 0;
+    page_begin_ = 0;
+    has_next_page_ = false;
+    responses_.clear();
+    resp_bytes_.clear();
 
     if (verbose_) {
       printf("Message %s, length %d, dp %d\n", msg_to_string(msg_).c_str(), dl_,
              dp_);
     }
 
-    if (msg_ == MSG_DRAW) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto player = read_u8();
-      auto drawed = read_u8();
-      std::vector<uint32> codes;
-      for (int i = 0; i < drawed; ++i) {
-        uint32 code = read_u32();
-        codes.push_back(code & 0x7fffffff);
-      }
-      const auto &pl = players_[player];
-      pl->notify("Drew " + std::to_string(drawed) + " cards:");
-      for (int i = 0; i < drawed; ++i) {
-        const auto &c = c_get_card(codes[i]);
-        pl->notify(std::to_string(i + 1) + ": " + c.name_);
-      }
-      const auto &op = players_[1 - player];
-      op->notify("Opponent drew " + std::to_string(drawed) + " cards.");
-    } else if (msg_ == MSG_NEW_TURN) {
-      tp_ = int(read_u8());
-      turn_count_++;
-      if (!verbose_) {
-        return;
-      }
-      auto player = players_[tp_];
-      player->notify("Your turn.");
-      players_[1 - tp_]->notify(player->nickname() + "'s turn.");
-    } else if (msg_ == MSG_NEW_PHASE) {
-      current_phase_ = int(read_u16());
-      if (!verbose_) {
-        return;
-      }
-      auto phase_str = phase_to_string(current_phase_);
-      for (int i = 0; i < 2; ++i) {
-        players_[i]->notify("entering " + phase_str + ".");
-      }
-    } else if (msg_ == MSG_MOVE) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      CardCode code = read_u32();
-      uint32_t location = read_u32();
-      uint32_t newloc = read_u32();
-      uint32_t reason = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(location);
-      Card cnew = c_get_card(code);
-      cnew.set_location(newloc);
-      auto pl = players_[card.controler_];
-      auto op = players_[1 - card.controler_];
-
-      auto plspec = card.get_spec(false);
-      auto opspec = card.get_spec(true);
-      auto plnewspec = cnew.get_spec(false);
-      auto opnewspec = cnew.get_spec(true);
-
-      auto getspec = [&](Player *p) { return p == pl ? plspec : opspec; };
-      auto getnewspec = [&](Player *p) {
-        return p == pl ? plnewspec : opnewspec;
+    const auto &entry = msg_handlers()[msg_];
+    auto handler = verbose_ ? entry.verbose : entry.fast;
+    if (handler == nullptr) {
+      auto err_msg = "Unknown message " + msg_to_string(msg_) + ", length " +
+                     std::to_string(dl_) + ", dp " + std::to_string(dp_);
+      throw std::runtime_error(err_msg);
+    }
+    if (!profile_messages_) {
+      (this->*handler)();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    (this->*handler)();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    msg_count_[msg_]++;
+    msg_time_ns_[msg_] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  }
+
+  // Fast path of the messages that only matter for verbose output, skip the
+  // payload without parsing it.
+  void skip_message() {
+    int length = msg_handlers()[msg_].length;
+    dp_ = length < 0 ? dl_ : dp_ + length;
+  }
+
+  using Handler = void (YGOProEnv::*)();
+
+  struct MsgHandler {
+    // used when verbose is off, only does the necessary state updates
+    Handler fast = nullptr;
+    // used when verbose is on, also notifies the players
+    Handler verbose = nullptr;
+    // fixed payload length, -1 if variable (skip to the end of the buffer)
+    int length = -1;
+  };
+
+  // dispatch table indexed by message id, unknown messages have no handler
+  static const std::array<MsgHandler, 256> &msg_handlers() {
+    static const std::array<MsgHandler, 256> handlers = [] {
+      std::array<MsgHandler, 256> h{};
+      // messages that update the env state or ask for a decision
+      auto always = [&](int msg, Handler fn) { h[msg] = {fn, fn}; };
+      // messages that are only parsed for verbose output
+      auto verbose_only = [&](int msg, Handler fn, int length) {
+        h[msg] = {&YGOProEnv::skip_message, fn, length};
       };
-      bool card_visible = true;
-      if ((card.position_ & POS_FACEDOWN) && (cnew.position_ & POS_FACEDOWN)) {
-        card_visible = false;
-      }
-      auto getvisiblename = [&](Player *p) {
-        return card_visible ? card.name_ : "Face-down card";
+      // messages that are never parsed
+      auto ignore = [&](int msg, int length) {
+        h[msg] = {&YGOProEnv::skip_message, &YGOProEnv::skip_message, length};
       };
+      verbose_only(MSG_DRAW, &YGOProEnv::handle_draw, -1);
+      always(MSG_NEW_TURN, &YGOProEnv::handle_new_turn);
+      always(MSG_NEW_PHASE, &YGOProEnv::handle_new_phase);
+      verbose_only(MSG_MOVE, &YGOProEnv::handle_move, 16);
+      verbose_only(MSG_SWAP, &YGOProEnv::handle_swap, 16);
+      verbose_only(MSG_SET, &YGOProEnv::handle_set, 8);
+      verbose_only(MSG_EQUIP, &YGOProEnv::handle_equip, 8);
+      verbose_only(MSG_HINT, &YGOProEnv::handle_hint, 6);
+      verbose_only(MSG_CARD_HINT, &YGOProEnv::handle_card_hint, 9);
+      verbose_only(MSG_POS_CHANGE, &YGOProEnv::handle_pos_change, 9);
+      verbose_only(MSG_BECOME_TARGET, &YGOProEnv::handle_become_target, -1);
+      verbose_only(MSG_CONFIRM_DECKTOP, &YGOProEnv::handle_confirm_decktop, -1);
+      always(MSG_CONFIRM_CARDS, &YGOProEnv::handle_confirm_cards);
+      verbose_only(MSG_MISSED_EFFECT, &YGOProEnv::handle_missed_effect, 8);
+      always(MSG_SORT_CARD, &YGOProEnv::handle_sort_card);
+      verbose_only(MSG_SHUFFLE_SET_CARD,
+                   &YGOProEnv::handle_shuffle_set_card, -1);
+      verbose_only(MSG_SHUFFLE_DECK, &YGOProEnv::handle_shuffle_deck, 1);
+      verbose_only(MSG_SHUFFLE_HAND, &YGOProEnv::handle_shuffle_hand, -1);
+      ignore(MSG_SUMMONED, 0);
+      verbose_only(MSG_SUMMONING, &YGOProEnv::handle_summoning, 8);
+      ignore(MSG_SPSUMMONED, 0);
+      ignore(MSG_FLIPSUMMONED, 0);
+      verbose_only(MSG_FLIPSUMMONING, &YGOProEnv::handle_flipsummoning, 8);
+      verbose_only(MSG_SPSUMMONING, &YGOProEnv::handle_spsummoning, 8);
+      ignore(MSG_CHAIN_NEGATED, 1);
+      ignore(MSG_CHAIN_DISABLED, 1);
+      always(MSG_CHAIN_SOLVED, &YGOProEnv::handle_chain_solved);
+      ignore(MSG_CHAIN_SOLVING, 1);
+      ignore(MSG_CHAINED, 1);
+      ignore(MSG_CHAIN_END, 0);
+      verbose_only(MSG_CHAINING, &YGOProEnv::handle_chaining, 16);
+      always(MSG_DAMAGE, &YGOProEnv::handle_damage);
+      always(MSG_RECOVER, &YGOProEnv::handle_recover);
+      always(MSG_LPUPDATE, &YGOProEnv::handle_lpupdate);
+      always(MSG_PAY_LPCOST, &YGOProEnv::handle_pay_lpcost);
+      verbose_only(MSG_ATTACK, &YGOProEnv::handle_attack, 8);
+      verbose_only(MSG_DAMAGE_STEP_START,
+                   &YGOProEnv::handle_damage_step_start, 0);
+      verbose_only(MSG_DAMAGE_STEP_END, &YGOProEnv::handle_damage_step_end,
+                   0);
+      verbose_only(MSG_BATTLE, &YGOProEnv::handle_battle, 26);
+      always(MSG_WIN, &YGOProEnv::handle_win);
+      always(MSG_RETRY, &YGOProEnv::handle_retry);
+      always(MSG_SELECT_BATTLECMD, &YGOProEnv::handle_select_battlecmd);
+      always(MSG_SELECT_UNSELECT_CARD,
+             &YGOProEnv::handle_select_unselect_card);
+      always(MSG_SELECT_CARD, &YGOProEnv::handle_select_card);
+      always(MSG_SELECT_TRIBUTE, &YGOProEnv::handle_select_tribute);
+      always(MSG_SELECT_SUM, &YGOProEnv::handle_select_sum);
+      always(MSG_SELECT_CHAIN, &YGOProEnv::handle_select_chain);
+      always(MSG_SELECT_YESNO, &YGOProEnv::handle_select_yesno);
+      always(MSG_SELECT_EFFECTYN, &YGOProEnv::handle_select_effectyn);
+      always(MSG_SELECT_OPTION, &YGOProEnv::handle_select_option);
+      always(MSG_SELECT_IDLECMD, &YGOProEnv::handle_select_idlecmd);
+      always(MSG_SELECT_PLACE, &YGOProEnv::handle_select_place);
+      always(MSG_SELECT_DISFIELD, &YGOProEnv::handle_select_disfield);
+      always(MSG_ANNOUNCE_ATTRIB, &YGOProEnv::handle_announce_attrib);
+      always(MSG_SELECT_POSITION, &YGOProEnv::handle_select_position);
+      return h;
+    }();
+    return handlers;
+  }
 
-      if ((reason & REASON_DESTROY) && (card.location_ != cnew.location_)) {
-        pl->notify("Card " + plspec + " (" + card.name_ + ") destroyed.");
-        op->notify("Card " + opspec + " (" + card.name_ + ") destroyed.");
-      } else if ((card.location_ == cnew.location_) &&
-                 (card.location_ & LOCATION_ONFIELD)) {
-        if (card.controler_ != cnew.controler_) {
-          pl->notify("Your card " + plspec + " (" + card.name_ +
-                     ") changed controller to " + op->nickname() +
-                     " and is now located at " + plnewspec + ".");
-          op->notify("You now control " + pl->nickname() + "'s card " + opspec +
-                     " (" + card.name_ + ") and its located at " + opnewspec +
-                     ".");
-        } else {
-          pl->notify("Your card " + plspec + " (" + card.name_ +
-                     ") switched its zone to " + plnewspec + ".");
-          op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
-                     ") changed its zone to " + opnewspec + ".");
-        }
-      } else if ((reason & REASON_DISCARD) &&
-                 (card.location_ != cnew.location_)) {
-        pl->notify("You discarded " + plspec + " (" + card.name_ + ").");
-        op->notify(pl->nickname() + " discarded " + opspec + " (" + card.name_ +
-                   ").");
-      } else if ((card.location_ == LOCATION_REMOVED) &&
-                 (cnew.location_ & LOCATION_ONFIELD)) {
-        pl->notify("Your banished card " + plspec + " (" + card.name_ +
-                   ") returns to the field at " + plnewspec + ".");
-        op->notify(pl->nickname() + "'s banished card " + opspec + " (" +
-                   card.name_ + ") returned to their field at " + opnewspec +
-                   ".");
-      } else if ((card.location_ == LOCATION_GRAVE) &&
-                 (cnew.location_ & LOCATION_ONFIELD)) {
+  void handle_draw() {
+    auto player = read_u8();
+    auto drawed = read_u8();
+    std::vector<uint32> codes;
+    for (int i = 0; i < drawed; ++i) {
+      uint32 code = read_u32();
+      codes.push_back(code & 0x7fffffff);
+    }
+    const auto &pl = players_[player];
+    pl->notify("Drew " + std::to_string(drawed) + " cards:");
+    for (int i = 0; i < drawed; ++i) {
+      const auto &c = c_get_card(codes[i]);
+      pl->notify(std::to_string(i + 1) + ": " + c.name_);
+    }
+    const auto &op = players_[1 - player];
+    op->notify("Opponent drew " + std::to_string(drawed) + " cards.");
+  }
+
+  void handle_new_turn() {
+    tp_ = int(read_u8());
+    turn_count_++;
+    if (!verbose_) {
+      return;
+    }
+    auto player = players_[tp_];
+    player->notify("Your turn.");
+    players_[1 - tp_]->notify(player->nickname() + "'s turn.");
+  }
+
+  void handle_new_phase() {
+    current_phase_ = int(read_u16());
+    if (!verbose_) {
+      return;
+    }
+    auto phase_str = phase_to_string(current_phase_);
+    for (int i = 0; i < 2; ++i) {
+      players_[i]->notify("entering " + phase_str + ".");
+    }
+  }
+
+  void handle_move() {
+    CardCode code = read_u32();
+    uint32_t location = read_u32();
+    uint32_t newloc = read_u32();
+    uint32_t reason = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(location);
+    Card cnew = c_get_card(code);
+    cnew.set_location(newloc);
+    auto pl = players_[card.controler_];
+    auto op = players_[1 - card.controler_];
+
+    auto plspec = card.get_spec(false);
+    auto opspec = card.get_spec(true);
+    auto plnewspec = cnew.get_spec(false);
+    auto opnewspec = cnew.get_spec(true);
+
+    auto getspec = [&](Player *p) { return p == pl ? plspec : opspec; };
+    auto getnewspec = [&](Player *p) {
+      return p == pl ? plnewspec : opnewspec;
+    };
+    bool card_visible = true;
+    if ((card.position_ & POS_FACEDOWN) && (cnew.position_ & POS_FACEDOWN)) {
+      card_visible = false;
+    }
+    auto getvisiblename = [&](Player *p) {
+      return card_visible ? card.name_ : "Face-down card";
+    };
+
+    if ((reason & REASON_DESTROY) && (card.location_ != cnew.location_)) {
+      pl->notify("Card " + plspec + " (" + card.name_ + ") destroyed.");
+      op->notify("Card " + opspec + " (" + card.name_ + ") destroyed.");
+    } else if ((card.location_ == cnew.location_) &&
+               (card.location_ & LOCATION_ONFIELD)) {
+      if (card.controler_ != cnew.controler_) {
         pl->notify("Your card " + plspec + " (" + card.name_ +
-                   ") returns from the graveyard to the field at " + plnewspec +
-                   ".");
-        op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
-                   ") returns from the graveyard to the field at " + opnewspec +
+                   ") changed controller to " + op->nickname() +
+                   " and is now located at " + plnewspec + ".");
+        op->notify("You now control " + pl->nickname() + "'s card " + opspec +
+                   " (" + card.name_ + ") and its located at " + opnewspec +
                    ".");
-      } else if ((cnew.location_ == LOCATION_HAND) &&
-                 (card.location_ != cnew.location_)) {
-        pl->notify("Card " + plspec + " (" + card.name_ +
-                   ") returned to hand.");
-      } else if ((reason & (REASON_RELEASE | REASON_SUMMON)) &&
-                 (card.location_ != cnew.location_)) {
-        pl->notify("You tribute " + plspec + " (" + card.name_ + ").");
-        op->notify(pl->nickname() + " tributes " + opspec + " (" +
-                   getvisiblename(op) + ").");
-      } else if ((card.location_ == (LOCATION_OVERLAY | LOCATION_MZONE)) &&
-                 (cnew.location_ & LOCATION_GRAVE)) {
-        pl->notify("You detached " + card.name_ + ".");
-        op->notify(pl->nickname() + " detached " + card.name_ + ".");
-      } else if ((card.location_ != cnew.location_) &&
-                 (cnew.location_ == LOCATION_GRAVE)) {
-        pl->notify("Your card " + plspec + " (" + card.name_ +
-                   ") was sent to the graveyard.");
-        op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
-                   ") was sent to the graveyard.");
-      } else if ((card.location_ != cnew.location_) &&
-                 (cnew.location_ == LOCATION_REMOVED)) {
-        pl->notify("Your card " + plspec + " (" + card.name_ +
-                   ") was banished.");
-        op->notify(pl->nickname() + "'s card " + opspec + " (" +
-                   getvisiblename(op) + ") was banished.");
-      } else if ((card.location_ != cnew.location_) &&
-                 (cnew.location_ == LOCATION_DECK)) {
-        pl->notify("Your card " + plspec + " (" + card.name_ +
-                   ") returned to your deck.");
-        op->notify(pl->nickname() + "'s card " + opspec + " (" +
-                   getvisiblename(op) + ") returned to their deck.");
-      } else if ((card.location_ != cnew.location_) &&
-                 (cnew.location_ == LOCATION_EXTRA)) {
+      } else {
         pl->notify("Your card " + plspec + " (" + card.name_ +
-                   ") returned to your extra deck.");
+                   ") switched its zone to " + plnewspec + ".");
         op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
-                   ") returned to their extra deck.");
-      } else if ((card.location_ == LOCATION_DECK) &&
-                 (cnew.location_ == LOCATION_SZONE) &&
-                 (cnew.position_ != POS_FACEDOWN)) {
-        pl->notify("Activating " + plnewspec + " (" + cnew.name_ + ")");
-        op->notify(pl->nickname() + " activating " + opnewspec + " (" +
-                   cnew.name_ + ")");
-      }
-    } else if (msg_ == MSG_SWAP) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      CardCode code1 = read_u32();
-      uint32_t loc1 = read_u32();
-      CardCode code2 = read_u32();
-      uint32_t loc2 = read_u32();
-      Card cards[2];
-      cards[0] = c_get_card(code1);
-      cards[1] = c_get_card(code2);
-      cards[0].set_location(loc1);
-      cards[1].set_location(loc2);
+                   ") changed its zone to " + opnewspec + ".");
+      }
+    } else if ((reason & REASON_DISCARD) &&
+               (card.location_ != cnew.location_)) {
+      pl->notify("You discarded " + plspec + " (" + card.name_ + ").");
+      op->notify(pl->nickname() + " discarded " + opspec + " (" + card.name_ +
+                 ").");
+    } else if ((card.location_ == LOCATION_REMOVED) &&
+               (cnew.location_ & LOCATION_ONFIELD)) {
+      pl->notify("Your banished card " + plspec + " (" + card.name_ +
+                 ") returns to the field at " + plnewspec + ".");
+      op->notify(pl->nickname() + "'s banished card " + opspec + " (" +
+                 card.name_ + ") returned to their field at " + opnewspec +
+                 ".");
+    } else if ((card.location_ == LOCATION_GRAVE) &&
+               (cnew.location_ & LOCATION_ONFIELD)) {
+      pl->notify("Your card " + plspec + " (" + card.name_ +
+                 ") returns from the graveyard to the field at " + plnewspec +
+                 ".");
+      op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
+                 ") returns from the graveyard to the field at " + opnewspec +
+                 ".");
+    } else if ((cnew.location_ == LOCATION_HAND) &&
+               (card.location_ != cnew.location_)) {
+      pl->notify("Card " + plspec + " (" + card.name_ +
+                 ") returned to hand.");
+    } else if ((reason & (REASON_RELEASE | REASON_SUMMON)) &&
+               (card.location_ != cnew.location_)) {
+      pl->notify("You tribute " + plspec + " (" + card.name_ + ").");
+      op->notify(pl->nickname() + " tributes " + opspec + " (" +
+                 getvisiblename(op) + ").");
+    } else if ((card.location_ == (LOCATION_OVERLAY | LOCATION_MZONE)) &&
+               (cnew.location_ & LOCATION_GRAVE)) {
+      pl->notify("You detached " + card.name_ + ".");
+      op->notify(pl->nickname() + " detached " + card.name_ + ".");
+    } else if ((card.location_ != cnew.location_) &&
+               (cnew.location_ == LOCATION_GRAVE)) {
+      pl->notify("Your card " + plspec + " (" + card.name_ +
+                 ") was sent to the graveyard.");
+      op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
+                 ") was sent to the graveyard.");
+    } else if ((card.location_ != cnew.location_) &&
+               (cnew.location_ == LOCATION_REMOVED)) {
+      pl->notify("Your card " + plspec + " (" + card.name_ +
+                 ") was banished.");
+      op->notify(pl->nickname() + "'s card " + opspec + " (" +
+                 getvisiblename(op) + ") was banished.");
+    } else if ((card.location_ != cnew.location_) &&
+               (cnew.location_ == LOCATION_DECK)) {
+      pl->notify("Your card " + plspec + " (" + card.name_ +
+                 ") returned to your deck.");
+      op->notify(pl->nickname() + "'s card " + opspec + " (" +
+                 getvisiblename(op) + ") returned to their deck.");
+    } else if ((card.location_ != cnew.location_) &&
+               (cnew.location_ == LOCATION_EXTRA)) {
+      pl->notify("Your card " + plspec + " (" + card.name_ +
+                 ") returned to your extra deck.");
+      op->notify(pl->nickname() + "'s card " + opspec + " (" + card.name_ +
+                 ") returned to their extra deck.");
+    } else if ((card.location_ == LOCATION_DECK) &&
+               (cnew.location_ == LOCATION_SZONE) &&
+               (cnew.position_ != POS_FACEDOWN)) {
+      pl->notify("Activating " + plnewspec + " (" + cnew.name_ + ")");
+      op->notify(pl->nickname() + " activating " + opnewspec + " (" +
+                 cnew.name_ + ")");
+    }
+  }
 
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        for (int i = 0; i < 2; i++) {
-          auto c = cards[i];
-          auto spec = c.get_spec(pl);
-          auto plname = players_[1 - c.controler_]->nickname_;
-          players_[pl]->notify("Card " + c.name_ + " swapped control towards " +
-                               plname + " and is now located at " + spec + ".");
-        }
+  void handle_swap() {
+    CardCode code1 = read_u32();
+    uint32_t loc1 = read_u32();
+    CardCode code2 = read_u32();
+    uint32_t loc2 = read_u32();
+    Card cards[2];
+    cards[0] = c_get_card(code1);
+    cards[1] = c_get_card(code2);
+    cards[0].set_location(loc1);
+    cards[1].set_location(loc2);
+
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      for (int i = 0; i < 2; i++) {
+        auto c = cards[i];
+        auto spec = c.get_spec(pl);
+        auto plname = players_[1 - c.controler_]->nickname_;
+        players_[pl]->notify("Card " + c.name_ + " swapped control towards " +
+                             plname + " and is now located at " + spec + ".");
       }
-    } else if (msg_ == MSG_SET) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
+    }
+  }
+
+  void handle_set() {
+    CardCode code = read_u32();
+    uint32_t location = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(location);
+    auto c = card.controler_;
+    auto cpl = players_[c];
+    auto opl = players_[1 - c];
+    auto x = 1u - c;
+    cpl->notify("You set " + card.get_spec(c) + " (" + card.name_ + ") in " +
+                card.get_position() + " position.");
+    opl->notify(cpl->nickname() + " sets " + card.get_spec(PlayerId(1 - c)) +
+                " in " + card.get_position() + " position.");
+  }
+
+  void handle_equip() {
+    auto c = read_u8();
+    auto loc = read_u8();
+    auto seq = read_u8();
+    auto pos = read_u8();
+    Card card = get_card(c, loc, seq);
+    c = read_u8();
+    loc = read_u8();
+    seq = read_u8();
+    pos = read_u8();
+    Card target = get_card(c, loc, seq);
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      auto c = cardlist_info_for_player(card, pl);
+      auto t = cardlist_info_for_player(target, pl);
+      players_[pl]->notify(c + " equipped to " + t + ".");
+    }
+  }
+
+  void handle_hint() {
+    auto hint_type = int(read_u8());
+    auto player = read_u8();
+    auto value = read_u32();
+    // non-GUI don't need hint
+    return;
+    if (hint_type == HINT_SELECTMSG) {
+      if (value > 2000) {
+        CardCode code = value;
+        players_[player]->notify(players_[player]->nickname() + " select " +
+                                 c_get_card(code).name_);
+      } else {
+        players_[player]->notify(get_system_string(value));
       }
-      CardCode code = read_u32();
-      uint32_t location = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(location);
-      auto c = card.controler_;
-      auto cpl = players_[c];
-      auto opl = players_[1 - c];
-      auto x = 1u - c;
-      cpl->notify("You set " + card.get_spec(c) + " (" + card.name_ + ") in " +
-                  card.get_position() + " position.");
-      opl->notify(cpl->nickname() + " sets " + card.get_spec(PlayerId(1 - c)) +
-                  " in " + card.get_position() + " position.");
-    } else if (msg_ == MSG_EQUIP) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
+    } else if (hint_type == HINT_NUMBER) {
+      players_[1 - player]->notify("Choice of player: [" +
+                                   std::to_string(value) + "]");
+    } else {
+      printf("Unknown hint type %d with value %d\n", hint_type, value);
+    }
+  }
+
+  void handle_card_hint() {
+    uint8_t player = read_u8();
+    uint8_t loc = read_u8();
+    uint8_t seq = read_u8();
+    uint8_t pos = read_u8();
+    uint8_t type = read_u8();
+    uint32_t value = read_u32();
+    Card card = get_card(player, loc, seq);
+    if (type == CHINT_RACE) {
+      std::string races_str = "TODO";
+      for (PlayerId pl = 0; pl < 2; pl++) {
+        players_[pl]->notify(card.get_spec(pl) + " (" + card.name_ +
+                             ") selected " + races_str + ".");
+      }
+    } else if (type == CHINT_ATTRIBUTE) {
+      std::string attributes_str = "TODO";
+      for (PlayerId pl = 0; pl < 2; pl++) {
+        players_[pl]->notify(card.get_spec(pl) + " (" + card.name_ +
+                             ") selected " + attributes_str + ".");
       }
+    } else {
+      printf("Unknown card hint type %d with value %d\n", type, value);
+    }
+  }
+
+  void handle_pos_change() {
+    CardCode code = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(read_u32());
+    uint8_t prevpos = card.position_;
+    card.position_ = read_u8();
+
+    auto pl = players_[card.controler_];
+    auto op = players_[1 - card.controler_];
+    auto plspec = card.get_spec(false);
+    auto opspec = card.get_spec(true);
+    auto prevpos_str = position_to_string(prevpos);
+    auto pos_str = position_to_string(card.position_);
+    pl->notify("The position of card " + plspec + " (" + card.name_ +
+               ") changed from " + prevpos_str + " to " + pos_str + ".");
+    op->notify("The position of card " + opspec + " (" + card.name_ +
+               ") changed from " + prevpos_str + " to " + pos_str + ".");
+  }
+
+  void handle_become_target() {
+    auto u = read_u8();
+    uint32_t target = read_u32();
+    uint8_t tc = target & 0xff;
+    uint8_t tl = (target >> 8) & 0xff;
+    uint8_t tseq = (target >> 16) & 0xff;
+    Card card = get_card(tc, tl, tseq);
+    auto name = players_[chaining_player_]->nickname_;
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      auto spec = card.get_spec(pl);
+      auto tcname = card.name_;
+      if ((card.controler_ != pl) && (card.position_ & POS_FACEDOWN)) {
+        tcname = position_to_string(card.position_) + " card";
+      }
+      players_[pl]->notify(name + " targets " + spec + " (" + tcname + ")");
+    }
+  }
+
+  void handle_confirm_decktop() {
+    auto player = read_u8();
+    auto size = read_u8();
+    std::vector<Card> cards;
+    for (int i = 0; i < size; ++i) {
+      read_u32();
       auto c = read_u8();
       auto loc = read_u8();
       auto seq = read_u8();
-      auto pos = read_u8();
-      Card card = get_card(c, loc, seq);
-      c = read_u8();
-      loc = read_u8();
-      seq = read_u8();
-      pos = read_u8();
-      Card target = get_card(c, loc, seq);
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        auto c = cardlist_info_for_player(card, pl);
-        auto t = cardlist_info_for_player(target, pl);
-        players_[pl]->notify(c + " equipped to " + t + ".");
-      }
-    } else if (msg_ == MSG_HINT) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto hint_type = int(read_u8());
-      auto player = read_u8();
-      auto value = read_u32();
-      // non-GUI don't need hint
-      return;
-      if (hint_type == HINT_SELECTMSG) {
-        if (value > 2000) {
-          CardCode code = value;
-          players_[player]->notify(players_[player]->nickname() + " select " +
-                                   c_get_card(code).name_);
-        } else {
-          players_[player]->notify(get_system_string(value));
-        }
-      } else if (hint_type == HINT_NUMBER) {
-        players_[1 - player]->notify("Choice of player: [" +
-                                     std::to_string(value) + "]");
-      } else {
-        printf("Unknown hint type %d with value %d\n", hint_type, value);
-      }
-    } else if (msg_ == MSG_CARD_HINT) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      uint8_t player = read_u8();
-      uint8_t loc = read_u8();
-      uint8_t seq = read_u8();
-      uint8_t pos = read_u8();
-      uint8_t type = read_u8();
-      uint32_t value = read_u32();
-      Card card = get_card(player, loc, seq);
-      if (type == CHINT_RACE) {
-        std::string races_str = "TODO";
-        for (PlayerId pl = 0; pl < 2; pl++) {
-          players_[pl]->notify(card.get_spec(pl) + " (" + card.name_ +
-                               ") selected " + races_str + ".");
-        }
-      } else if (type == CHINT_ATTRIBUTE) {
-        std::string attributes_str = "TODO";
-        for (PlayerId pl = 0; pl < 2; pl++) {
-          players_[pl]->notify(card.get_spec(pl) + " (" + card.name_ +
-                               ") selected " + attributes_str + ".");
-        }
+      cards.push_back(get_card(c, loc, seq));
+    }
+
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      auto p = players_[pl];
+      if (pl == player) {
+        p->notify("You reveal " + std::to_string(size) +
+                  " cards from your "
+                  "deck:");
       } else {
-        printf("Unknown card hint type %d with value %d\n", type, value);
+        p->notify(players_[player]->nickname() + " reveals " +
+                  std::to_string(size) + " cards from their deck:");
       }
-    } else if (msg_ == MSG_POS_CHANGE) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      CardCode code = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(read_u32());
-      uint8_t prevpos = card.position_;
-      card.position_ = read_u8();
-
-      auto pl = players_[card.controler_];
-      auto op = players_[1 - card.controler_];
-      auto plspec = card.get_spec(false);
-      auto opspec = card.get_spec(true);
-      auto prevpos_str = position_to_string(prevpos);
-      auto pos_str = position_to_string(card.position_);
-      pl->notify("The position of card " + plspec + " (" + card.name_ +
-                 ") changed from " + prevpos_str + " to " + pos_str + ".");
-      op->notify("The position of card " + opspec + " (" + card.name_ +
-                 ") changed from " + prevpos_str + " to " + pos_str + ".");
-    } else if (msg_ == MSG_BECOME_TARGET) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto u = read_u8();
-      uint32_t target = read_u32();
-      uint8_t tc = target & 0xff;
-      uint8_t tl = (target >> 8) & 0xff;
-      uint8_t tseq = (target >> 16) & 0xff;
-      Card card = get_card(tc, tl, tseq);
-      auto name = players_[chaining_player_]->nickname_;
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        auto spec = card.get_spec(pl);
-        auto tcname = card.name_;
-        if ((card.controler_ != pl) && (card.position_ & POS_FACEDOWN)) {
-          tcname = position_to_string(card.position_) + " card";
-        }
-        players_[pl]->notify(name + " targets " + spec + " (" + tcname + ")");
-      }
-    } else if (msg_ == MSG_CONFIRM_DECKTOP) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto player = read_u8();
-      auto size = read_u8();
-      std::vector<Card> cards;
       for (int i = 0; i < size; ++i) {
-        read_u32();
-        auto c = read_u8();
-        auto loc = read_u8();
-        auto seq = read_u8();
-        cards.push_back(get_card(c, loc, seq));
+        p->notify(std::to_string(i + 1) + ": " + cards[i].name_);
       }
+    }
+  }
 
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        auto p = players_[pl];
-        if (pl == player) {
-          p->notify("You reveal " + std::to_string(size) +
-                    " cards from your "
-                    "deck:");
-        } else {
-          p->notify(players_[player]->nickname() + " reveals " +
-                    std::to_string(size) + " cards from their deck:");
-        }
-        for (int i = 0; i < size; ++i) {
-          p->notify(std::to_string(i + 1) + ": " + cards[i].name_);
-        }
-      }
-    } else if (msg_ == MSG_CONFIRM_CARDS) {
-      auto player = read_u8();
-      auto size = read_u8();
-      std::vector<Card> cards;
-      for (int i = 0; i < size; ++i) {
-        read_u32();
-        auto c = read_u8();
-        auto loc = read_u8();
-        auto seq = read_u8();
-        if (verbose_) {
-          cards.push_back(get_card(c, loc, seq));
-        }
-        revealed_.push_back(ls_to_spec(loc, seq, 0, c == player));
-      }
-      if (!verbose_) {
-        return;
+  void handle_confirm_cards() {
+    auto player = read_u8();
+    auto size = read_u8();
+    std::vector<Card> cards;
+    for (int i = 0; i < size; ++i) {
+      read_u32();
+      auto c = read_u8();
+      auto loc = read_u8();
+      auto seq = read_u8();
+      if (verbose_) {
+        cards.push_back(get_card(c, loc, seq));
       }
+      revealed_.push_back(ls_to_spec(loc, seq, 0, c == player));
+    }
+    if (!verbose_) {
+      return;
+    }
 
-      auto pl = players_[player];
-      auto op = players_[1 - player];
+    auto pl = players_[player];
+    auto op = players_[1 - player];
 
-      op->notify(pl->nickname() + " shows you " + std::to_string(size) +
-                 " cards.");
-      for (int i = 0; i < size; ++i) {
-        pl->notify(std::to_string(i + 1) + ": " + cards[i].name_);
-      }
-    } else if (msg_ == MSG_MISSED_EFFECT) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      dp_ += 4;
-      CardCode code = read_u32();
-      Card card = c_get_card(code);
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        auto spec = card.get_spec(pl);
-        auto str = get_system_string(1622);
-        std::string fmt_str = "[%ls]";
-        str = str.replace(str.find(fmt_str), fmt_str.length(), card.name_);
-        players_[pl]->notify(str);
-      }
-    } else if (msg_ == MSG_SORT_CARD) {
-      // TODO: implement action
-      if (!verbose_) {
-        dp_ = dl_;
-        resp_buf_[0] = 255;
-        set_responseb(pduel_, resp_buf_);
-        return;
-      }
-      auto player = read_u8();
-      to_play_ = player;
-      auto size = read_u8();
-      std::vector<Card> cards;
-      for (int i = 0; i < size; ++i) {
-        read_u32();
-        auto c = read_u8();
-        auto loc = read_u8();
-        auto seq = read_u8();
-        cards.push_back(get_card(c, loc, seq));
-      }
-      auto pl = players_[player];
-      pl->notify(
-          "Sort " + std::to_string(size) +
-          " cards by entering numbers separated by spaces (c = cancel):");
-      for (int i = 0; i < size; ++i) {
-        pl->notify(std::to_string(i + 1) + ": " + cards[i].name_);
-      }
+    op->notify(pl->nickname() + " shows you " + std::to_string(size) +
+               " cards.");
+    for (int i = 0; i < size; ++i) {
+      pl->notify(std::to_string(i + 1) + ": " + cards[i].name_);
+    }
+  }
+
+  void handle_missed_effect() {
+    dp_ += 4;
+    CardCode code = read_u32();
+    Card card = c_get_card(code);
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      auto spec = card.get_spec(pl);
+      auto str = get_system_string(1622);
+      std::string fmt_str = "[%ls]";
+      str = str.replace(str.find(fmt_str), fmt_str.length(), card.name_);
+      players_[pl]->notify(str);
+    }
+  }
 
-      printf("sort card not implemented\n");
+  void handle_sort_card() {
+    // TODO: implement action
+    if (!verbose_) {
+      dp_ = dl_;
       resp_buf_[0] = 255;
       set_responseb(pduel_, resp_buf_);
+      return;
+    }
+    auto player = read_u8();
+    to_play_ = player;
+    auto size = read_u8();
+    std::vector<Card> cards;
+    for (int i = 0; i < size; ++i) {
+      read_u32();
+      auto c = read_u8();
+      auto loc = read_u8();
+      auto seq = read_u8();
+      cards.push_back(get_card(c, loc, seq));
+    }
+    auto pl = players_[player];
+    pl->notify(
+        "Sort " + std::to_string(size) +
+        " cards by entering numbers separated by spaces (c = cancel):");
+    for (int i = 0; i < size; ++i) {
+      pl->notify(std::to_string(i + 1) + ": " + cards[i].name_);
+    }
 
-      // // generate all permutations
-      // std::vector<int> perm(size);
-      // std::iota(perm.begin(), perm.end(), 0);
-      // std::vector<std::vector<int>> perms;
-      // do {
-      //   auto option = std::accumulate(perm.begin(), perm.end(),
-      //   std::string(),
-      //                                 [&](std::string &acc, int i) {
-      //                                   return acc + std::to_string(i + 1) +
-      //                                   " ";
-      //                                 });
-      //   options_.push_back(option);
-      // } while (std::next_permutation(perm.begin(), perm.end()));
-      // options_.push_back("c");
-      // callback_ = [this](int idx) {
-      //   const auto &option = options_[idx];
-      //   if (option == "c") {
-      //     resp_buf_[0] = 255;
-      //     set_responseb(pduel_, resp_buf_);
-      //     return;
-      //   }
-      //   std::istringstream iss(option);
-      //   int x;
-      //   int i = 0;
-      //   while (iss >> x) {
-      //     resp_buf_[i] = uint8_t(x);
-      //     i++;
-      //   }
-      //   set_responseb(pduel_, resp_buf_);
-      // };
-    } else if (msg_ == MSG_SHUFFLE_SET_CARD) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      // TODO: implement output
-      dp_ = dl_;
-    } else if (msg_ == MSG_SHUFFLE_DECK) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto player = read_u8();
-      auto pl = players_[player];
-      auto op = players_[1 - player];
-      pl->notify("You shuffled your deck.");
-      op->notify(pl->nickname() + " shuffled their deck.");
-    } else if (msg_ == MSG_SHUFFLE_HAND) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
+    printf("sort card not implemented\n");
+    resp_buf_[0] = 255;
+    set_responseb(pduel_, resp_buf_);
+
+    // // generate all permutations
+    // std::vector<int> perm(size);
+    // std::iota(perm.begin(), perm.end(), 0);
+    // std::vector<std::vector<int>> perms;
+    // do {
+    //   auto option = std::accumulate(perm.begin(), perm.end(),
+    //   std::string(),
+    //                                 [&](std::string &acc, int i) {
+    //                                   return acc + std::to_string(i + 1) +
+    //                                   " ";
+    //                                 });
+    //   options_.push_back(option);
+    // } while (std::next_permutation(perm.begin(), perm.end()));
+    // options_.push_back("c");
+    // callback_ = [this](int idx) {
+    //   const auto &option = options_[idx];
+    //   if (option == "c") {
+    //     resp_buf_[0] = 255;
+    //     set_responseb(pduel_, resp_buf_);
+    //     return;
+    //   }
+    //   std::istringstream iss(option);
+    //   int x;
+    //   int i = 0;
+    //   while (iss >> x) {
+    //     resp_buf_[i] = uint8_t(x);
+    //     i++;
+    //   }
+    //   set_responseb(pduel_, resp_buf_);
+    // };
+  }
 
-      auto player = read_u8();
-      dp_ = dl_;
+  void handle_shuffle_set_card() {
+    // TODO: implement output
+    dp_ = dl_;
+  }
 
-      auto pl = players_[player];
-      auto op = players_[1 - player];
-      pl->notify("You shuffled your hand.");
-      op->notify(pl->nickname() + " shuffled their hand.");
-    } else if (msg_ == MSG_SUMMONED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_SUMMONING) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      CardCode code = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(read_u32());
-      const auto &nickname = players_[card.controler_]->nickname();
-      for (auto pl : players_) {
-        pl->notify(nickname + " summoning " + card.name_ + " (" +
-                   std::to_string(card.attack_) + "/" +
-                   std::to_string(card.defense_) + ") in " +
-                   card.get_position() + " position.");
-      }
-    } else if (msg_ == MSG_SPSUMMONED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_FLIPSUMMONED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_FLIPSUMMONING) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
+  void handle_shuffle_deck() {
+    auto player = read_u8();
+    auto pl = players_[player];
+    auto op = players_[1 - player];
+    pl->notify("You shuffled your deck.");
+    op->notify(pl->nickname() + " shuffled their deck.");
+  }
+
+  void handle_shuffle_hand() {
+    auto player = read_u8();
+    dp_ = dl_;
+
+    auto pl = players_[player];
+    auto op = players_[1 - player];
+    pl->notify("You shuffled your hand.");
+    op->notify(pl->nickname() + " shuffled their hand.");
+  }
+
+  void handle_summoning() {
+    CardCode code = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(read_u32());
+    const auto &nickname = players_[card.controler_]->nickname();
+    for (auto pl : players_) {
+      pl->notify(nickname + " summoning " + card.name_ + " (" +
+                 std::to_string(card.attack_) + "/" +
+                 std::to_string(card.defense_) + ") in " +
+                 card.get_position() + " position.");
+    }
+  }
+
+  void handle_flipsummoning() {
+    auto code = read_u32();
+    auto location = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(location);
+
+    auto cpl = players_[card.controler_];
+    for (PlayerId pl = 0; pl < 2; pl++) {
+      auto spec = card.get_spec(pl);
+      players_[1 - pl]->notify(cpl->nickname() + " flip summons " + spec +
+                               " (" + card.name_ + ")");
+    }
+  }
+
+  void handle_spsummoning() {
+    CardCode code = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(read_u32());
+    const auto &nickname = players_[card.controler_]->nickname();
+    for (auto pl : players_) {
+      auto pos = card.get_position();
+      auto atk = std::to_string(card.attack_);
+      auto def = std::to_string(card.defense_);
+      if (card.type_ & TYPE_LINK) {
+        pl->notify(nickname + " special summoning " + card.name_ + " (" +
+                   atk + ") in " + pos + " position.");
+      } else {
+        pl->notify(nickname + " special summoning " + card.name_ + " (" +
+                   atk + "/" + def + ") in " + pos + " position.");
       }
+    }
+  }
 
-      auto code = read_u32();
-      auto location = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(location);
+  void handle_chain_solved() {
+    dp_ = dl_;
+    revealed_.clear();
+  }
 
-      auto cpl = players_[card.controler_];
-      for (PlayerId pl = 0; pl < 2; pl++) {
-        auto spec = card.get_spec(pl);
-        players_[1 - pl]->notify(cpl->nickname() + " flip summons " + spec +
-                                 " (" + card.name_ + ")");
+  void handle_chaining() {
+    CardCode code = read_u32();
+    Card card = c_get_card(code);
+    card.set_location(read_u32());
+    auto tc = read_u8();
+    auto tl = read_u8();
+    auto ts = read_u8();
+    uint32_t desc = read_u32();
+    auto cs = read_u8();
+    auto c = card.controler_;
+    PlayerId o = 1 - c;
+    chaining_player_ = c;
+    players_[c]->notify("Activating " + card.get_spec(c) + " (" + card.name_ +
+                        ")");
+    players_[o]->notify(players_[c]->nickname_ + " activating " +
+                        card.get_spec(o) + " (" + card.name_ + ")");
+  }
+
+  void handle_damage() {
+    auto player = read_u8();
+    auto amount = read_u32();
+    _damage(player, amount);
+  }
+
+  void handle_recover() {
+    auto player = read_u8();
+    auto amount = read_u32();
+    _recover(player, amount);
+  }
+
+  void handle_lpupdate() {
+    auto player = read_u8();
+    auto lp = read_u32();
+    if (lp >= lp_[player]) {
+      _recover(player, lp - lp_[player]);
+    } else {
+      _damage(player, lp_[player] - lp);
+    }
+  }
+
+  void handle_pay_lpcost() {
+    auto player = read_u8();
+    auto cost = read_u32();
+    lp_[player] -= cost;
+    if (!verbose_) {
+      return;
+    }
+    auto pl = players_[player];
+    pl->notify("You pay " + std::to_string(cost) + " LP. Your LP is now " +
+               std::to_string(lp_[player]) + ".");
+    players_[1 - player]->notify(
+        pl->nickname() + " pays " + std::to_string(cost) + " LP. " +
+        pl->nickname() + "'s LP is now " + std::to_string(lp_[player]) + ".");
+  }
+
+  void handle_attack() {
+    auto attacker = read_u32();
+    PlayerId ac = attacker & 0xff;
+    auto aloc = (attacker >> 8) & 0xff;
+    auto aseq = (attacker >> 16) & 0xff;
+    auto apos = (attacker >> 24) & 0xff;
+    auto target = read_u32();
+    PlayerId tc = target & 0xff;
+    auto tloc = (target >> 8) & 0xff;
+    auto tseq = (target >> 16) & 0xff;
+    auto tpos = (target >> 24) & 0xff;
+
+    if ((ac == 0) && (aloc == 0) && (aseq == 0) && (apos == 0)) {
+      return;
+    }
+
+    Card acard = get_card(ac, aloc, aseq);
+    auto name = players_[ac]->nickname_;
+    if ((tc == 0) && (tloc == 0) && (tseq == 0) && (tpos == 0)) {
+      for (PlayerId i = 0; i < 2; i++) {
+        players_[i]->notify(name + " prepares to attack with " +
+                            acard.get_spec(i) + " (" + acard.name_ + ")");
       }
-    } else if (msg_ == MSG_SPSUMMONING) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
+      return;
+    }
+
+    Card tcard = get_card(tc, tloc, tseq);
+    for (PlayerId i = 0; i < 2; i++) {
+      auto aspec = acard.get_spec(i);
+      auto tspec = tcard.get_spec(i);
+      auto tcname = tcard.name_;
+      if ((tcard.controler_ != i) && (tcard.position_ & POS_FACEDOWN)) {
+        tcname = tcard.get_position() + " card";
+      }
+      players_[i]->notify(name + " prepares to attack " + tspec + " (" +
+                          tcname + ") with " + aspec + " (" + acard.name_ +
+                          ")");
+    }
+  }
+
+  void handle_damage_step_start() {
+    for (int i = 0; i < 2; i++) {
+      players_[i]->notify("begin damage");
+    }
+  }
+
+  void handle_damage_step_end() {
+    for (int i = 0; i < 2; i++) {
+      players_[i]->notify("end damage");
+    }
+  }
+
+  void handle_battle() {
+    auto attacker = read_u32();
+    auto aa = read_u32();
+    auto ad = read_u32();
+    auto bd0 = read_u8();
+    auto target = read_u32();
+    auto da = read_u32();
+    auto dd = read_u32();
+    auto bd1 = read_u8();
+
+    auto ac = attacker & 0xff;
+    auto aloc = (attacker >> 8) & 0xff;
+    auto aseq = (attacker >> 16) & 0xff;
+
+    auto tc = target & 0xff;
+    auto tloc = (target >> 8) & 0xff;
+    auto tseq = (target >> 16) & 0xff;
+    auto tpos = (target >> 24) & 0xff;
+
+    Card acard = get_card(ac, aloc, aseq);
+    Card tcard;
+    if (tloc != 0) {
+      tcard = get_card(tc, tloc, tseq);
+    }
+    for (int i = 0; i < 2; i++) {
+      auto pl = players_[i];
+      std::string attacker_points;
+      if (acard.type_ & TYPE_LINK) {
+        attacker_points = std::to_string(aa);
+      } else {
+        attacker_points = std::to_string(aa) + "/" + std::to_string(ad);
       }
-      CardCode code = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(read_u32());
-      const auto &nickname = players_[card.controler_]->nickname();
-      for (auto pl : players_) {
-        auto pos = card.get_position();
-        auto atk = std::to_string(card.attack_);
-        auto def = std::to_string(card.defense_);
-        if (card.type_ & TYPE_LINK) {
-          pl->notify(nickname + " special summoning " + card.name_ + " (" +
-                     atk + ") in " + pos + " position.");
+      if (tloc != 0) {
+        std::string defender_points;
+        if (tcard.type_ & TYPE_LINK) {
+          defender_points = std::to_string(da);
         } else {
-          pl->notify(nickname + " special summoning " + card.name_ + " (" +
-                     atk + "/" + def + ") in " + pos + " position.");
+          defender_points = std::to_string(da) + "/" + std::to_string(dd);
         }
-      }
-    } else if (msg_ == MSG_CHAIN_NEGATED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_CHAIN_DISABLED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_CHAIN_SOLVED) {
-      dp_ = dl_;
-      revealed_.clear();
-    } else if (msg_ == MSG_CHAIN_SOLVING) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_CHAINED) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_CHAIN_END) {
-      dp_ = dl_;
-    } else if (msg_ == MSG_CHAINING) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      CardCode code = read_u32();
-      Card card = c_get_card(code);
-      card.set_location(read_u32());
-      auto tc = read_u8();
-      auto tl = read_u8();
-      auto ts = read_u8();
-      uint32_t desc = read_u32();
-      auto cs = read_u8();
-      auto c = card.controler_;
-      PlayerId o = 1 - c;
-      chaining_player_ = c;
-      players_[c]->notify("Activating " + card.get_spec(c) + " (" + card.name_ +
-                          ")");
-      players_[o]->notify(players_[c]->nickname_ + " activating " +
-                          card.get_spec(o) + " (" + card.name_ + ")");
-    } else if (msg_ == MSG_DAMAGE) {
-      auto player = read_u8();
-      auto amount = read_u32();
-      _damage(player, amount);
-    } else if (msg_ == MSG_RECOVER) {
-      auto player = read_u8();
-      auto amount = read_u32();
-      _recover(player, amount);
-    } else if (msg_ == MSG_LPUPDATE) {
-      auto player = read_u8();
-      auto lp = read_u32();
-      if (lp >= lp_[player]) {
-        _recover(player, lp - lp_[player]);
+        pl->notify(acard.name_ + "(" + attacker_points + ")" + " attacks " +
+                   tcard.name_ + " (" + defender_points + ")");
       } else {
-        _damage(player, lp_[player] - lp);
-      }
-    } else if (msg_ == MSG_PAY_LPCOST) {
-      auto player = read_u8();
-      auto cost = read_u32();
-      lp_[player] -= cost;
-      if (!verbose_) {
-        return;
-      }
-      auto pl = players_[player];
-      pl->notify("You pay " + std::to_string(cost) + " LP. Your LP is now " +
-                 std::to_string(lp_[player]) + ".");
-      players_[1 - player]->notify(
-          pl->nickname() + " pays " + std::to_string(cost) + " LP. " +
-          pl->nickname() + "'s LP is now " + std::to_string(lp_[player]) + ".");
-    } else if (msg_ == MSG_ATTACK) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto attacker = read_u32();
-      PlayerId ac = attacker & 0xff;
-      auto aloc = (attacker >> 8) & 0xff;
-      auto aseq = (attacker >> 16) & 0xff;
-      auto apos = (attacker >> 24) & 0xff;
-      auto target = read_u32();
-      PlayerId tc = target & 0xff;
-      auto tloc = (target >> 8) & 0xff;
-      auto tseq = (target >> 16) & 0xff;
-      auto tpos = (target >> 24) & 0xff;
-
-      if ((ac == 0) && (aloc == 0) && (aseq == 0) && (apos == 0)) {
-        return;
-      }
-
-      Card acard = get_card(ac, aloc, aseq);
-      auto name = players_[ac]->nickname_;
-      if ((tc == 0) && (tloc == 0) && (tseq == 0) && (tpos == 0)) {
-        for (PlayerId i = 0; i < 2; i++) {
-          players_[i]->notify(name + " prepares to attack with " +
-                              acard.get_spec(i) + " (" + acard.name_ + ")");
-        }
-        return;
+        pl->notify(acard.name_ + "(" + attacker_points + ")" + " attacks");
       }
+    }
+  }
 
-      Card tcard = get_card(tc, tloc, tseq);
-      for (PlayerId i = 0; i < 2; i++) {
-        auto aspec = acard.get_spec(i);
-        auto tspec = tcard.get_spec(i);
-        auto tcname = tcard.name_;
-        if ((tcard.controler_ != i) && (tcard.position_ & POS_FACEDOWN)) {
-          tcname = tcard.get_position() + " card";
-        }
-        players_[i]->notify(name + " prepares to attack " + tspec + " (" +
-                            tcname + ") with " + aspec + " (" + acard.name_ +
-                            ")");
-      }
-    } else if (msg_ == MSG_DAMAGE_STEP_START) {
-      if (!verbose_) {
-        return;
-      }
-      for (int i = 0; i < 2; i++) {
-        players_[i]->notify("begin damage");
-      }
-    } else if (msg_ == MSG_DAMAGE_STEP_END) {
-      if (!verbose_) {
-        return;
-      }
-      for (int i = 0; i < 2; i++) {
-        players_[i]->notify("end damage");
-      }
-    } else if (msg_ == MSG_BATTLE) {
-      if (!verbose_) {
-        dp_ = dl_;
-        return;
-      }
-      auto attacker = read_u32();
-      auto aa = read_u32();
-      auto ad = read_u32();
-      auto bd0 = read_u8();
-      auto target = read_u32();
-      auto da = read_u32();
-      auto dd = read_u32();
-      auto bd1 = read_u8();
-
-      auto ac = attacker & 0xff;
-      auto aloc = (attacker >> 8) & 0xff;
-      auto aseq = (attacker >> 16) & 0xff;
-
-      auto tc = target & 0xff;
-      auto tloc = (target >> 8) & 0xff;
-      auto tseq = (target >> 16) & 0xff;
-      auto tpos = (target >> 24) & 0xff;
-
-      Card acard = get_card(ac, aloc, aseq);
-      Card tcard;
-      if (tloc != 0) {
-        tcard = get_card(tc, tloc, tseq);
-      }
-      for (int i = 0; i < 2; i++) {
-        auto pl = players_[i];
-        std::string attacker_points;
-        if (acard.type_ & TYPE_LINK) {
-          attacker_points = std::to_string(aa);
-        } else {
-          attacker_points = std::to_string(aa) + "/" + std::to_string(ad);
-        }
-        if (tloc != 0) {
-          std::string defender_points;
-          if (tcard.type_ & TYPE_LINK) {
-            defender_points = std::to_string(da);
-          } else {
-            defender_points = std::to_string(da) + "/" + std::to_string(dd);
-          }
-          pl->notify(acard.name_ + "(" + attacker_points + ")" + " attacks " +
-                     tcard.name_ + " (" + defender_points + ")");
-        } else {
-          pl->notify(acard.name_ + "(" + attacker_points + ")" + " attacks");
-        }
-      }
-    } else if (msg_ == MSG_WIN) {
-      auto player = read_u8();
-      auto reason = read_u8();
-      auto winner = players_[player];
-      auto loser = players_[1 - player];
+  void handle_win() {
+    auto player = read_u8();
+    auto reason = read_u8();
+    auto winner = players_[player];
+    auto loser = players_[1 - player];
 
-      _duel_end(player, reason);
+    _duel_end(player, reason);
 
-      auto l_reason = reason_to_string(reason);
-      if (verbose_) {
-        winner->notify("You won (" + l_reason + ").");
-        loser->notify("You lost (" + l_reason + ").");
-      }
-    } else if (msg_ == MSG_RETRY) {
-      printf("Retry\n");
-      throw std::runtime_error("Retry");
-    } else if (msg_ == MSG_SELECT_BATTLECMD) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto activatable = read_cardlist_spec(true);
-      auto attackable = read_cardlist_spec(true, true);
-      bool to_m2 = read_u8();
-      bool to_ep = read_u8();
+    auto l_reason = reason_to_string(reason);
+    if (verbose_) {
+      winner->notify("You won (" + l_reason + ").");
+      loser->notify("You lost (" + l_reason + ").");
+    }
+  }
 
-      auto pl = players_[player];
+  void handle_retry() {
+    printf("Retry\n");
+    throw std::runtime_error("Retry");
+  }
+
+  void handle_select_battlecmd() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto activatable = read_cardlist_spec(true);
+    auto attackable = read_cardlist_spec(true, true);
+    bool to_m2 = read_u8();
+    bool to_ep = read_u8();
+
+    auto pl = players_[player];
+    if (verbose_) {
+      pl->notify("Battle menu:");
+    }
+    for (const auto [code, spec, data] : activatable) {
+      options_.push_back("v " + spec);
       if (verbose_) {
-        pl->notify("Battle menu:");
+        const auto &c = c_get_card(code);
+        pl->notify("v " + spec + ": activate " + c.name_ + " (" +
+                   std::to_string(c.attack_) + "/" +
+                   std::to_string(c.defense_) + ")");
       }
-      for (const auto [code, spec, data] : activatable) {
-        options_.push_back("v " + spec);
-        if (verbose_) {
-          const auto &c = c_get_card(code);
-          pl->notify("v " + spec + ": activate " + c.name_ + " (" +
+    }
+    for (const auto [code, spec, data] : attackable) {
+      options_.push_back("a " + spec);
+      if (verbose_) {
+        const auto &c = c_get_card(code);
+        if (c.type_ & TYPE_LINK) {
+          pl->notify("a " + spec + ": " + c.name_ + " (" +
+                     std::to_string(c.attack_) + ") attack");
+        } else {
+          pl->notify("a " + spec + ": " + c.name_ + " (" +
                      std::to_string(c.attack_) + "/" +
-                     std::to_string(c.defense_) + ")");
+                     std::to_string(c.defense_) + ") attack");
         }
       }
-      for (const auto [code, spec, data] : attackable) {
-        options_.push_back("a " + spec);
-        if (verbose_) {
-          const auto &c = c_get_card(code);
-          if (c.type_ & TYPE_LINK) {
-            pl->notify("a " + spec + ": " + c.name_ + " (" +
-                       std::to_string(c.attack_) + ") attack");
-          } else {
-            pl->notify("a " + spec + ": " + c.name_ + " (" +
-                       std::to_string(c.attack_) + "/" +
-                       std::to_string(c.defense_) + ") attack");
-          }
-        }
+    }
+    if (to_m2) {
+      options_.push_back("m");
+      if (verbose_) {
+        pl->notify("m: Main phase 2.");
       }
-      if (to_m2) {
-        options_.push_back("m");
+    }
+    if (to_ep) {
+      if (!to_m2) {
+        options_.push_back("e");
         if (verbose_) {
-          pl->notify("m: Main phase 2.");
+          pl->notify("e: End phase.");
         }
       }
-      if (to_ep) {
-        if (!to_m2) {
-          options_.push_back("e");
-          if (verbose_) {
-            pl->notify("e: End phase.");
-          }
-        }
+    }
+    for (int i = 0; i < activatable.size(); ++i) {
+      add_response(i << 16);
+    }
+    for (int i = 0; i < attackable.size(); ++i) {
+      add_response((i << 16) + 1);
+    }
+    if (to_m2) {
+      add_response(2);
+    } else if (to_ep) {
+      add_response(3);
+    }
+  }
+
+  void handle_select_unselect_card() {
+    auto player = read_u8();
+    to_play_ = player;
+    bool finishable = read_u8();
+    bool cancelable = read_u8();
+    auto min = read_u8();
+    auto max = read_u8();
+    auto select_size = read_u8();
+
+    std::vector<std::string> select_specs;
+    select_specs.reserve(select_size);
+    if (verbose_) {
+      std::vector<Card> cards;
+      for (int i = 0; i < select_size; ++i) {
+        auto code = read_u32();
+        auto loc = read_u32();
+        Card card = c_get_card(code);
+        card.set_location(loc);
+        cards.push_back(card);
       }
-      int n_activatables = activatable.size();
-      int n_attackables = attackable.size();
-      callback_ = [this, n_activatables, n_attackables, to_ep, to_m2](int idx) {
-        if (idx < n_activatables) {
-          set_responsei(pduel_, idx << 16);
-        } else if (idx < (n_activatables + n_attackables)) {
-          idx = idx - n_activatables;
-          set_responsei(pduel_, (idx << 16) + 1);
-        } else if ((options_[idx] == "e") && to_ep) {
-          set_responsei(pduel_, 3);
-        } else if ((options_[idx] == "m") && to_m2) {
-          set_responsei(pduel_, 2);
-        } else {
-          throw std::runtime_error("Invalid option");
-        }
-      };
-    } else if (msg_ == MSG_SELECT_UNSELECT_CARD) {
-      auto player = read_u8();
-      to_play_ = player;
-      bool finishable = read_u8();
-      bool cancelable = read_u8();
-      auto min = read_u8();
-      auto max = read_u8();
-      auto select_size = read_u8();
-
-      std::vector<std::string> select_specs;
-      select_specs.reserve(select_size);
-      if (verbose_) {
-        std::vector<Card> cards;
-        for (int i = 0; i < select_size; ++i) {
-          auto code = read_u32();
-          auto loc = read_u32();
-          Card card = c_get_card(code);
-          card.set_location(loc);
-          cards.push_back(card);
-        }
-        auto pl = players_[player];
-        pl->notify("Select " + std::to_string(min) + " to " +
-                   std::to_string(max) + " cards:");
-        for (const auto &card : cards) {
-          auto spec = card.get_spec(player);
-          select_specs.push_back(spec);
-          pl->notify(spec + ": " + card.name_);
-        }
-      } else {
-        for (int i = 0; i < select_size; ++i) {
-          dp_ += 4;
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto pos = read_u8();
-          auto spec = ls_to_spec(loc, seq, pos, controller != player);
-          select_specs.push_back(spec);
-        }
+      auto pl = players_[player];
+      pl->notify("Select " + std::to_string(min) + " to " +
+                 std::to_string(max) + " cards:");
+      for (const auto &card : cards) {
+        auto spec = card.get_spec(player);
+        select_specs.push_back(spec);
+        pl->notify(spec + ": " + card.name_);
       }
+    } else {
+      for (int i = 0; i < select_size; ++i) {
+        dp_ += 4;
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto pos = read_u8();
+        auto spec = ls_to_spec(loc, seq, pos, controller != player);
+        select_specs.push_back(spec);
+      }
+    }
 
-      auto unselect_size = read_u8();
-
-      // unselect not allowed (no regrets!)
-      dp_ += 8 * unselect_size;
+    auto unselect_size = read_u8();
 
-      // if (min != max) {
-      //   printf("Min(%d) != Max(%d) not implemented, select_size: %d,
-      //   unselect_size: %d\n",
-      //          min, max, select_size, unselect_size);
-      // }
+    // unselect not allowed (no regrets!)
+    dp_ += 8 * unselect_size;
 
-      for (int j = 0; j < select_specs.size(); ++j) {
-        options_.push_back(select_specs[j]);
-      }
+    // if (min != max) {
+    //   printf("Min(%d) != Max(%d) not implemented, select_size: %d,
+    //   unselect_size: %d\n",
+    //          min, max, select_size, unselect_size);
+    // }
 
-      if (finishable) {
-        options_.push_back("f");
-      }
+    for (int j = 0; j < select_specs.size(); ++j) {
+      options_.push_back(select_specs[j]);
+      add_response({1, uint8_t(j)});
+    }
 
-      // cancelable and finishable not needed
+    if (finishable) {
+      options_.push_back("f");
+      add_response(-1);
+    }
 
-      callback_ = [this](int idx) {
-        if (options_[idx] == "f") {
-          set_responsei(pduel_, -1);
-        } else {
-          resp_buf_[0] = 1;
-          resp_buf_[1] = idx;
-          set_responseb(pduel_, resp_buf_);
-        }
-      };
+    // cancelable and finishable not needed
+  }
 
-    } else if (msg_ == MSG_SELECT_CARD) {
-      auto player = read_u8();
-      to_play_ = player;
-      bool cancelable = read_u8();
-      auto min = read_u8();
-      auto max = read_u8();
-      auto size = read_u8();
+  void handle_select_card() {
+    auto player = read_u8();
+    to_play_ = player;
+    bool cancelable = read_u8();
+    auto min = read_u8();
+    auto max = read_u8();
+    auto size = read_u8();
+
+    if (min > spec_.config["max_multi_select"_]) {
+      printf("min: %d, max: %d, size: %d\n", min, max, size);
+      throw std::runtime_error("Min > " + std::to_string(spec_.config["max_multi_select"_]) + " not implemented for select card");
+    }
+    max = std::min(max, uint8_t(spec_.config["max_multi_select"_]));
 
-      if (min > spec_.config["max_multi_select"_]) {
-        printf("min: %d, max: %d, size: %d\n", min, max, size);
-        throw std::runtime_error("Min > " + std::to_string(spec_.config["max_multi_select"_]) + " not implemented for select card");
+    std::vector<std::string> specs;
+    specs.reserve(size);
+    if (verbose_) {
+      std::vector<Card> cards;
+      for (int i = 0; i < size; ++i) {
+        auto code = read_u32();
+        auto loc = read_u32();
+        Card card = c_get_card(code);
+        card.set_location(loc);
+        cards.push_back(card);
       }
-      max = std::min(max, uint8_t(spec_.config["max_multi_select"_]));
-
-      std::vector<std::string> specs;
-      specs.reserve(size);
-      if (verbose_) {
-        std::vector<Card> cards;
-        for (int i = 0; i < size; ++i) {
-          auto code = read_u32();
-          auto loc = read_u32();
-          Card card = c_get_card(code);
-          card.set_location(loc);
-          cards.push_back(card);
-        }
-        auto pl = players_[player];
-        pl->notify("Select " + std::to_string(min) + " to " +
-                   std::to_string(max) + " cards separated by spaces:");
-        for (const auto &card : cards) {
-          auto spec = card.get_spec(player);
-          specs.push_back(spec);
-          if (card.controler_ != player && card.position_ & POS_FACEDOWN) {
-            pl->notify(spec + ": " + card.get_position() + " card");
-          } else {
-            pl->notify(spec + ": " + card.name_);
-          }
-        }
-      } else {
-        for (int i = 0; i < size; ++i) {
-          dp_ += 4;
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto pos = read_u8();
-          auto spec = ls_to_spec(loc, seq, pos, controller != player);
-          specs.push_back(spec);
+      auto pl = players_[player];
+      pl->notify("Select " + std::to_string(min) + " to " +
+                 std::to_string(max) + " cards separated by spaces:");
+      for (const auto &card : cards) {
+        auto spec = card.get_spec(player);
+        specs.push_back(spec);
+        if (card.controler_ != player && card.position_ & POS_FACEDOWN) {
+          pl->notify(spec + ": " + card.get_position() + " card");
+        } else {
+          pl->notify(spec + ": " + card.name_);
         }
       }
+    } else {
+      for (int i = 0; i < size; ++i) {
+        dp_ += 4;
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto pos = read_u8();
+        auto spec = ls_to_spec(loc, seq, pos, controller != player);
+        specs.push_back(spec);
+      }
+    }
 
-      std::vector<std::vector<int>> combs;
-      for (int i = min; i <= max; ++i) {
-        for (const auto &comb : combinations(size, i)) {
-          combs.push_back(comb);
-          std::string option = "";
-          for (int j = 0; j < i; ++j) {
-            option += specs[comb[j]];
-            if (j < i - 1) {
-              option += " ";
-            }
+    for (int i = min; i <= max; ++i) {
+      for (const auto &comb : combinations(size, i)) {
+        std::string option = "";
+        for (int j = 0; j < i; ++j) {
+          option += specs[comb[j]];
+          if (j < i - 1) {
+            option += " ";
           }
-          options_.push_back(option);
         }
+        options_.push_back(option);
+        add_response(comb);
       }
+    }
+  }
 
-      callback_ = [this, combs](int idx) {
-        const auto &comb = combs[idx];
-        resp_buf_[0] = comb.size();
-        for (int i = 0; i < comb.size(); ++i) {
-          resp_buf_[i + 1] = comb[i];
-        }
-        set_responseb(pduel_, resp_buf_);
-      };
-    } else if (msg_ == MSG_SELECT_TRIBUTE) {
-      auto player = read_u8();
-      to_play_ = player;
-      bool cancelable = read_u8();
-      auto min = read_u8();
-      auto max = read_u8();
-      auto size = read_u8();
-
-      if (max > 3) {
-        throw std::runtime_error("Max > 3 not implemented for select tribute");
-      }
-
-      std::vector<int> release_params;
-      release_params.reserve(size);
-      std::vector<std::string> specs;
-      specs.reserve(size);
-      if (verbose_) {
-        std::vector<Card> cards;
-        for (int i = 0; i < size; ++i) {
-          auto code = read_u32();
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto release_param = read_u8();
-          Card card = get_card(controller, loc, seq);
-          cards.push_back(card);
-          release_params.push_back(release_param);
-        }
-        auto pl = players_[player];
-        pl->notify("Select " + std::to_string(min) + " to " +
-                   std::to_string(max) +
-                   " cards to tribute separated by spaces:");
-        for (const auto &card : cards) {
-          auto spec = card.get_spec(player);
-          specs.push_back(spec);
-          pl->notify(spec + ": " + card.name_);
-        }
-      } else {
-        for (int i = 0; i < size; ++i) {
-          dp_ += 4;
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto release_param = read_u8();
+  void handle_select_tribute() {
+    auto player = read_u8();
+    to_play_ = player;
+    bool cancelable = read_u8();
+    auto min = read_u8();
+    auto max = read_u8();
+    auto size = read_u8();
 
-          auto spec = ls_to_spec(loc, seq, 0, controller != player);
-          specs.push_back(spec);
+    if (max > 3) {
+      throw std::runtime_error("Max > 3 not implemented for select tribute");
+    }
 
-          release_params.push_back(release_param);
-        }
+    std::vector<int> release_params;
+    release_params.reserve(size);
+    std::vector<std::string> specs;
+    specs.reserve(size);
+    if (verbose_) {
+      std::vector<Card> cards;
+      for (int i = 0; i < size; ++i) {
+        auto code = read_u32();
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto release_param = read_u8();
+        Card card = get_card(controller, loc, seq);
+        cards.push_back(card);
+        release_params.push_back(release_param);
+      }
+      auto pl = players_[player];
+      pl->notify("Select " + std::to_string(min) + " to " +
+                 std::to_string(max) +
+                 " cards to tribute separated by spaces:");
+      for (const auto &card : cards) {
+        auto spec = card.get_spec(player);
+        specs.push_back(spec);
+        pl->notify(spec + ": " + card.name_);
       }
+    } else {
+      for (int i = 0; i < size; ++i) {
+        dp_ += 4;
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto release_param = read_u8();
 
-      bool has_weight =
-          std::any_of(release_params.begin(), release_params.end(),
-                      [](int i) { return i != 1; });
+        auto spec = ls_to_spec(loc, seq, 0, controller != player);
+        specs.push_back(spec);
 
-      if (min != max) {
-        auto err_str =
-            "min: " + std::to_string(min) + ", max: " + std::to_string(max);
-        throw std::runtime_error(err_str + ", not implemented");
+        release_params.push_back(release_param);
       }
+    }
 
-      std::vector<std::vector<int>> combs;
-      if (has_weight) {
-        combs = combinations_with_weight(release_params, min);
-      } else {
-        combs = combinations(size, min);
-      }
-      for (const auto &comb : combs) {
-        std::string option = "";
-        for (int j = 0; j < min; ++j) {
-          option += specs[comb[j]];
-          if (j < min - 1) {
-            option += " ";
-          }
+    bool has_weight =
+        std::any_of(release_params.begin(), release_params.end(),
+                    [](int i) { return i != 1; });
+
+    if (min != max) {
+      auto err_str =
+          "min: " + std::to_string(min) + ", max: " + std::to_string(max);
+      throw std::runtime_error(err_str + ", not implemented");
+    }
+
+    std::vector<std::vector<int>> combs;
+    if (has_weight) {
+      combs = combinations_with_weight(release_params, min);
+    } else {
+      combs = combinations(size, min);
+    }
+    for (const auto &comb : combs) {
+      std::string option = "";
+      for (int j = 0; j < min; ++j) {
+        option += specs[comb[j]];
+        if (j < min - 1) {
+          option += " ";
         }
-        options_.push_back(option);
       }
+      options_.push_back(option);
+      add_response(comb);
+    }
+  }
 
-      callback_ = [this, combs](int idx) {
-        const auto &comb = combs[idx];
-        resp_buf_[0] = comb.size();
-        for (int i = 0; i < comb.size(); ++i) {
-          resp_buf_[i + 1] = comb[i];
-        }
-        set_responseb(pduel_, resp_buf_);
-      };
-    } else if (msg_ == MSG_SELECT_SUM) {
-      auto mode = read_u8();
-      auto player = read_u8();
-      to_play_ = player;
-      auto val = read_u32();
-      auto min = read_u8();
-      auto max = read_u8();
-      auto must_select_size = read_u8();
-
-      if (mode == 0) {
-        if (must_select_size != 1) {
-          throw std::runtime_error(
-              " must select size: " + std::to_string(must_select_size) +
-              " not implemented for MSG_SELECT_SUM");
-        }
-      } else {
-        throw std::runtime_error("mode: " + std::to_string(mode) +
-                                 " not implemented for MSG_SELECT_SUM");
+  void handle_select_sum() {
+    auto mode = read_u8();
+    auto player = read_u8();
+    to_play_ = player;
+    auto val = read_u32();
+    auto min = read_u8();
+    auto max = read_u8();
+    auto must_select_size = read_u8();
+
+    if (mode == 0) {
+      if (must_select_size != 1) {
+        throw std::runtime_error(
+            " must select size: " + std::to_string(must_select_size) +
+            " not implemented for MSG_SELECT_SUM");
       }
+    } else {
+      throw std::runtime_error("mode: " + std::to_string(mode) +
+                               " not implemented for MSG_SELECT_SUM");
+    }
 
-      std::vector<int> must_select_params;
-      std::vector<std::string> must_select_specs;
-      std::vector<int> select_params;
-      std::vector<std::string> select_specs;
+    std::vector<int> must_select_params;
+    std::vector<std::string> must_select_specs;
+    std::vector<int> select_params;
+    std::vector<std::string> select_specs;
 
-      must_select_params.reserve(must_select_size);
-      must_select_specs.reserve(must_select_size);
+    must_select_params.reserve(must_select_size);
+    must_select_specs.reserve(must_select_size);
 
-      uint32_t expected;
-      if (verbose_) {
-        std::vector<Card> must_select;
-        must_select.reserve(must_select_size);
-        for (int i = 0; i < must_select_size; ++i) {
-          auto code = read_u32();
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto param = read_u32();
-          Card card = get_card(controller, loc, seq);
-          must_select.push_back(card);
-          must_select_params.push_back(param);
-        }
-        expected = val - (must_select_params[0] & 0xff);
-        auto pl = players_[player];
-        pl->notify("Select cards with a total value of " +
-                   std::to_string(expected) + ", seperated by spaces.");
-        for (const auto &card : must_select) {
-          auto spec = card.get_spec(player);
-          must_select_specs.push_back(spec);
-          pl->notify(card.name_ + " (" + spec +
-                     ") must be selected, automatically selected.");
-        }
-      } else {
-        for (int i = 0; i < must_select_size; ++i) {
-          dp_ += 4;
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto param = read_u32();
-
-          auto spec = ls_to_spec(loc, seq, 0, controller != player);
-          must_select_specs.push_back(spec);
-          must_select_params.push_back(param);
-        }
-        expected = val - (must_select_params[0] & 0xff);
+    uint32_t expected;
+    if (verbose_) {
+      std::vector<Card> must_select;
+      must_select.reserve(must_select_size);
+      for (int i = 0; i < must_select_size; ++i) {
+        auto code = read_u32();
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto param = read_u32();
+        Card card = get_card(controller, loc, seq);
+        must_select.push_back(card);
+        must_select_params.push_back(param);
       }
+      expected = val - (must_select_params[0] & 0xff);
+      auto pl = players_[player];
+      pl->notify("Select cards with a total value of " +
+                 std::to_string(expected) + ", seperated by spaces.");
+      for (const auto &card : must_select) {
+        auto spec = card.get_spec(player);
+        must_select_specs.push_back(spec);
+        pl->notify(card.name_ + " (" + spec +
+                   ") must be selected, automatically selected.");
+      }
+    } else {
+      for (int i = 0; i < must_select_size; ++i) {
+        dp_ += 4;
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto param = read_u32();
 
-      uint8_t select_size = read_u8();
-      select_params.reserve(select_size);
-      select_specs.reserve(select_size);
-
-      if (verbose_) {
-        std::vector<Card> select;
-        select.reserve(select_size);
-        for (int i = 0; i < select_size; ++i) {
-          auto code = read_u32();
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto param = read_u32();
-          Card card = get_card(controller, loc, seq);
-          select.push_back(card);
-          select_params.push_back(param);
-        }
-        auto pl = players_[player];
-        for (const auto &card : select) {
-          auto spec = card.get_spec(player);
-          select_specs.push_back(spec);
-          pl->notify(spec + ": " + card.name_);
-        }
-      } else {
-        for (int i = 0; i < select_size; ++i) {
-          dp_ += 4;
-          auto controller = read_u8();
-          auto loc = read_u8();
-          auto seq = read_u8();
-          auto param = read_u32();
-
-          auto spec = ls_to_spec(loc, seq, 0, controller != player);
-          select_specs.push_back(spec);
-          select_params.push_back(param);
-        }
+        auto spec = ls_to_spec(loc, seq, 0, controller != player);
+        must_select_specs.push_back(spec);
+        must_select_params.push_back(param);
       }
+      expected = val - (must_select_params[0] & 0xff);
+    }
+
+    uint8_t select_size = read_u8();
+    select_params.reserve(select_size);
+    select_specs.reserve(select_size);
 
-      std::vector<std::vector<uint32_t>> card_levels;
+    if (verbose_) {
+      std::vector<Card> select;
+      select.reserve(select_size);
       for (int i = 0; i < select_size; ++i) {
-        std::vector<uint32_t> levels;
-        uint32_t level1 = select_params[i] & 0xff;
-        uint32_t level2 = (select_params[i] >> 16);
-        if (level1 > 0) {
-          levels.push_back(level1);
-        }
-        if (level2 > 0) {
-          levels.push_back(level2);
-        }
-        card_levels.push_back(levels);
+        auto code = read_u32();
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto param = read_u32();
+        Card card = get_card(controller, loc, seq);
+        select.push_back(card);
+        select_params.push_back(param);
+      }
+      auto pl = players_[player];
+      for (const auto &card : select) {
+        auto spec = card.get_spec(player);
+        select_specs.push_back(spec);
+        pl->notify(spec + ": " + card.name_);
       }
+    } else {
+      for (int i = 0; i < select_size; ++i) {
+        dp_ += 4;
+        auto controller = read_u8();
+        auto loc = read_u8();
+        auto seq = read_u8();
+        auto param = read_u32();
 
-      std::vector<std::vector<int>> combs =
-          combinations_with_weight2(card_levels, expected);
+        auto spec = ls_to_spec(loc, seq, 0, controller != player);
+        select_specs.push_back(spec);
+        select_params.push_back(param);
+      }
+    }
 
-      for (const auto &comb : combs) {
-        std::string option = "";
-        for (int j = 0; j < min; ++j) {
-          option += select_specs[comb[j]];
-          if (j < min - 1) {
-            option += " ";
-          }
-        }
-        options_.push_back(option);
+    std::vector<std::vector<uint32_t>> card_levels;
+    for (int i = 0; i < select_size; ++i) {
+      std::vector<uint32_t> levels;
+      uint32_t level1 = select_params[i] & 0xff;
+      uint32_t level2 = (select_params[i] >> 16);
+      if (level1 > 0) {
+        levels.push_back(level1);
       }
+      if (level2 > 0) {
+        levels.push_back(level2);
+      }
+      card_levels.push_back(levels);
+    }
 
-      callback_ = [this, combs, must_select_size](int idx) {
-        const auto &comb = combs[idx];
-        resp_buf_[0] = must_select_size + comb.size();
-        for (int i = 0; i < must_select_size; ++i) {
-          resp_buf_[i + 1] = 0;
-        }
-        for (int i = 0; i < comb.size(); ++i) {
-          resp_buf_[i + must_select_size + 1] = comb[i];
+    std::vector<std::vector<int>> combs =
+        combinations_with_weight2(card_levels, expected);
+
+    for (const auto &comb : combs) {
+      std::string option = "";
+      for (int j = 0; j < min; ++j) {
+        option += select_specs[comb[j]];
+        if (j < min - 1) {
+          option += " ";
         }
-        set_responseb(pduel_, resp_buf_);
-      };
+      }
+      options_.push_back(option);
+      add_response(comb, must_select_size);
+    }
+  }
 
-    } else if (msg_ == MSG_SELECT_CHAIN) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto size = read_u8();
-      auto spe_count = read_u8();
-      bool forced = read_u8();
-      dp_ += 8;
-      // auto hint_timing = read_u32();
-      // auto other_timing = read_u32();
+  void handle_select_chain() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto size = read_u8();
+    auto spe_count = read_u8();
+    bool forced = read_u8();
+    dp_ += 8;
+    // auto hint_timing = read_u32();
+    // auto other_timing = read_u32();
 
-      std::vector<Card> cards;
-      std::vector<uint32_t> descs;
-      std::vector<uint32_t> spec_codes;
-      for (int i = 0; i < size; ++i) {
-        auto et = read_u8();
-        CardCode code = read_u32();
-        if (verbose_) {
-          uint32_t loc = read_u32();
-          Card card = c_get_card(code);
-          card.set_location(loc);
-          cards.push_back(card);
-          spec_codes.push_back(card.get_spec_code(player));
-        } else {
-          PlayerId c = read_u8();
-          uint8_t loc = read_u8();
-          uint8_t seq = read_u8();
-          uint8_t pos = read_u8();
-          spec_codes.push_back(ls_to_spec_code(loc, seq, pos, c != player));
-        }
-        uint32_t desc = read_u32();
-        descs.push_back(desc);
+    std::vector<Card> cards;
+    std::vector<uint32_t> descs;
+    std::vector<uint32_t> spec_codes;
+    for (int i = 0; i < size; ++i) {
+      auto et = read_u8();
+      CardCode code = read_u32();
+      if (verbose_) {
+        uint32_t loc = read_u32();
+        Card card = c_get_card(code);
+        card.set_location(loc);
+        cards.push_back(card);
+        spec_codes.push_back(card.get_spec_code(player));
+      } else {
+        PlayerId c = read_u8();
+        uint8_t loc = read_u8();
+        uint8_t seq = read_u8();
+        uint8_t pos = read_u8();
+        spec_codes.push_back(ls_to_spec_code(loc, seq, pos, c != player));
       }
+      uint32_t desc = read_u32();
+      descs.push_back(desc);
+    }
+
+    if ((size == 0) && (spe_count == 0)) {
+      // non-GUI don't need this
+      // if (verbose_) {
+      //   printf("keep processing\n");
+      // }
+      set_responsei(pduel_, -1);
+      return;
+    }
 
-      if ((size == 0) && (spe_count == 0)) {
-        // non-GUI don't need this
-        // if (verbose_) {
-        //   printf("keep processing\n");
-        // }
-        set_responsei(pduel_, -1);
-        return;
+    auto pl = players_[player];
+    auto op = players_[1 - player];
+    chaining_player_ = player;
+    if (!op->seen_waiting_) {
+      if (verbose_) {
+        op->notify("Waiting for opponent.");
       }
+      op->seen_waiting_ = true;
+    }
 
-      auto pl = players_[player];
-      auto op = players_[1 - player];
-      chaining_player_ = player;
-      if (!op->seen_waiting_) {
-        if (verbose_) {
-          op->notify("Waiting for opponent.");
-        }
-        op->seen_waiting_ = true;
+    std::vector<int> chain_index;
+    ankerl::unordered_dense::map<uint32_t, int> chain_counts;
+    ankerl::unordered_dense::map<uint32_t, int> chain_orders;
+    std::vector<std::string> chain_specs;
+    std::vector<std::string> effect_descs;
+    for (int i = 0; i < size; i++) {
+      chain_index.push_back(i);
+      chain_counts[spec_codes[i]] += 1;
+    }
+    for (int i = 0; i < size; i++) {
+      auto spec_code = spec_codes[i];
+      auto cs = code_to_spec(spec_code);
+      auto chain_count = chain_counts[spec_code];
+      if (chain_count > 1) {
+        cs.push_back('a' + chain_orders[spec_code]);
+      }
+      chain_orders[spec_code]++;
+      chain_specs.push_back(cs);
+      if (verbose_) {
+        const auto &card = cards[i];
+        effect_descs.push_back(card.get_effect_description(descs[i], true));
       }
+    }
 
-      std::vector<int> chain_index;
-      ankerl::unordered_dense::map<uint32_t, int> chain_counts;
-      ankerl::unordered_dense::map<uint32_t, int> chain_orders;
-      std::vector<std::string> chain_specs;
-      std::vector<std::string> effect_descs;
-      for (int i = 0; i < size; i++) {
-        chain_index.push_back(i);
-        chain_counts[spec_codes[i]] += 1;
+    if (verbose_) {
+      if (forced) {
+        pl->notify("Select chain:");
+      } else {
+        pl->notify("Select chain (c to cancel):");
       }
       for (int i = 0; i < size; i++) {
-        auto spec_code = spec_codes[i];
-        auto cs = code_to_spec(spec_code);
-        auto chain_count = chain_counts[spec_code];
-        if (chain_count > 1) {
-          cs.push_back('a' + chain_orders[spec_code]);
-        }
-        chain_orders[spec_code]++;
-        chain_specs.push_back(cs);
-        if (verbose_) {
-          const auto &card = cards[i];
-          effect_descs.push_back(card.get_effect_description(descs[i], true));
+        const auto &effect_desc = effect_descs[i];
+        if (effect_desc.empty()) {
+          pl->notify(chain_specs[i] + ": " + cards[i].name_);
+        } else {
+          pl->notify(chain_specs[i] + " (" + cards[i].name_ +
+                     "): " + effect_desc);
         }
       }
+    }
 
-      if (verbose_) {
-        if (forced) {
-          pl->notify("Select chain:");
-        } else {
-          pl->notify("Select chain (c to cancel):");
+    for (int i = 0; i < chain_specs.size(); ++i) {
+      options_.push_back(chain_specs[i]);
+      add_response(i);
+    }
+    if (!forced) {
+      options_.push_back("c");
+      add_response(-1);
+    }
+  }
+
+  void handle_select_yesno() {
+    auto player = read_u8();
+    to_play_ = player;
+
+    if (verbose_) {
+      auto desc = read_u32();
+      auto pl = players_[player];
+      std::string opt;
+      if (desc > 10000) {
+        auto code = desc >> 4;
+        auto card = c_get_card(code);
+        auto opt_idx = desc & 0xf;
+        if (opt_idx < card.strings_.size()) {
+          opt = card.strings_[opt_idx];
         }
-        for (int i = 0; i < size; i++) {
-          const auto &effect_desc = effect_descs[i];
-          if (effect_desc.empty()) {
-            pl->notify(chain_specs[i] + ": " + cards[i].name_);
-          } else {
-            pl->notify(chain_specs[i] + " (" + cards[i].name_ +
-                       "): " + effect_desc);
-          }
+        if (opt.empty()) {
+          opt = "Unknown question from " + card.name_ + ". Yes or no?";
         }
+      } else {
+        opt = get_system_string(desc);
       }
+      pl->notify(opt);
+      pl->notify("Please enter y or n.");
+    } else {
+      dp_ += 4;
+    }
+    options_.push_back("y");
+    options_.push_back("n");
+    add_response(1);
+    add_response(0);
+  }
 
-      for (const auto &spec : chain_specs) {
-        options_.push_back(spec);
-      }
-      if (!forced) {
-        options_.push_back("c");
-      }
-      callback_ = [this, forced](int idx) {
-        const auto &option = options_[idx];
-        if ((option == "c") && (!forced)) {
-          set_responsei(pduel_, -1);
-          return;
-        }
-        set_responsei(pduel_, idx);
-      };
-    } else if (msg_ == MSG_SELECT_YESNO) {
-      auto player = read_u8();
-      to_play_ = player;
+  void handle_select_effectyn() {
+    auto player = read_u8();
+    to_play_ = player;
 
-      if (verbose_) {
-        auto desc = read_u32();
-        auto pl = players_[player];
-        std::string opt;
-        if (desc > 10000) {
-          auto code = desc >> 4;
-          auto card = c_get_card(code);
-          auto opt_idx = desc & 0xf;
-          if (opt_idx < card.strings_.size()) {
-            opt = card.strings_[opt_idx];
-          }
-          if (opt.empty()) {
-            opt = "Unknown question from " + card.name_ + ". Yes or no?";
-          }
+    std::string spec;
+    if (verbose_) {
+      CardCode code = read_u32();
+      uint32_t loc = read_u32();
+      Card card = c_get_card(code);
+      card.set_location(loc);
+      auto desc = read_u32();
+      auto pl = players_[player];
+      spec = card.get_spec(player);
+      auto name = card.name_;
+      std::string s;
+      if (desc == 0) {
+        // From [%ls], activate [%ls]?
+        s = "From " + card.get_spec(player) + ", activate " + name + "?";
+      } else if (desc < 2048) {
+        s = get_system_string(desc);
+        std::string fmt_str = "[%ls]";
+        auto pos = find_substrs(s, fmt_str);
+        if (pos.size() == 0) {
+          // nothing to replace
+        } else if (pos.size() == 1) {
+          auto p = pos[0];
+          s = s.substr(0, p) + name + s.substr(p + fmt_str.size());
+        } else if (pos.size() == 2) {
+          auto p1 = pos[0];
+          auto p2 = pos[1];
+          s = s.substr(0, p1) + card.get_spec(player) +
+              s.substr(p1 + fmt_str.size(), p2 - p1 - fmt_str.size()) + name +
+              s.substr(p2 + fmt_str.size());
         } else {
-          opt = get_system_string(desc);
+          throw std::runtime_error("Unknown effectyn desc " +
+                                   std::to_string(desc) + " of " + name);
         }
-        pl->notify(opt);
-        pl->notify("Please enter y or n.");
       } else {
-        dp_ += 4;
+        throw std::runtime_error("Unknown effectyn desc " +
+                                 std::to_string(desc) + " of " + name);
       }
-      options_ = {"y", "n"};
-      callback_ = [this](int idx) {
-        if (idx == 0) {
-          set_responsei(pduel_, 1);
-        } else if (idx == 1) {
-          set_responsei(pduel_, 0);
-        } else {
-          throw std::runtime_error("Invalid option");
-        }
-      };
-    } else if (msg_ == MSG_SELECT_EFFECTYN) {
-      auto player = read_u8();
-      to_play_ = player;
+      pl->notify(s);
+      pl->notify("Please enter y or n.");
+    } else {
+      dp_ += 4;
+      auto c = read_u8();
+      auto loc = read_u8();
+      auto seq = read_u8();
+      auto pos = read_u8();
+      dp_ += 4;
+      spec = ls_to_spec(loc, seq, pos, c != player);
+    }
+    options_.push_back("y " + spec);
+    options_.push_back("n " + spec);
+    add_response(1);
+    add_response(0);
+  }
 
-      std::string spec;
-      if (verbose_) {
-        CardCode code = read_u32();
-        uint32_t loc = read_u32();
-        Card card = c_get_card(code);
-        card.set_location(loc);
-        auto desc = read_u32();
-        auto pl = players_[player];
-        spec = card.get_spec(player);
-        auto name = card.name_;
+  void handle_select_option() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto size = read_u8();
+    if (verbose_) {
+      auto pl = players_[player];
+      pl->notify("Select an option:");
+      for (int i = 0; i < size; ++i) {
+        auto opt = read_u32();
         std::string s;
-        if (desc == 0) {
-          // From [%ls], activate [%ls]?
-          s = "From " + card.get_spec(player) + ", activate " + name + "?";
-        } else if (desc < 2048) {
-          s = get_system_string(desc);
-          std::string fmt_str = "[%ls]";
-          auto pos = find_substrs(s, fmt_str);
-          if (pos.size() == 0) {
-            // nothing to replace
-          } else if (pos.size() == 1) {
-            auto p = pos[0];
-            s = s.substr(0, p) + name + s.substr(p + fmt_str.size());
-          } else if (pos.size() == 2) {
-            auto p1 = pos[0];
-            auto p2 = pos[1];
-            s = s.substr(0, p1) + card.get_spec(player) +
-                s.substr(p1 + fmt_str.size(), p2 - p1 - fmt_str.size()) + name +
-                s.substr(p2 + fmt_str.size());
-          } else {
-            throw std::runtime_error("Unknown effectyn desc " +
-                                     std::to_string(desc) + " of " + name);
-          }
+        if (opt > 10000) {
+          CardCode code = opt >> 4;
+          s = c_get_card(code).strings_[opt & 0xf];
         } else {
-          throw std::runtime_error("Unknown effectyn desc " +
-                                   std::to_string(desc) + " of " + name);
+          s = get_system_string(opt);
         }
-        pl->notify(s);
-        pl->notify("Please enter y or n.");
-      } else {
-        dp_ += 4;
-        auto c = read_u8();
-        auto loc = read_u8();
-        auto seq = read_u8();
-        auto pos = read_u8();
+        std::string option = std::to_string(i + 1);
+        options_.push_back(option);
+        add_response(i);
+        pl->notify(option + ": " + s);
+      }
+    } else {
+      for (int i = 0; i < size; ++i) {
         dp_ += 4;
-        spec = ls_to_spec(loc, seq, pos, c != player);
-      }
-      options_ = {"y " + spec, "n " + spec};
-      callback_ = [this](int idx) {
-        if (idx == 0) {
-          set_responsei(pduel_, 1);
-        } else if (idx == 1) {
-          set_responsei(pduel_, 0);
-        } else {
-          throw std::runtime_error("Invalid option");
-        }
-      };
-    } else if (msg_ == MSG_SELECT_OPTION) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto size = read_u8();
-      if (verbose_) {
-        auto pl = players_[player];
-        pl->notify("Select an option:");
-        for (int i = 0; i < size; ++i) {
-          auto opt = read_u32();
-          std::string s;
-          if (opt > 10000) {
-            CardCode code = opt >> 4;
-            s = c_get_card(code).strings_[opt & 0xf];
-          } else {
-            s = get_system_string(opt);
-          }
-          std::string option = std::to_string(i + 1);
-          options_.push_back(option);
-          pl->notify(option + ": " + s);
-        }
-      } else {
-        for (int i = 0; i < size; ++i) {
-          dp_ += 4;
-          options_.push_back(std::to_string(i + 1));
-        }
+        options_.push_back(std::to_string(i + 1));
+        add_response(i);
       }
-      callback_ = [this](int idx) {
-        if (verbose_) {
-          players_[to_play_]->notify("You selected option " + options_[idx] +
-                                     ".");
-          players_[1 - to_play_]->notify(players_[to_play_]->nickname_ +
-                                         " selected option " + options_[idx] +
-                                         ".");
-        }
-
-        set_responsei(pduel_, idx);
-      };
-    } else if (msg_ == MSG_SELECT_IDLECMD) {
-      int32_t player = read_u8();
-      to_play_ = player;
-      auto summonable_ = read_cardlist_spec();
-      auto spsummon_ = read_cardlist_spec();
-      auto repos_ = read_cardlist_spec();
-      auto idle_mset_ = read_cardlist_spec();
-      auto idle_set_ = read_cardlist_spec();
-      auto idle_activate_ = read_cardlist_spec(true);
-      bool to_bp_ = read_u8();
-      bool to_ep_ = read_u8();
-      read_u8(); // can_shuffle
-
-      int offset = 0;
+    }
+  }
 
-      auto pl = players_[player];
+  void handle_select_idlecmd() {
+    int32_t player = read_u8();
+    to_play_ = player;
+    auto summonable_ = read_cardlist_spec();
+    auto spsummon_ = read_cardlist_spec();
+    auto repos_ = read_cardlist_spec();
+    auto idle_mset_ = read_cardlist_spec();
+    auto idle_set_ = read_cardlist_spec();
+    auto idle_activate_ = read_cardlist_spec(true);
+    bool to_bp_ = read_u8();
+    bool to_ep_ = read_u8();
+    read_u8(); // can_shuffle
+
+    auto pl = players_[player];
+    if (verbose_) {
+      pl->notify("Select a card and action to perform.");
+    }
+    for (const auto &[code, spec, data] : summonable_) {
+      std::string option = "s " + spec;
+      options_.push_back(option);
       if (verbose_) {
-        pl->notify("Select a card and action to perform.");
+        const auto &name = c_get_card(code).name_;
+        pl->notify(option + ": Summon " + name +
+                   " in face-up attack position.");
       }
-      for (const auto &[code, spec, data] : summonable_) {
-        std::string option = "s " + spec;
-        options_.push_back(option);
-        if (verbose_) {
-          const auto &name = c_get_card(code).name_;
-          pl->notify(option + ": Summon " + name +
-                     " in face-up attack position.");
-        }
-      }
-      offset += summonable_.size();
-      int spsummon_offset = offset;
-      for (const auto &[code, spec, data] : spsummon_) {
-        std::string option = "c " + spec;
-        options_.push_back(option);
-        if (verbose_) {
-          const auto &name = c_get_card(code).name_;
-          pl->notify(option + ": Special summon " + name + ".");
-        }
+    }
+    for (int i = 0; i < summonable_.size(); ++i) {
+      add_response(i << 16);
+    }
+    for (const auto &[code, spec, data] : spsummon_) {
+      std::string option = "c " + spec;
+      options_.push_back(option);
+      if (verbose_) {
+        const auto &name = c_get_card(code).name_;
+        pl->notify(option + ": Special summon " + name + ".");
       }
-      offset += spsummon_.size();
-      int repos_offset = offset;
-      for (const auto &[code, spec, data] : repos_) {
-        std::string option = "r " + spec;
-        options_.push_back(option);
-        if (verbose_) {
-          const auto &name = c_get_card(code).name_;
-          pl->notify(option + ": Reposition " + name + ".");
-        }
+    }
+    for (int i = 0; i < spsummon_.size(); ++i) {
+      add_response((i << 16) + 1);
+    }
+    for (const auto &[code, spec, data] : repos_) {
+      std::string option = "r " + spec;
+      options_.push_back(option);
+      if (verbose_) {
+        const auto &name = c_get_card(code).name_;
+        pl->notify(option + ": Reposition " + name + ".");
       }
-      offset += repos_.size();
-      int mset_offset = offset;
-      for (const auto &[code, spec, data] : idle_mset_) {
-        std::string option = "m " + spec;
-        options_.push_back(option);
-        if (verbose_) {
-          const auto &name = c_get_card(code).name_;
-          pl->notify(option + ": Summon " + name +
-                     " in face-down defense position.");
-        }
+    }
+    for (int i = 0; i < repos_.size(); ++i) {
+      add_response((i << 16) + 2);
+    }
+    for (const auto &[code, spec, data] : idle_mset_) {
+      std::string option = "m " + spec;
+      options_.push_back(option);
+      if (verbose_) {
+        const auto &name = c_get_card(code).name_;
+        pl->notify(option + ": Summon " + name +
+                   " in face-down defense position.");
       }
-      offset += idle_mset_.size();
-      int set_offset = offset;
-      for (const auto &[code, spec, data] : idle_set_) {
-        std::string option = "t " + spec;
-        options_.push_back(option);
-        if (verbose_) {
-          const auto &name = c_get_card(code).name_;
-          pl->notify(option + ": Set " + name + ".");
-        }
+    }
+    for (int i = 0; i < idle_mset_.size(); ++i) {
+      add_response((i << 16) + 3);
+    }
+    for (const auto &[code, spec, data] : idle_set_) {
+      std::string option = "t " + spec;
+      options_.push_back(option);
+      if (verbose_) {
+        const auto &name = c_get_card(code).name_;
+        pl->notify(option + ": Set " + name + ".");
       }
-      offset += idle_set_.size();
-      int activate_offset = offset;
-      ankerl::unordered_dense::map<std::string, int> idle_activate_count;
-      for (const auto &[code, spec, data] : idle_activate_) {
-        idle_activate_count[spec] += 1;
-      }
-      ankerl::unordered_dense::map<std::string, int> activate_count;
-      for (const auto &[code, spec, data] : idle_activate_) {
-        std::string option = "v " + spec;
-        int count = idle_activate_count[spec];
-        activate_count[spec]++;
-        if (count > 1) {
-          option.push_back('a' + activate_count[spec] - 1);
-        }
-        options_.push_back(option);
-        if (verbose_) {
-          pl->notify(option + ": " +
-                     c_get_card(code).get_effect_description(data));
-        }
+    }
+    for (int i = 0; i < idle_set_.size(); ++i) {
+      add_response((i << 16) + 4);
+    }
+    ankerl::unordered_dense::map<std::string, int> idle_activate_count;
+    for (const auto &[code, spec, data] : idle_activate_) {
+      idle_activate_count[spec] += 1;
+    }
+    ankerl::unordered_dense::map<std::string, int> activate_count;
+    for (const auto &[code, spec, data] : idle_activate_) {
+      std::string option = "v " + spec;
+      int count = idle_activate_count[spec];
+      activate_count[spec]++;
+      if (count > 1) {
+        option.push_back('a' + activate_count[spec] - 1);
+      }
+      options_.push_back(option);
+      if (verbose_) {
+        pl->notify(option + ": " +
+                   c_get_card(code).get_effect_description(data));
       }
+    }
+    for (int i = 0; i < idle_activate_.size(); ++i) {
+      add_response((i << 16) + 5);
+    }
 
-      if (to_bp_) {
-        std::string cmd = "b";
+    if (to_bp_) {
+      std::string cmd = "b";
+      options_.push_back(cmd);
+      add_response(6);
+      if (verbose_) {
+        pl->notify(cmd + ": Enter the battle phase.");
+      }
+    }
+    if (to_ep_) {
+      if (!to_bp_) {
+        std::string cmd = "e";
         options_.push_back(cmd);
+        add_response(7);
         if (verbose_) {
-          pl->notify(cmd + ": Enter the battle phase.");
-        }
-      }
-      if (to_ep_) {
-        if (!to_bp_) {
-          std::string cmd = "e";
-          options_.push_back(cmd);
-          if (verbose_) {
-            pl->notify(cmd + ": End phase.");
-          }
+          pl->notify(cmd + ": End phase.");
         }
       }
-      callback_ = [this, spsummon_offset, repos_offset, mset_offset, set_offset,
-                   activate_offset](int idx) {
-        const auto &option = options_[idx];
-        char cmd = option[0];
-        if (cmd == 'b') {
-          set_responsei(pduel_, 6);
-        } else if (cmd == 'e') {
-          set_responsei(pduel_, 7);
-        } else {
-          auto spec = option.substr(2);
-          if (cmd == 's') {
-            uint32_t idx_ = idx;
-            set_responsei(pduel_, idx_ << 16);
-          } else if (cmd == 'c') {
-            uint32_t idx_ = idx - spsummon_offset;
-            set_responsei(pduel_, (idx_ << 16) + 1);
-          } else if (cmd == 'r') {
-            uint32_t idx_ = idx - repos_offset;
-            set_responsei(pduel_, (idx_ << 16) + 2);
-          } else if (cmd == 'm') {
-            uint32_t idx_ = idx - mset_offset;
-            set_responsei(pduel_, (idx_ << 16) + 3);
-          } else if (cmd == 't') {
-            uint32_t idx_ = idx - set_offset;
-            set_responsei(pduel_, (idx_ << 16) + 4);
-          } else if (cmd == 'v') {
-            uint32_t idx_ = idx - activate_offset;
-            set_responsei(pduel_, (idx_ << 16) + 5);
-          } else {
-            throw std::runtime_error("Invalid option: " + option);
-          }
-        }
-      };
-    } else if (msg_ == MSG_SELECT_PLACE) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto count = read_u8();
-      if (count == 0) {
-        count = 1;
-      }
-      auto flag = read_u32();
-      options_ = flag_to_usable_cardspecs(flag);
-      if (verbose_) {
-        std::string specs_str = options_[0];
-        for (int i = 1; i < options_.size(); ++i) {
-          specs_str += ", " + options_[i];
-        }
-        if (count == 1) {
-          players_[player]->notify("Select place for card, one of " +
-                                   specs_str + ".");
-        } else {
-          players_[player]->notify("Select " + std::to_string(count) +
-                                   " places for card, from " + specs_str + ".");
-        }
-      }
-      callback_ = [this, player](int idx) {
-        int y = player + 1;
-        std::string spec = options_[idx];
-        auto plr = player;
-        if (spec[0] == 'o') {
-          plr = 1 - player;
-          spec = spec.substr(1);
-        }
-        auto [loc, seq, pos] = spec_to_ls(spec);
-        resp_buf_[0] = plr;
-        resp_buf_[1] = loc;
-        resp_buf_[2] = seq;
-        set_responseb(pduel_, resp_buf_);
-      };
-    } else if (msg_ == MSG_SELECT_DISFIELD) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto count = read_u8();
-      if (count == 0) {
-        count = 1;
-      }
-      auto flag = read_u32();
-      options_ = flag_to_usable_cardspecs(flag);
-      if (verbose_) {
-        std::string specs_str = options_[0];
-        for (int i = 1; i < options_.size(); ++i) {
-          specs_str += ", " + options_[i];
-        }
-        if (count == 1) {
-          players_[player]->notify("Select place for card, one of " +
-                                   specs_str + ".");
-        } else {
-          throw std::runtime_error("Select disfield count " +
-                                   std::to_string(count) + " not implemented");
-          // players_[player]->notify("Select " + std::to_string(count) +
-          //                          " places for card, from " + specs_str +
-          //                          ".");
-        }
+    }
+  }
+
+  // responses of the places in options_, which are specs of the player's zones
+  // or prefixed with 'o' for the opponent's zones
+  void add_place_responses(PlayerId player) {
+    for (const auto &option : options_) {
+      std::string spec = option;
+      auto plr = player;
+      if (spec[0] == 'o') {
+        plr = 1 - player;
+        spec = spec.substr(1);
+      }
+      auto [loc, seq, pos] = spec_to_ls(spec);
+      add_response({plr, loc, seq});
+    }
+  }
+
+  void handle_select_place() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto count = read_u8();
+    if (count == 0) {
+      count = 1;
+    }
+    auto flag = read_u32();
+    options_ = flag_to_usable_cardspecs(flag);
+    if (verbose_) {
+      std::string specs_str = options_[0];
+      for (int i = 1; i < options_.size(); ++i) {
+        specs_str += ", " + options_[i];
       }
-      callback_ = [this, player](int idx) {
-        int y = player + 1;
-        std::string spec = options_[idx];
-        auto plr = player;
-        if (spec[0] == 'o') {
-          plr = 1 - player;
-          spec = spec.substr(1);
-        }
-        auto [loc, seq, pos] = spec_to_ls(spec);
-        resp_buf_[0] = plr;
-        resp_buf_[1] = loc;
-        resp_buf_[2] = seq;
-        set_responseb(pduel_, resp_buf_);
-      };
-    } else if (msg_ == MSG_ANNOUNCE_ATTRIB) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto count = read_u8();
-      auto flag = read_u32();
-
-      int n_attrs = 7;
-
-      std::vector<uint8_t> attrs;
-      for (int i = 0; i < n_attrs; i++) {
-        if (flag & (1 << i)) {
-          attrs.push_back(i + 1);
-        }
+      if (count == 1) {
+        players_[player]->notify("Select place for card, one of " +
+                                 specs_str + ".");
+      } else {
+        players_[player]->notify("Select " + std::to_string(count) +
+                                 " places for card, from " + specs_str + ".");
       }
+    }
+    add_place_responses(player);
+  }
 
-      if (count != 1) {
-        throw std::runtime_error("Announce attrib count " +
+  void handle_select_disfield() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto count = read_u8();
+    if (count == 0) {
+      count = 1;
+    }
+    auto flag = read_u32();
+    options_ = flag_to_usable_cardspecs(flag);
+    if (verbose_) {
+      std::string specs_str = options_[0];
+      for (int i = 1; i < options_.size(); ++i) {
+        specs_str += ", " + options_[i];
+      }
+      if (count == 1) {
+        players_[player]->notify("Select place for card, one of " +
+                                 specs_str + ".");
+      } else {
+        throw std::runtime_error("Select disfield count " +
                                  std::to_string(count) + " not implemented");
+        // players_[player]->notify("Select " + std::to_string(count) +
+        //                          " places for card, from " + specs_str +
+        //                          ".");
       }
+    }
+    add_place_responses(player);
+  }
 
-      if (verbose_) {
-        auto pl = players_[player];
-        pl->notify("Select " + std::to_string(count) +
-                   " attributes separated by spaces:");
-        for (int i = 0; i < attrs.size(); i++) {
-          pl->notify(std::to_string(attrs[i]) + ": " +
-                     attribute2str.at(1 << (attrs[i] - 1)));
-        }
+  void handle_announce_attrib() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto count = read_u8();
+    auto flag = read_u32();
+
+    int n_attrs = 7;
+
+    std::vector<uint8_t> attrs;
+    for (int i = 0; i < n_attrs; i++) {
+      if (flag & (1 << i)) {
+        attrs.push_back(i + 1);
       }
+    }
 
-      auto combs = combinations(attrs.size(), count);
-      for (const auto &comb : combs) {
-        std::string option = "";
-        for (int j = 0; j < count; ++j) {
-          option += std::to_string(attrs[comb[j]]);
-          if (j < count - 1) {
-            option += " ";
-          }
-        }
-        options_.push_back(option);
+    if (count != 1) {
+      throw std::runtime_error("Announce attrib count " +
+                               std::to_string(count) + " not implemented");
+    }
+
+    if (verbose_) {
+      auto pl = players_[player];
+      pl->notify("Select " + std::to_string(count) +
+                 " attributes separated by spaces:");
+      for (int i = 0; i < attrs.size(); i++) {
+        pl->notify(std::to_string(attrs[i]) + ": " +
+                   attribute2str.at(1 << (attrs[i] - 1)));
       }
+    }
 
-      callback_ = [this](int idx) {
-        const auto &option = options_[idx];
-        uint32_t resp = 0;
-        int i = 0;
-        while (i < option.size()) {
-          resp |= 1 << (option[i] - '1');
-          i += 2;
+    auto combs = combinations(attrs.size(), count);
+    for (const auto &comb : combs) {
+      std::string option = "";
+      for (int j = 0; j < count; ++j) {
+        option += std::to_string(attrs[comb[j]]);
+        if (j < count - 1) {
+          option += " ";
         }
-        set_responsei(pduel_, resp);
-      };
+      }
+      options_.push_back(option);
+      uint32_t resp = 0;
+      for (int j = 0; j < count; ++j) {
+        resp |= 1 << (attrs[comb[j]] - 1);
+      }
+      add_response(resp);
+    }
+  }
 
-    } else if (msg_ == MSG_SELECT_POSITION) {
-      auto player = read_u8();
-      to_play_ = player;
-      auto code = read_u32();
-      auto valid_pos = read_u8();
+  void handle_select_position() {
+    auto player = read_u8();
+    to_play_ = player;
+    auto code = read_u32();
+    auto valid_pos = read_u8();
 
-      if (verbose_) {
-        auto pl = players_[player];
-        auto card = c_get_card(code);
-        pl->notify("Select position for " + card.name_ + ":");
-      }
+    if (verbose_) {
+      auto pl = players_[player];
+      auto card = c_get_card(code);
+      pl->notify("Select position for " + card.name_ + ":");
+    }
 
-      std::vector<uint8_t> positions;
-      int i = 1;
-      for (auto pos : {POS_FACEUP_ATTACK, POS_FACEDOWN_ATTACK,
-                       POS_FACEUP_DEFENSE, POS_FACEDOWN_DEFENSE}) {
-        if (valid_pos & pos) {
-          positions.push_back(pos);
-          options_.push_back(std::to_string(i));
-          if (verbose_) {
-            auto pl = players_[player];
-            pl->notify(std::to_string(i) + ": " + position_to_string(pos));
-          }
+    std::vector<uint8_t> positions;
+    int i = 1;
+    for (auto pos : {POS_FACEUP_ATTACK, POS_FACEDOWN_ATTACK,
+                     POS_FACEUP_DEFENSE, POS_FACEDOWN_DEFENSE}) {
+      if (valid_pos & pos) {
+        positions.push_back(pos);
+        options_.push_back(std::to_string(i));
+        add_response(pos);
+        if (verbose_) {
+          auto pl = players_[player];
+          pl->notify(std::to_string(i) + ": " + position_to_string(pos));
         }
-        i++;
       }
-
-      callback_ = [this](int idx) {
-        uint8_t pos = options_[idx][0] - '1';
-        set_responsei(pduel_, 1 << pos);
-      };
-    } else {
-      auto err_msg = "Unknown message " + msg_to_string(msg_) + ", length " +
-                     std::to_string(dl_) + ", dp " + std::to_string(dp_);
-      throw std::runtime_error(err_msg);
+      i++;
     }
   }
 
@@ -3935,6 +4788,105 @@ private:
 
 using YGOProEnvPool = AsyncEnvPool<YGOProEnv>;
 
+// Plays `num_games` duels for every ordered pair of `decks` between two
+// built-in players on `num_threads` threads, without going through the env
+// pool. All duels use the card registry named `registry` as it is when the
+// arena starts. Returns the win rates of the first player and the average
+// number of turns, both indexed by [deck of the first player][deck of the
+// second player], and the average time in seconds of the duels each deck
+// played.
+static std::tuple<std::vector<std::vector<double>>,
+                  std::vector<std::vector<double>>, std::vector<double>>
+arena(const std::vector<std::string> &decks, int num_games,
+      const std::string &player0, const std::string &player1,
+      int num_threads = 0, uint64_t seed = 0,
+      const std::string &registry = "") {
+  if (num_games < 1) {
+    throw std::invalid_argument("num_games must be at least 1");
+  }
+  auto reg = load_registry(registry);
+  for (const auto &deck : decks) {
+    if (reg->main_decks.find(deck) == reg->main_decks.end()) {
+      throw std::invalid_argument("Unknown deck: " + deck);
+    }
+  }
+  for (const auto &player : {player0, player1}) {
+    if ((player != "greedy") && (player != "random")) {
+      throw std::invalid_argument("Unknown arena player: " + player);
+    }
+  }
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  int n = decks.size();
+  std::size_t num_duels = std::size_t(n) * n * num_games;
+  std::vector<std::vector<double>> wins(n, std::vector<double>(n));
+  std::vector<std::vector<double>> turns(n, std::vector<double>(n));
+  std::vector<double> times(n);
+  std::mutex mtx;
+  std::exception_ptr error;
+  std::atomic<std::size_t> next_duel{0};
+
+  auto config = YGOProEnvSpec::kDefaultConfig;
+  config["play_mode"_] = std::string("bot");
+  auto spec = std::make_shared<const YGOProEnvSpec>(config);
+  auto worker = [&](int thread_id) {
+    YGOProEnv env(spec, thread_id);
+    std::vector<std::vector<double>> t_wins(n, std::vector<double>(n));
+    std::vector<std::vector<double>> t_turns(n, std::vector<double>(n));
+    std::vector<double> t_times(n);
+    try {
+      for (std::size_t k = next_duel++; k < num_duels; k = next_duel++) {
+        // every duel has its own seed, so results don't depend on scheduling
+        int i = k / num_games / n;
+        int j = k / num_games % n;
+        auto start = std::chrono::steady_clock::now();
+        auto winner = env.play_arena_duel(reg, decks[i], decks[j], player0,
+                                          player1, seed + k);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        t_wins[i][j] += winner == 0;
+        t_turns[i][j] += env.turn_count();
+        t_times[i] += elapsed.count();
+        t_times[j] += elapsed.count();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mtx);
+      error = std::current_exception();
+      next_duel = num_duels;
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < n; ++j) {
+        wins[i][j] += t_wins[i][j];
+        turns[i][j] += t_turns[i][j];
+      }
+      times[i] += t_times[i];
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; ++t) {
+    workers.emplace_back(worker, t);
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      wins[i][j] /= num_games;
+      turns[i][j] /= num_games;
+    }
+    // each deck plays 2 * n * num_games duels, including mirror matches
+    times[i] /= 2.0 * n * num_games;
+  }
+  return {wins, turns, times};
+}
+
 } // namespace ygopro
 
 #endif // ENVPOOL_YGOPRO_YGOPRO_H_
@@ -0,0 +1,90 @@
+// Serves a YGOPro env pool to RemoteEnvPool clients, e.g.
+//
+//   ygopro_server 0.0.0.0:7700 --db cards.cdb --code-list code_list.txt
+//     --deck Main=main.ydk --compress obs:cards_ num_envs=64 batch_size=32
+//
+// Every connection gets a fresh pool built from the key=value config.
+
+#include <pthread.h>
+
+#include <csignal>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "envpool2/core/remote_envpool.h"
+#include "envpool2/ygopro/ygopro.h"
+
+using Server = RemoteEnvPoolServer<ygopro::YGOProEnvPool>;
+
+static void Usage(const char *prog) {
+  std::cerr << "usage: " << prog
+            << " ADDRESS --db PATH --code-list PATH --deck NAME=PATH..."
+               " [--compress KEY]... [CONFIG_KEY=VALUE]...\n"
+               "ADDRESS is host:port or unix:PATH\n";
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    Usage(argv[0]);
+    return 1;
+  }
+  std::string address = argv[1];
+  std::string db_path, code_list;
+  std::map<std::string, std::string> decks;
+  std::vector<std::string> compress_keys;
+  auto config = ygopro::YGOProEnvSpec::kDefaultConfig;
+  try {
+    for (int i = 2; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool has_value = i + 1 < argc;
+      if (arg == "--db" && has_value) {
+        db_path = argv[++i];
+      } else if (arg == "--code-list" && has_value) {
+        code_list = argv[++i];
+      } else if (arg == "--deck" && has_value) {
+        std::string deck = argv[++i];
+        auto eq = deck.find('=');
+        if (eq == std::string::npos) {
+          throw std::invalid_argument("--deck expects NAME=PATH");
+        }
+        decks[deck.substr(0, eq)] = deck.substr(eq + 1);
+      } else if (arg == "--compress" && has_value) {
+        compress_keys.emplace_back(argv[++i]);
+      } else if (arg.find('=') != std::string::npos && arg[0] != '-') {
+        auto eq = arg.find('=');
+        remote::SetConfig(&config, arg.substr(0, eq), arg.substr(eq + 1));
+      } else {
+        throw std::invalid_argument("Unknown argument " + arg);
+      }
+    }
+    if (db_path.empty() || code_list.empty() || decks.empty()) {
+      throw std::invalid_argument("--db, --code-list and --deck are required");
+    }
+    ygopro::init_module(db_path, code_list, decks);
+    // stop on SIGINT / SIGTERM, handled by a thread since Stop takes a lock
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    Server s(ygopro::YGOProEnvSpec(config), address, compress_keys);
+    std::thread([&s, signals] {
+      int sig;
+      sigwait(&signals, &sig);
+      s.Stop();
+    }).detach();
+    std::cerr << "serving on " << address << std::endl;
+    s.Serve();
+  } catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << "\n";
+    Usage(argv[0]);
+    return 1;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}